@@ -0,0 +1,65 @@
+#include "bench.hh"
+#include <algorithm>
+#include <numeric>
+#include <cmath>
+
+float bench_time(int frame) {
+  return frame / 60.f;
+}
+
+double bench_series::min() const {
+  return ms.empty() ? 0 : *std::min_element(ms.begin(), ms.end());
+}
+
+double bench_series::mean() const {
+  return ms.empty() ? 0 : std::accumulate(ms.begin(), ms.end(), 0.) / ms.size();
+}
+
+// nearest-rank percentile, p in [0, 100]
+double bench_series::percentile(double p) const {
+  if (ms.empty())
+    return 0;
+  std::vector<double> sorted = ms;
+  std::sort(sorted.begin(), sorted.end());
+  size_t rank = ceil(p / 100. * sorted.size());
+  return sorted[std::min(std::max<size_t>(rank, 1), sorted.size()) - 1];
+}
+
+static void write_series(FILE *f, const char *name, const bench_series &s) {
+  fprintf(f, "  \"%s\": {\"min\": %.4f, \"mean\": %.4f, \"median\": %.4f"
+      ", \"p95\": %.4f, \"p99\": %.4f},\n", name, s.min(), s.mean()
+      , s.percentile(50), s.percentile(95), s.percentile(99));
+}
+
+static std::string escape(const std::string &s) {
+  std::string out;
+  for (char c : s) {
+    if (c == '"' || c == '\\')
+      out += '\\';
+    out += c;
+  }
+  return out;
+}
+
+void bench_report::write_json(FILE *f) const {
+  fprintf(f, "{\n");
+  fprintf(f, "  \"backend\": \"%s\",\n", escape(backend).c_str());
+  fprintf(f, "  \"renderer\": \"%s\",\n", escape(renderer).c_str());
+  fprintf(f, "  \"width\": %d,\n  \"height\": %d,\n", width, height);
+  fprintf(f, "  \"frames\": %zu,\n", frame.ms.size());
+  write_series(f, "frame_ms", frame);
+  if (!gpu.ms.empty())
+    write_series(f, "gpu_ms", gpu);
+  if (!counters.empty()) {
+    fprintf(f, "  \"counters\": {");
+    for (size_t i = 0; i < counters.size(); i++)
+      fprintf(f, "%s\"%s\": %.4f", i ? ", " : "", escape(counters[i].first)
+          .c_str(), counters[i].second);
+    fprintf(f, "},\n");
+  }
+  const double median = frame.percentile(50);
+  fprintf(f, "  \"rays_per_sec\": %.0f\n", median > 0
+      ? (double)width * height / (median / 1000.) : 0.);
+  fprintf(f, "}\n");
+}
+
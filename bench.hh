@@ -0,0 +1,29 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <utility>
+#include <cstdio>
+
+// frames rendered by --bench all see the same iGlobalTime sequence, which
+// moves the camera along its orbit at a fixed 60 steps per second
+float bench_time(int frame);
+
+struct bench_series {
+  std::vector<double> ms;
+  double min() const;
+  double mean() const;
+  double percentile(double p) const;
+};
+
+// collected by --bench and written out as json so that runs can be compared
+// by a script
+struct bench_report {
+  std::string backend, renderer;
+  int width, height;
+  bench_series frame, gpu;
+  // extra numbers of the run, written out as they are
+  std::vector<std::pair<std::string, double>> counters;
+  void write_json(FILE *f) const;
+};
+
@@ -0,0 +1,182 @@
+#include "brush.hh"
+#include "generator.hh"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+// how far a voxel center can be from the center of its brick. sd_sphere()
+// and sd_box() are exact distances, so they cannot change by more than that
+// across a brick
+static const float brick_radius = 1.7321f * (brick_size - 1) * 0.5f;
+
+static float distance(const brush &b, float px, float py, float pz) {
+  px -= b.x;
+  py -= b.y;
+  pz -= b.z;
+  return b.shape == brush_sphere ? sd_sphere(px, py, pz, b.sx)
+    : sd_box(px, py, pz, b.sx, b.sy, b.sz);
+}
+
+// which voxels of a brick the brush covers, laid out x first, as masks of 0
+// or 255 from the sign of the distance at their centers. that needs no
+// square root, and the loops run over the whole brick without branches so
+// that the compiler vectorizes them
+static void cover_brick(const brush &b, float x0, float y0, float z0
+    , uint8_t *covered) {
+  x0 += 0.5f - b.x;
+  y0 += 0.5f - b.y;
+  z0 += 0.5f - b.z;
+  const uint32_t m = brick_size - 1;
+  if (b.shape == brush_sphere) {
+    const float r2 = b.sx > 0.f ? b.sx * b.sx : -1.f;
+    for (uint32_t i = 0; i < brick_voxels; i++) {
+      const float px = x0 + (i & m), py = y0 + (i >> brick_shift & m)
+        , pz = z0 + (i >> 2 * brick_shift);
+      covered[i] = px * px + py * py + pz * pz < r2 ? 255 : 0;
+    }
+    return;
+  }
+  for (uint32_t i = 0; i < brick_voxels; i++) {
+    const float px = x0 + (i & m), py = y0 + (i >> brick_shift & m)
+      , pz = z0 + (i >> 2 * brick_shift);
+    covered[i] = (fabsf(px) < b.sx) & (fabsf(py) < b.sy) & (fabsf(pz) < b.sz)
+      ? 255 : 0;
+  }
+}
+
+struct brick_edit {
+  uint32_t bx, by, bz;
+  bool uniform; // to value, the voxels are next in the slab's buffer otherwise
+  uint8_t value;
+};
+
+box apply_brush(world *w, const brush &b, thread_pool *pool) {
+  const uint8_t value = w->format == occupancy_bits && b.value ? 255
+    : b.value;
+  // covered voxels take value with union. the voxels that keep their value
+  // are the uncovered ones for union and subtract, the covered ones for
+  // intersect
+  const uint8_t set_mask = b.op == brush_union ? 255 : 0
+    , keep_flip = b.op == brush_intersect ? 0 : 255;
+  const float center[3] = { b.x, b.y, b.z }, extent[3] = { b.sx
+    , b.shape == brush_sphere ? b.sx : b.sy
+    , b.shape == brush_sphere ? b.sx : b.sz };
+  const uint32_t bricks[3] = { w->bw, w->bh, w->bd };
+  // the bricks that hold a voxel whose center may be inside
+  uint32_t lo[3], hi[3];
+  bool missed = false;
+  for (int i = 0; i < 3; i++) {
+    const float first = floorf((center[i] - extent[i] - 0.5f) / brick_size)
+      , last = floorf((center[i] + extent[i] - 0.5f) / brick_size);
+    lo[i] = std::min(std::max(first, 0.f), (float)bricks[i]);
+    hi[i] = std::min(std::max(last + 1.f, 0.f), (float)bricks[i]);
+    missed = missed || lo[i] >= hi[i];
+  }
+  if (missed)
+    for (int i = 0; i < 3; i++)
+      lo[i] = hi[i] = 0;
+
+  // slabs of bricks along z are decided on the pool and written to the world
+  // afterwards in order, like generate() does
+  const uint32_t slabs = hi[2] - lo[2];
+  std::vector<std::vector<brick_edit>> edits(slabs);
+  std::vector<std::vector<uint8_t>> voxels(slabs);
+  pool->parallel_for(slabs, [&](size_t slab, int) {
+    const uint32_t bz = lo[2] + slab;
+    uint8_t old[brick_voxels], next[brick_voxels], covered[brick_voxels];
+    for (uint32_t by = lo[1]; by < hi[1]; by++)
+      for (uint32_t bx = lo[0]; bx < hi[0]; bx++) {
+        const float x0 = bx * brick_size, y0 = by * brick_size
+          , z0 = bz * brick_size, half = brick_size * 0.5f
+          , dist = distance(b, x0 + half, y0 + half, z0 + half);
+        uint8_t current;
+        const bool collapsed = w->uniform_brick(bx, by, bz, current);
+        if (dist < -brick_radius || dist >= brick_radius) {
+          // union and subtract leave the bricks they miss alone, intersect
+          // the ones it covers
+          if ((dist < 0.f) == (b.op == brush_intersect))
+            continue;
+          const uint8_t v = b.op == brush_union ? value : 0;
+          if (!collapsed || current != v)
+            edits[slab].push_back(brick_edit { bx, by, bz, true, v });
+          continue;
+        }
+        if (collapsed && current == (b.op == brush_union ? value : 0))
+          continue;
+        w->get_brick(bx, by, bz, old);
+        cover_brick(b, x0, y0, z0, covered);
+        // the voxels that take value, keep their own or are cleared
+        for (uint32_t i = 0; i < brick_voxels; i++) {
+          const uint8_t set = covered[i] & set_mask
+            , keep = (covered[i] ^ keep_flip) & ~set;
+          next[i] = (value & set) | (old[i] & keep);
+        }
+        if (!memcmp(old, next, brick_voxels))
+          continue;
+        if (std::all_of(next, next + brick_voxels
+              , [&](uint8_t v) { return v == next[0]; }))
+          edits[slab].push_back(brick_edit { bx, by, bz, true, next[0] });
+        else {
+          edits[slab].push_back(brick_edit { bx, by, bz, false, 0 });
+          voxels[slab].insert(voxels[slab].end(), next, next + brick_voxels);
+        }
+      }
+  });
+
+  uint32_t changed_lo[3] = { bricks[0], bricks[1], bricks[2] }
+    , changed_hi[3] = { 0, 0, 0 };
+  auto changed = [&](const uint32_t l[3], const uint32_t h[3]) {
+    for (int i = 0; i < 3; i++) {
+      changed_lo[i] = std::min(changed_lo[i], l[i]);
+      changed_hi[i] = std::max(changed_hi[i], h[i]);
+    }
+  };
+  for (uint32_t slab = 0; slab < slabs; slab++) {
+    const uint8_t *next = voxels[slab].data();
+    for (const brick_edit &e : edits[slab]) {
+      if (e.uniform)
+        w->fill(box { e.bx * brick_size, e.by * brick_size
+            , e.bz * brick_size, (e.bx + 1) * brick_size
+            , (e.by + 1) * brick_size, (e.bz + 1) * brick_size }, e.value);
+      else {
+        w->set_brick(e.bx, e.by, e.bz, next);
+        next += brick_voxels;
+      }
+      const uint32_t l[3] = { e.bx, e.by, e.bz }
+        , h[3] = { e.bx + 1, e.by + 1, e.bz + 1 };
+      changed(l, h);
+    }
+  }
+
+  // intersect clears the slabs of bricks around the bounding box, first
+  // along z, then y and x in what is left. they count as changed whether
+  // they held anything or not
+  if (b.op == brush_intersect)
+    for (int axis = 2; axis >= 0; axis--)
+      for (int side = 0; side < 2; side++) {
+        uint32_t l[3] = { 0, 0, 0 }, h[3] = { bricks[0], bricks[1]
+          , bricks[2] };
+        for (int i = axis + 1; i < 3; i++) {
+          l[i] = lo[i];
+          h[i] = hi[i];
+        }
+        if (side == 0)
+          h[axis] = lo[axis];
+        else
+          l[axis] = hi[axis];
+        const box around { l[0] * brick_size, l[1] * brick_size
+          , l[2] * brick_size, h[0] * brick_size, h[1] * brick_size
+          , h[2] * brick_size };
+        if (l[0] >= h[0] || l[1] >= h[1] || l[2] >= h[2])
+          continue;
+        w->fill(around, 0);
+        changed(l, h);
+      }
+
+  if (changed_lo[0] >= changed_hi[0])
+    return box { 0, 0, 0, 0, 0, 0 };
+  return box { changed_lo[0] * brick_size, changed_lo[1] * brick_size
+    , changed_lo[2] * brick_size, std::min(changed_hi[0] * brick_size, w->w)
+    , std::min(changed_hi[1] * brick_size, w->h)
+    , std::min(changed_hi[2] * brick_size, w->d) };
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include "world.hh"
+#include "thread_pool.hh"
+
+// bulk edits with the csg of the shader's sdf primitives. a brush covers the
+// voxels whose centers are inside its shape: union sets them to value,
+// subtract clears them and intersect clears every voxel it does not cover
+enum brush_shape { brush_sphere, brush_box };
+enum brush_op { brush_union, brush_subtract, brush_intersect };
+
+struct brush {
+  brush_shape shape;
+  brush_op op;
+  float x, y, z; // center
+  float sx, sy, sz; // half extents of a box, sx is the radius of a sphere
+  uint8_t value; // that union sets
+};
+
+// applies b to w and returns the box of the bricks it changed, with x0 == x1
+// when it changed none. only the bricks in b's bounding box are looked at,
+// intersect clears the rest of the world a brick at a time and returns all
+// of it. bricks that b covers whole or misses are decided by the distance at
+// their center, the others are evaluated voxel by voxel on pool. only the
+// bricks that changed are marked for upload
+box apply_brush(world *w, const brush &b, thread_pool *pool);
@@ -1,15 +1,18 @@
 #include <fstream>
+#include <chrono>
+#include <string>
 #include "pxdrw.hh"
+#include "rays.hh"
+#include "../perf_counters.hh"
 
 void drawvline(pixeldrawer *pd, int x, int sz, uint32_t color) {
-  for (int y = 0; y < sz; y++)
-    pd->write(x, pd->wheight / 2 - sz / 2 + y, color);
+  const int top = pd->wheight / 2 - sz / 2;
+  pd->column(x, top, top + sz, color);
 }
 
 void drawsq(pixeldrawer *pd, int x, int y, int sz, uint32_t color) {
   for (int dy = 0; dy < sz; dy++)
-    for (int dx = 0; dx < sz; dx++)
-      pd->write(x + dx, y + dy, color);
+    pd->span(x, x + sz, y + dy, color);
 }
 
 int tilecolor(int t) {
@@ -25,7 +28,7 @@ int tilecolor(int t) {
 }
 
 const int mapsz = 10;
-const int map[mapsz][mapsz] = {
+const int default_map[mapsz][mapsz] = {
   {1,1,1,2,3,4,2,1,1,1},
   {1,0,0,0,0,0,0,0,0,1},
   {1,0,0,0,0,0,0,0,0,5},
@@ -37,20 +40,16 @@ const int map[mapsz][mapsz] = {
   {1,0,0,0,0,0,0,0,0,1},
   {1,1,5,2,3,4,2,1,1,1},
 };
+raymap map;
 double playerx = 30, playery = 40, playerang = 0;
 const double tilesize = 10;
 const double plyspeed = 30, plyturnspeed = 100;
 double fov = 60;
 bool running = true;
-
-int sign(double x) {
-  if (abs(x) < 1e-5)
-    return 0;
-  if (x < 0)
-    return -1;
-  else
-    return 1;
-}
+// the widest kernel the cpu supports when the rays are long enough, unless
+// --scalar
+cast_kernel kernel = kernel_auto;
+column_rays rays;
 
 double to_rads(double degs) {
   return (degs * (M_PI / 180.0));
@@ -72,20 +71,46 @@ void update(double dt, uint32_t t) {
   }
 }
 
-int getmap(int x, int y) {
-  if (x < 0 || y < 0 || x > mapsz - 1 || y > mapsz - 1)
-    return -1;
-  else
-    return map[y][x];
+void load_default_map() {
+  map.w = map.h = mapsz;
+  map.cells.assign(&default_map[0][0], &default_map[0][0] + mapsz * mapsz);
+}
+
+// walls around the border and pillars in about density of the cells inside,
+// by default sparse ones so that rays travel far
+void generate_map(int size, double density) {
+  map.w = map.h = size;
+  map.cells.assign(size * size, 0);
+  srand(1);
+  for (int y = 0; y < size; y++)
+    for (int x = 0; x < size; x++)
+      if (x == 0 || y == 0 || x == size - 1 || y == size - 1)
+        map.cells[y * size + x] = 1 + rand() % 6;
+      else if (rand() % 4096 < density * 4096)
+        map.cells[y * size + x] = 1 + rand() % 6;
+  playerx = playery = size / 2 * tilesize + tilesize / 2;
+  map.cells[(int)(playery / tilesize) * size + (int)(playerx / tilesize)] = 0;
+}
+
+// fills rays with one ray per screen column and walks them through the map
+void cast_screen(int width) {
+  rays.resize(width);
+  for (int x = 0; x < width; x++) {
+    const double screenxnorm = ((double)x / width) * 2.0 - 1.0;
+    double thisrayang = playerang + screenxnorm * fov;
+    double dirx = cos(to_rads(thisrayang)), diry = sin(to_rads(thisrayang));
+    setup_column(rays, x, playerx / tilesize, playery / tilesize, dirx, diry);
+  }
+  cast_columns(kernel, map, rays, width);
 }
 
 void draw(pixeldrawer *pd) {
   const int offset = 5, scale = 5;
-  for (int y = 0; y < mapsz; y++)
-    for (int x = 0; x < mapsz; x++)
-      if (map[y][x])
+  for (int y = 0; y < std::min(map.h, pd->wheight / scale); y++)
+    for (int x = 0; x < std::min(map.w, pd->wwidth / scale); x++)
+      if (map.get(x, y))
         drawsq(pd, offset + x * scale, offset + y * scale, scale,
-            tilecolor(map[y][x]));
+            tilecolor(map.get(x, y)));
   int plx = offset + (playerx / tilesize) * scale,
       ply = offset + (playery / tilesize) * scale;
   drawsq(pd, plx - 1, ply - 1, 3, 0xAAAAAA);
@@ -104,35 +129,12 @@ void draw(pixeldrawer *pd) {
         round(ply + i * sin(to_rads(playerang))),
         0xFF0000);
 
+  cast_screen(pd->wwidth);
   for (int x = 0; x < pd->wwidth; x++) {
-    const double screenxnorm = ((double)x / pd->wwidth) * 2.0 - 1.0;
-    double thisrayang = playerang + screenxnorm * fov;
-    double dirx = cos(to_rads(thisrayang)), diry = sin(to_rads(thisrayang));
-    int mapx = playerx / tilesize, mapy = playery / tilesize;
-    double ddx = abs(1 / dirx), ddy = abs(1 / diry);
-    int stepx = sign(dirx), stepy = sign(diry);
-    double raydifx = mapx - playerx / tilesize, raydify = mapy - playery / tilesize;
-    double sidedx = (sign(dirx) * raydifx + sign(dirx) * 0.5 + 0.5) * ddx,
-           sidedy = (sign(diry) * raydify + sign(diry) * 0.5 + 0.5) * ddy;
-    bool maskx, masky;
-
-    int mapval;
-    for (int i = 0; i < 1e3; i++) {
-      mapval = getmap(mapx, mapy);
-      if (mapval != 0)
-        break;
-      if (sidedx < sidedy) {
-        sidedx += ddx;
-        mapx += stepx;
-        maskx = true;
-        masky = false;
-      } else {
-        sidedy += ddy;
-        mapy += stepy;
-        maskx = false;
-        masky = true;
-      }
-    }
+    const double dirx = rays.dirx[x], diry = rays.diry[x];
+    const int mapx = rays.mapx[x], mapy = rays.mapy[x]
+      , stepx = rays.stepx[x], stepy = rays.stepy[x];
+    const bool maskx = rays.maskx[x];
     double dist;
     if (maskx)
       dist = abs((mapx - playerx / tilesize + (1.0 - stepx) / 2.0) / dirx);
@@ -141,12 +143,143 @@ void draw(pixeldrawer *pd) {
     dist = 600 / dist;
     if (dist > 600)
       dist = 600;
-    uint32_t color = tilecolor(getmap(mapx, mapy)) * (maskx ? 0.9 : 1.0);
+    uint32_t color = tilecolor(map.get(mapx, mapy)) * (maskx ? 0.9 : 1.0);
     drawvline(pd, x, dist, color);
   }
 }
 
-int main() {
+// casts a full turn of frames with every kernel the cpu supports, then with
+// kernel_auto, and checks that they produce exactly the scalar kernel's
+// hits. a step moves a ray one cell, so a ray took as many as it is cells
+// away from the player's
+void bench(int width) {
+  const int frames = 64;
+  const cast_kernel best = detect_kernel();
+  double scalar_ms = 0;
+  std::vector<int> refx, refy;
+  std::vector<uint8_t> refmask;
+  perf_counters counters;
+  const int startx = playerx / tilesize, starty = playery / tilesize;
+  std::vector<cast_kernel> kernels;
+  for (int k = kernel_scalar; k <= best; k++)
+    kernels.push_back((cast_kernel)k);
+  if (best != kernel_scalar)
+    kernels.push_back(kernel_auto);
+  for (cast_kernel k : kernels) {
+    kernel = k;
+    // the frames that ran the packet kernel, which kernel_auto decides on
+    // anew every frame
+    int packet_frames = 0;
+    uint64_t mismatches = 0, steps = 0;
+    int64_t branch_misses = 0;
+    double ms = 0;
+    for (int f = 0; f < frames; f++) {
+      playerang = f * 360.0 / frames;
+      counters.start();
+      auto begin = std::chrono::steady_clock::now();
+      cast_screen(width);
+      ms += std::chrono::duration<double, std::milli>(
+          std::chrono::steady_clock::now() - begin).count();
+      counters.stop();
+      packet_frames += rays.kernel == kernel_avx2;
+      branch_misses += counters.branch_misses;
+      for (int x = 0; x < width; x++)
+        steps += abs(rays.mapx[x] - startx) + abs(rays.mapy[x] - starty);
+      if (k == kernel_scalar) {
+        refx.insert(refx.end(), rays.mapx.begin(), rays.mapx.end());
+        refy.insert(refy.end(), rays.mapy.begin(), rays.mapy.end());
+        refmask.insert(refmask.end(), rays.maskx.begin(), rays.maskx.end());
+        continue;
+      }
+      for (int x = 0; x < width; x++)
+        if (rays.mapx[x] != refx[f * width + x]
+            || rays.mapy[x] != refy[f * width + x]
+            || rays.maskx[x] != refmask[f * width + x])
+          mismatches++;
+    }
+    if (k == kernel_scalar)
+      scalar_ms = ms / frames;
+    // the kernel that ran the last frame, or auto with how often that was
+    // the packet kernel
+    printf("%-6s: %8.3f ms/frame, %5.2fx, %7.2f Msteps/s, %lu mismatching "
+        "columns", kernel_name(k == kernel_auto ? k : rays.kernel)
+        , ms / frames, scalar_ms * frames / ms, steps / ms / 1e3
+        , (unsigned long)mismatches);
+    if (k == kernel_auto)
+      printf(", avx2 in %d of %d frames", packet_frames, frames);
+    if (counters.available())
+      printf(", %.4f branch misses/step\n", (double)branch_misses / steps);
+    else
+      printf("\n");
+  }
+}
+
+// draws frames into a headless pixeldrawer, to time clearing and drawing
+// without a window or the cost of presenting
+void drawbench(int width, int height, int frames) {
+  pixeldrawer pd(width, height, true);
+  double clear_ms = 0, draw_ms = 0;
+  for (int f = 0; f < frames; f++) {
+    playerang = f * 360.0 / frames;
+    auto begin = std::chrono::steady_clock::now();
+    pd.clear();
+    auto cleared = std::chrono::steady_clock::now();
+    draw(&pd);
+    pd.draw();
+    auto end = std::chrono::steady_clock::now();
+    clear_ms += std::chrono::duration<double, std::milli>(
+        cleared - begin).count();
+    draw_ms += std::chrono::duration<double, std::milli>(
+        end - cleared).count();
+  }
+  printf("%dx%d, %d frames: clear %.3f ms, draw %.3f ms per frame\n", width
+      , height, frames, clear_ms / frames, draw_ms / frames);
+}
+
+void usage() {
+  puts("usage: vfk [--scalar] [--mapsize N] [--density F] [--bench WIDTH]"
+      " [--drawbench WxH FRAMES]");
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  int benchwidth = 0, drawwidth = 0, drawheight = 0, drawframes = 0
+    , mapsize = 0;
+  double density = 1 / 64.;
+  load_default_map();
+  for (int i = 1; i < argc; i++) {
+    const std::string arg = argv[i];
+    if (arg == "--scalar")
+      kernel = kernel_scalar;
+    else if (arg == "--mapsize" && i + 1 < argc)
+      mapsize = atoi(argv[++i]);
+    else if (arg == "--density" && i + 1 < argc)
+      density = atof(argv[++i]);
+    else if (arg == "--bench" && i + 1 < argc)
+      benchwidth = atoi(argv[++i]);
+    else if (arg == "--drawbench" && i + 2 < argc
+        && sscanf(argv[i + 1], "%dx%d", &drawwidth, &drawheight) == 2) {
+      drawframes = atoi(argv[i + 2]);
+      i += 2;
+    }
+    else
+      usage();
+  }
+  if (mapsize > 0)
+    generate_map(mapsize, density);
+
+  if (benchwidth) {
+    printf("%dx%d map, %d columns, widest kernel: %s\n", map.w, map.h
+        , benchwidth, kernel_name(detect_kernel()));
+    bench(benchwidth);
+    return 0;
+  }
+
+  if (drawframes) {
+    drawbench(drawwidth, drawheight, drawframes);
+    return 0;
+  }
+
   pixeldrawer screen(800, 600);
 
   screen.mainloop(update, draw);
@@ -1,12 +1,25 @@
 #include "pxdrw.hh"
 #include "utils.hh"
-
-pixeldrawer::pixeldrawer(int wwidth, int wheight) : wwidth(wwidth),
-  wheight(wheight)
+#include <algorithm>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+pixeldrawer::pixeldrawer(int wwidth, int wheight, bool headless) :
+  back(0), wwidth(wwidth), wheight(wheight), headless(headless), stepms(16),
+  maxsteps(5)
 {
   window = NULL;
   renderer = NULL;
-  texture = NULL;
+  textures[0] = textures[1] = NULL;
+
+  if (headless) {
+    for (int i = 0; i < 2; i++)
+      buffers[i].resize(wwidth * wheight);
+    pixels = buffers[back].data();
+    pitch = wwidth;
+    return;
+  }
 
   assert(SDL_Init(SDL_INIT_VIDEO) >= 0, "Failed to initialize SDL: %s",
       SDL_GetError());
@@ -32,51 +45,118 @@ void pixeldrawer::resize()
   assert(renderer != NULL, "Failed to create Renderer: %s",
       SDL_GetError());
 
-  if (texture)
-    SDL_DestroyTexture(texture);
+  // rgb888 leaves the top byte unused, so colors go in as they are
+  for (int i = 0; i < 2; i++) {
+    if (textures[i])
+      SDL_DestroyTexture(textures[i]);
+
+    textures[i] = SDL_CreateTexture(renderer,
+        SDL_PIXELFORMAT_RGB888,
+        SDL_TEXTUREACCESS_STREAMING, wwidth, wheight);
+  }
 
-  texture = SDL_CreateTexture(renderer,
-      SDL_PIXELFORMAT_RGBA8888,
-      SDL_TEXTUREACCESS_STREAMING, wwidth, wheight);
+  lock();
+}
 
-  data = std::unique_ptr<uint32_t>(new uint32_t [wwidth * wheight]);
+void pixeldrawer::lock()
+{
+  void *p;
+  int bytes;
+  assert(SDL_LockTexture(textures[back], NULL, &p, &bytes) == 0,
+      "Failed to lock texture: %s", SDL_GetError());
+  pixels = (uint32_t*)p;
+  pitch = bytes / sizeof(uint32_t);
 }
 
 void pixeldrawer::draw()
 {
-  SDL_UpdateTexture(texture, NULL, data.get(), wwidth * sizeof(uint32_t));
+  const int front = back;
+  back ^= 1;
+  if (headless) {
+    pixels = buffers[back].data();
+    return;
+  }
+  SDL_UnlockTexture(textures[front]);
   SDL_RenderClear(renderer);
-  SDL_RenderCopy(renderer, texture, NULL, NULL);
+  SDL_RenderCopy(renderer, textures[front], NULL, NULL);
   SDL_RenderPresent(renderer);
+  lock();
 }
 
 void pixeldrawer::write(int x, int y, uint32_t color)
 {
-  if (x < 0 || x > wwidth || y < 0 || y > wheight)
+  if (x < 0 || x >= wwidth || y < 0 || y >= wheight)
     return;
-  data.get()[y * wwidth + x] = (color << 8) + 0xFF; // XXX
+  row(y)[x] = color;
 }
 
-void pixeldrawer::clear()
+// std::fill_n, with sse2 stores once p is aligned
+static void fill(uint32_t *p, int n, uint32_t color)
 {
-  for (int y = 0; y < wheight; y++)
-    for (int x = 0; x < wwidth; x++)
-      write(x, y, 0);
+#ifdef __SSE2__
+  for (; n > 0 && (uintptr_t)p % 16; n--)
+    *p++ = color;
+  const __m128i c = _mm_set1_epi32(color);
+  for (; n >= 16; n -= 16, p += 16) {
+    _mm_store_si128((__m128i*)p, c);
+    _mm_store_si128((__m128i*)p + 1, c);
+    _mm_store_si128((__m128i*)p + 2, c);
+    _mm_store_si128((__m128i*)p + 3, c);
+  }
+#endif
+  std::fill_n(p, std::max(n, 0), color);
+}
+
+void pixeldrawer::span(int x0, int x1, int y, uint32_t color)
+{
+  if (y < 0 || y >= wheight)
+    return;
+  x0 = std::max(x0, 0);
+  x1 = std::min(x1, wwidth);
+  if (x0 < x1)
+    fill(row(y) + x0, x1 - x0, color);
+}
+
+void pixeldrawer::column(int x, int y0, int y1, uint32_t color)
+{
+  if (x < 0 || x >= wwidth)
+    return;
+  y0 = std::max(y0, 0);
+  y1 = std::min(y1, wheight);
+  for (uint32_t *p = row(y0) + x; y0 < y1; y0++, p += pitch)
+    *p = color;
+}
+
+void pixeldrawer::clear(uint32_t color)
+{
+  if (pitch == wwidth)
+    fill(pixels, wwidth * wheight, color);
+  else
+    for (int y = 0; y < wheight; y++)
+      fill(row(y), wwidth, color);
 }
 
 void pixeldrawer::mainloop(void (*update_cb)(double, uint32_t),
     void (*draw_cb)(pixeldrawer*)) {
   extern bool running;
-  uint32_t simtime = 0;
+  // the simulation's clock starts at the first frame, and a frame runs at
+  // most maxsteps updates. the rest of a longer stall is dropped, so the
+  // simulation falls behind instead of spiralling into longer frames
+  const uint32_t start = SDL_GetTicks();
+  uint32_t simtime = 0, dropped = 0;
 
   while (running) {
-    uint32_t realtime = SDL_GetTicks();
+    uint32_t realtime = SDL_GetTicks() - start - dropped;
 
-    while (simtime < realtime) {
-      simtime += 16;
+    int steps = 0;
+    while (simtime + stepms <= realtime && steps < maxsteps) {
+      simtime += stepms;
+      steps++;
 
-      update_cb(16. / 1000., simtime);
+      update_cb(stepms / 1000., simtime);
     }
+    if (simtime + stepms <= realtime)
+      dropped += (realtime - simtime) / stepms * stepms;
     clear();
 
     draw_cb(this);
@@ -87,7 +167,10 @@ void pixeldrawer::mainloop(void (*update_cb)(double, uint32_t),
 
 pixeldrawer::~pixeldrawer()
 {
-  SDL_DestroyTexture(texture);
+  if (headless)
+    return;
+  SDL_DestroyTexture(textures[0]);
+  SDL_DestroyTexture(textures[1]);
   SDL_DestroyRenderer(renderer);
   SDL_DestroyWindow(window);
   SDL_Quit();
@@ -1,25 +1,45 @@
 #pragma once
 
 #include <SDL2/SDL.h>
-#include <memory>
+#include <vector>
 
 class pixeldrawer
 {
   SDL_Window *window;
   SDL_Renderer *renderer;
-  SDL_Texture *texture;
-  std::unique_ptr<uint32_t> data;
+  // frames are drawn straight into a locked streaming texture. the two take
+  // turns, so the next frame is drawn while the last one is still on its
+  // way to the screen
+  SDL_Texture *textures[2];
+  // what the frames are drawn into without a window
+  std::vector<uint32_t> buffers[2];
+  int back; // the texture or buffer being drawn
 
   void resize();
+  void lock();
 public:
-  pixeldrawer(int wwidth, int wheight);
+  // a headless pixeldrawer opens no window and does not touch sdl, draw()
+  // only swaps its buffers
+  pixeldrawer(int wwidth, int wheight, bool headless = false);
   ~pixeldrawer();
 
   int wwidth, wheight;
+  const bool headless;
+  uint32_t stepms; // of an update
+  int maxsteps; // updates per frame at most
+
+  // the frame being drawn, pitch pixels from one row to the next. colors are
+  // 0xRRGGBB and nothing is kept from earlier frames, clear() before drawing
+  uint32_t *pixels;
+  int pitch;
+  uint32_t *row(int y) { return pixels + y * pitch; }
 
   void draw();
   void write(int x, int y, uint32_t color);
-  void clear();
+  // fill [x0, x1) of row y and [y0, y1) of column x, clipped to the frame
+  void span(int x0, int x1, int y, uint32_t color);
+  void column(int x, int y0, int y1, uint32_t color);
+  void clear(uint32_t color = 0);
   void mainloop(void (*update_cb)(double, uint32_t),
       void (*draw_cb)(pixeldrawer*));
 };
@@ -0,0 +1,250 @@
+#include "rays.hh"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
+
+void column_rays::resize(int n) {
+  dirx.resize(n);
+  diry.resize(n);
+  sidedx.resize(n);
+  sidedy.resize(n);
+  ddx.resize(n);
+  ddy.resize(n);
+  mapx.resize(n);
+  mapy.resize(n);
+  stepx.resize(n);
+  stepy.resize(n);
+  maskx.resize(n);
+}
+
+int sign(double x) {
+  if (std::abs(x) < 1e-5)
+    return 0;
+  if (x < 0)
+    return -1;
+  else
+    return 1;
+}
+
+void setup_column(column_rays &r, int i, double posx, double posy
+    , double dirx, double diry) {
+  int mapx = posx, mapy = posy;
+  double raydifx = mapx - posx, raydify = mapy - posy;
+  r.dirx[i] = dirx;
+  r.diry[i] = diry;
+  r.mapx[i] = mapx;
+  r.mapy[i] = mapy;
+  r.ddx[i] = std::abs(1 / dirx);
+  r.ddy[i] = std::abs(1 / diry);
+  r.stepx[i] = sign(dirx);
+  r.stepy[i] = sign(diry);
+  r.sidedx[i] = (sign(dirx) * raydifx + sign(dirx) * 0.5 + 0.5) * r.ddx[i];
+  r.sidedy[i] = (sign(diry) * raydify + sign(diry) * 0.5 + 0.5) * r.ddy[i];
+  r.maskx[i] = false;
+}
+
+// the columns [begin, end). returns the steps their rays took
+static uint64_t cast_scalar(const raymap &m, column_rays &r, int begin
+    , int end) {
+  uint64_t steps = 0;
+  for (int c = begin; c < end; c++) {
+    double sidedx = r.sidedx[c], sidedy = r.sidedy[c];
+    int mapx = r.mapx[c], mapy = r.mapy[c];
+    bool maskx = r.maskx[c];
+    int i = 0;
+    for (; i < max_column_steps; i++) {
+      if (m.get(mapx, mapy) != 0)
+        break;
+      if (sidedx < sidedy) {
+        sidedx += r.ddx[c];
+        mapx += r.stepx[c];
+        maskx = true;
+      } else {
+        sidedy += r.ddy[c];
+        mapy += r.stepy[c];
+        maskx = false;
+      }
+    }
+    r.mapx[c] = mapx;
+    r.mapy[c] = mapy;
+    r.maskx[c] = maskx;
+    steps += i;
+  }
+  return steps;
+}
+
+#ifdef HAVE_X86_KERNELS
+// four columns per packet, in 64 bit lanes. the packet steps every lane
+// unconditionally for a batch of up to batch_steps steps, so that the side
+// distance comparison, the one branch of the scalar loop that the cpu
+// cannot predict, turns into blends and the map reads stay off its
+// dependency chain. every step gathers the cells of the lanes and keeps
+// which were solid as 4 bits of a mask, in registers. the lanes with a
+// solid cell in the batch are then stepped again from the start of the
+// batch, each up to its first one, which is where the scalar loop would
+// stop. there is no sse kernel, without a gather its cell reads are scalar
+// loads and it came out slower than the scalar loop
+const int batch_steps = 8;
+
+__attribute__((target("avx2")))
+static uint64_t cast_avx2(const raymap &m, column_rays &r, int n) {
+  const __m256i vw = _mm256_set1_epi64x(m.w), vh = _mm256_set1_epi64x(m.h)
+    , minus1 = _mm256_set1_epi64x(-1)
+    , evens = _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6);
+  uint64_t steps = 0;
+  // the columns are loaded straight from the arrays, n is a whole number of
+  // packets
+  for (int base = 0; base < n; base += 4) {
+    alignas(32) int64_t mapx[4], mapy[4], maskx[4];
+    const double *ddx = &r.ddx[base], *ddy = &r.ddy[base];
+    int32_t masks;
+    memcpy(&masks, &r.maskx[base], 4);
+    const int *stepx = &r.stepx[base], *stepy = &r.stepy[base];
+    __m256d vsdx = _mm256_loadu_pd(&r.sidedx[base])
+      , vsdy = _mm256_loadu_pd(&r.sidedy[base]);
+    const __m256d vddx = _mm256_loadu_pd(ddx), vddy = _mm256_loadu_pd(ddy);
+    __m256i vmapx = _mm256_cvtepi32_epi64(_mm_loadu_si128(
+          (const __m128i*)&r.mapx[base]))
+      , vmapy = _mm256_cvtepi32_epi64(_mm_loadu_si128(
+          (const __m128i*)&r.mapy[base]))
+      , vmaskx = _mm256_sub_epi64(_mm256_setzero_si256()
+          , _mm256_cvtepu8_epi64(_mm_cvtsi32_si128(masks)));
+    const __m256i vstepx = _mm256_cvtepi32_epi64(_mm_loadu_si128(
+          (const __m128i*)stepx))
+      , vstepy = _mm256_cvtepi32_epi64(_mm_loadu_si128(
+          (const __m128i*)stepy));
+    int live = 15;
+    // the batches start short, most rays in a busy map are over after a step
+    // or two
+    for (int i = 0, batch = 2; i < max_column_steps && live; i += batch
+        , batch = std::min(batch * 2, batch_steps)) {
+      // the last one ends exactly where the scalar loop gives up
+      batch = std::min(batch, max_column_steps - i);
+      const __m256d startx = vsdx, starty = vsdy;
+      const __m256i startmapx = vmapx, startmapy = vmapy, startmask = vmaskx;
+      uint32_t solid = 0; // bit 4 * step + lane
+      for (int j = 0; j < batch; j++) {
+        // out of bounds lanes are not loaded and read -1, like raymap::get
+        const __m256i inside = _mm256_and_si256(
+            _mm256_and_si256(_mm256_cmpgt_epi64(vmapx, minus1)
+              , _mm256_cmpgt_epi64(vw, vmapx))
+            , _mm256_and_si256(_mm256_cmpgt_epi64(vmapy, minus1)
+              , _mm256_cmpgt_epi64(vh, vmapy)))
+          , index = _mm256_add_epi64(_mm256_mul_epi32(vmapy, vw), vmapx);
+        const __m128i cells = _mm256_mask_i64gather_epi32(_mm_set1_epi32(-1)
+            , m.cells.data(), index, _mm256_castsi256_si128(
+              _mm256_permutevar8x32_epi32(inside, evens)), 4);
+        solid |= (uint32_t)(~_mm_movemask_ps(_mm_castsi128_ps(
+                _mm_cmpeq_epi32(cells, _mm_setzero_si128()))) & 15) << 4 * j;
+        const __m256d lt = _mm256_cmp_pd(vsdx, vsdy, _CMP_LT_OQ);
+        vsdx = _mm256_add_pd(vsdx, _mm256_and_pd(vddx, lt));
+        vsdy = _mm256_add_pd(vsdy, _mm256_andnot_pd(lt, vddy));
+        vmaskx = _mm256_castpd_si256(lt);
+        vmapx = _mm256_add_epi64(vmapx, _mm256_and_si256(vstepx, vmaskx));
+        vmapy = _mm256_add_epi64(vmapy, _mm256_andnot_si256(vmaskx, vstepy));
+      }
+      // every lane's bits of a step, for the lanes still stepping
+      const uint32_t hits = solid & 0x11111111u * live;
+      if (!hits)
+        continue;
+      // steps the lanes again from the start of the batch, each up to its
+      // first solid cell
+      alignas(32) int64_t stops[4];
+      int longest = 0;
+      for (int l = 0; l < 4; l++) {
+        const uint32_t lane = hits >> l & 0x11111111u;
+        stops[l] = lane ? __builtin_ctz(lane) / 4 : 0;
+        longest = std::max(longest, (int)stops[l]);
+      }
+      const __m256i vstops = _mm256_load_si256((__m256i*)stops);
+      __m256d rsdx = startx, rsdy = starty;
+      __m256i rmapx = startmapx, rmapy = startmapy, rmaskx = startmask;
+      for (int j = 0; j < longest; j++) {
+        const __m256i moving = _mm256_cmpgt_epi64(vstops
+              , _mm256_set1_epi64x(j))
+          , lt = _mm256_castpd_si256(_mm256_cmp_pd(rsdx, rsdy, _CMP_LT_OQ))
+          , stepsx = _mm256_and_si256(lt, moving)
+          , stepsy = _mm256_andnot_si256(lt, moving);
+        rsdx = _mm256_add_pd(rsdx, _mm256_and_pd(vddx
+              , _mm256_castsi256_pd(stepsx)));
+        rsdy = _mm256_add_pd(rsdy, _mm256_and_pd(vddy
+              , _mm256_castsi256_pd(stepsy)));
+        rmapx = _mm256_add_epi64(rmapx, _mm256_and_si256(vstepx, stepsx));
+        rmapy = _mm256_add_epi64(rmapy, _mm256_and_si256(vstepy, stepsy));
+        rmaskx = _mm256_blendv_epi8(rmaskx, lt, moving);
+      }
+      _mm256_store_si256((__m256i*)mapx, rmapx);
+      _mm256_store_si256((__m256i*)mapy, rmapy);
+      _mm256_store_si256((__m256i*)maskx, rmaskx);
+      for (int l = 0; l < 4; l++) {
+        if (!(hits >> l & 0x11111111u))
+          continue;
+        r.mapx[base + l] = mapx[l];
+        r.mapy[base + l] = mapy[l];
+        r.maskx[base + l] = maskx[l] != 0;
+        steps += i + stops[l];
+        live &= ~(1 << l);
+      }
+    }
+    _mm256_store_si256((__m256i*)mapx, vmapx);
+    _mm256_store_si256((__m256i*)mapy, vmapy);
+    _mm256_store_si256((__m256i*)maskx, vmaskx);
+    for (int l = 0; l < 4; l++)
+      if (live >> l & 1) {
+        r.mapx[base + l] = mapx[l];
+        r.mapy[base + l] = mapy[l];
+        r.maskx[base + l] = maskx[l] != 0;
+        steps += max_column_steps;
+      }
+  }
+  return steps;
+}
+#endif
+
+cast_kernel detect_kernel() {
+#ifdef HAVE_X86_KERNELS
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return kernel_avx2;
+#endif
+  return kernel_scalar;
+}
+
+const char *kernel_name(cast_kernel k) {
+  switch (k) {
+    case kernel_avx2: return "avx2";
+    case kernel_auto: return "auto";
+    default: return "scalar";
+  }
+}
+
+void cast_columns(cast_kernel k, const raymap &m, column_rays &r, int n) {
+  static const cast_kernel best = detect_kernel();
+  // the packets only pay for their extra steps once the rays are long, the
+  // last cast's rays tell whether this one's likely are
+  if (k == kernel_auto)
+    k = r.mean_steps < packet_min_steps ? kernel_scalar : best;
+  if (k > best)
+    k = best;
+  uint64_t steps;
+  switch (k) {
+#ifdef HAVE_X86_KERNELS
+    // the columns after the last whole packet go through the scalar loop.
+    // not from inside cast_avx2(), where it would be inlined and return with
+    // the upper halves of the registers dirty, which slows down the sse code
+    // of the caller
+    case kernel_avx2:
+      steps = cast_avx2(m, r, n / 4 * 4);
+      steps += cast_scalar(m, r, n / 4 * 4, n);
+      break;
+#endif
+    default: steps = cast_scalar(m, r, 0, n); break;
+  }
+  r.mean_steps = n > 0 ? (double)steps / n : 0;
+  r.kernel = k;
+}
+
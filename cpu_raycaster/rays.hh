@@ -0,0 +1,50 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+
+struct raymap {
+  int w, h;
+  std::vector<int> cells;
+  int get(int x, int y) const {
+    if (x < 0 || y < 0 || x > w - 1 || y > h - 1)
+      return -1;
+    else
+      return cells[y * w + x];
+  }
+};
+
+enum cast_kernel { kernel_scalar, kernel_avx2, kernel_auto };
+
+// per-column DDA state in structure-of-arrays form, so that packets of
+// adjacent columns can be loaded straight into simd registers. set up by
+// setup_column() and stepped by cast_columns() until every ray hits
+struct column_rays {
+  std::vector<double> dirx, diry, sidedx, sidedy, ddx, ddy;
+  std::vector<int> mapx, mapy, stepx, stepy;
+  std::vector<uint8_t> maskx;
+  // the steps per ray of the last cast_columns(), and the kernel it ran
+  double mean_steps = 0;
+  cast_kernel kernel = kernel_scalar;
+  void resize(int n);
+};
+
+const int max_column_steps = 1e3;
+// below that many steps per ray kernel_avx2 is slower than kernel_scalar,
+// which kernel_auto goes by
+const double packet_min_steps = 12;
+
+int sign(double x);
+
+void setup_column(column_rays &r, int i, double posx, double posy
+    , double dirx, double diry);
+
+// kernel_avx2 falls back to kernel_scalar when cpuid says the cpu does not
+// support it, and otherwise every kernel runs as asked. kernel_auto is the
+// fastest one the cpu supports, or kernel_scalar for a cast after one whose
+// rays averaged fewer than packet_min_steps. every kernel produces
+// bit-identical hits. detect_kernel() is the fastest one the cpu supports
+cast_kernel detect_kernel();
+const char *kernel_name(cast_kernel k);
+void cast_columns(cast_kernel k, const raymap &m, column_rays &r, int n);
+
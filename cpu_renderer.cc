@@ -0,0 +1,790 @@
+#include "cpu_renderer.hh"
+#include "utils.hh"
+#include "profiler.hh"
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <algorithm>
+
+static float signf(float x) {
+  return x > 0.f ? 1.f : (x < 0.f ? -1.f : 0.f);
+}
+
+static void rotate2d(float &x, float &y, float a) {
+  const float sina = sinf(a), cosa = cosf(a), rx = x * cosa - y * sina
+    , ry = y * cosa + x * sina;
+  x = rx;
+  y = ry;
+}
+
+void camera_ray(float fragx, float fragy, float resx, float resy, float time
+    , float origin[3], float dir[3]) {
+  const float screenx = (fragx / resx) * 2.f - 1.f
+    , screeny = (fragy / resy) * 2.f - 1.f;
+  dir[0] = screenx;
+  dir[1] = screeny * resy / resx;
+  dir[2] = 0.8f;
+  origin[0] = 0.f;
+  origin[1] = 2.f * sinf(time * 2.7f);
+  origin[2] = -12.f;
+  rotate2d(origin[0], origin[2], time);
+  rotate2d(dir[0], dir[2], time);
+}
+
+// getVoxel() from the shader: the world repeats in every direction and a
+// sphere of radius 30 around the origin is kept clear
+static bool clear_voxel(const int c[3]) {
+  const float sx = c[0] + 0.5f, sy = c[1] + 0.5f, sz = c[2] + 0.5f;
+  return sqrtf(sx * sx + sy * sy + sz * sz) <= 30.f;
+}
+
+static bool get_voxel(const world *w, const int c[3]) {
+  if (clear_voxel(c))
+    return false;
+  const int64_t x = ((int64_t)c[0] % w->w + w->w) % w->w
+    , y = ((int64_t)c[1] % w->h + w->h) % w->h
+    , z = ((int64_t)c[2] % w->d + w->d) % w->d;
+  return w->get(x, y, z) > 127;
+}
+
+static int floor_mod(int x, int n) {
+  return ((x % n) + n) % n;
+}
+
+// leaveBox() from the shader: moves map to the voxel past the face where the
+// ray leaves the empty box of size voxels at lo, and side to match
+static void leave_box(const int lo[3], int size, const float origin[3]
+    , const float dir[3], const float delta[3], int map[3], float side[3]
+    , ray_hit &r) {
+  float exit[3];
+  for (int i = 0; i < 3; i++)
+    exit[i] = ((dir[i] >= 0.f ? lo[i] + size : lo[i]) - origin[i]) / dir[i];
+  const float t = r.t = std::min(exit[0], std::min(exit[1], exit[2]));
+  for (int i = 0; i < 3; i++) {
+    // the shader's mask can have several axes set on a tie, its shading
+    // then goes by the last of them
+    if (exit[i] <= std::min(exit[(i + 1) % 3], exit[(i + 2) % 3])) {
+      map[i] = dir[i] >= 0.f ? lo[i] + size : lo[i] - 1;
+      r.axis = i;
+    } else
+      map[i] = std::min(std::max((int)floorf(origin[i] + dir[i] * t), lo[i])
+          , lo[i] + size - 1);
+  }
+  for (int i = 0; i < 3; i++)
+    side[i] = (signf(dir[i]) * (map[i] - origin[i]) + signf(dir[i]) * 0.5f
+        + 0.5f) * delta[i];
+}
+
+// the jump of the distance field traversal, false when the brick the ray is
+// in has voxels in it and the ray has to step
+static bool leave_distance(const world *w, const float origin[3]
+    , const float dir[3], const float delta[3], int map[3], float side[3]
+    , ray_hit &r) {
+  const int k = w->distance(floor_mod(map[0], w->w) >> brick_shift
+      , floor_mod(map[1], w->h) >> brick_shift
+      , floor_mod(map[2], w->d) >> brick_shift);
+  if (k < 1)
+    return false;
+  int lo[3];
+  for (int i = 0; i < 3; i++)
+    lo[i] = map[i] - floor_mod(map[i], brick_size) - (k - 1) * brick_size;
+  leave_box(lo, (2 * k - 1) * brick_size, origin, dir, delta, map, side, r);
+  return true;
+}
+
+ray_hit trace_ray(const world *w, const float origin[3], const float dir[3]
+    , int max_steps, float start, bool distance_field) {
+  ray_hit r;
+  int map[3], step[3];
+  float delta[3], side[3];
+  const float begin = start / sqrtf(dir[0] * dir[0] + dir[1] * dir[1]
+      + dir[2] * dir[2]);
+  for (int i = 0; i < 3; i++) {
+    map[i] = floorf(origin[i] + dir[i] * begin);
+    delta[i] = fabsf(1.f / dir[i]);
+    step[i] = signf(dir[i]);
+    side[i] = (signf(dir[i]) * (map[i] - origin[i]) + signf(dir[i]) * 0.5f
+        + 0.5f) * delta[i];
+  }
+  r.axis = -1;
+  r.t = begin;
+  r.hit = false;
+  for (r.steps = 0; r.steps < max_steps; r.steps++) {
+    if (distance_field && leave_distance(w, origin, dir, delta, map, side, r))
+      continue;
+    if (get_voxel(w, map)) {
+      r.hit = true;
+      break;
+    }
+    int a;
+    if (side[0] < side[1])
+      a = side[0] < side[2] ? 0 : 2;
+    else
+      a = side[1] < side[2] ? 1 : 2;
+    r.t = side[a];
+    side[a] += delta[a];
+    map[a] += step[a];
+    r.axis = a;
+  }
+  r.x = map[0];
+  r.y = map[1];
+  r.z = map[2];
+  return r;
+}
+
+ray_hit trace_ray_hierarchical(const world *w, const float origin[3]
+    , const float dir[3], int max_steps, float start) {
+  ray_hit r;
+  int map[3], step[3];
+  float delta[3], side[3];
+  const float begin = start / sqrtf(dir[0] * dir[0] + dir[1] * dir[1]
+      + dir[2] * dir[2]);
+  for (int i = 0; i < 3; i++) {
+    map[i] = floorf(origin[i] + dir[i] * begin);
+    delta[i] = fabsf(1.f / dir[i]);
+    step[i] = signf(dir[i]);
+    side[i] = (signf(dir[i]) * (map[i] - origin[i]) + signf(dir[i]) * 0.5f
+        + 0.5f) * delta[i];
+  }
+  r.axis = -1;
+  r.t = begin;
+  r.hit = false;
+  int level = -1; // of the last jump across empty space
+  for (r.steps = 0; r.steps < max_steps; r.steps++) {
+    const int p[3] = { floor_mod(map[0], w->w), floor_mod(map[1], w->h)
+      , floor_mod(map[2], w->d) };
+    if (!clear_voxel(map) && w->empty_cell(0, p[0], p[1], p[2])) {
+      const int up = std::min(level + 1, w->occupancy_levels - 1);
+      level = up > 0 && w->empty_cell(up, p[0], p[1], p[2]) ? up : 0;
+      const int size = brick_size << level;
+      int lo[3];
+      for (int i = 0; i < 3; i++)
+        lo[i] = map[i] - floor_mod(map[i], size);
+      leave_box(lo, size, origin, dir, delta, map, side, r);
+      continue;
+    }
+    if (get_voxel(w, map)) {
+      r.hit = true;
+      break;
+    }
+    level = -1;
+    int a;
+    if (side[0] < side[1])
+      a = side[0] < side[2] ? 0 : 2;
+    else
+      a = side[1] < side[2] ? 1 : 2;
+    r.t = side[a];
+    side[a] += delta[a];
+    map[a] += step[a];
+    r.axis = a;
+  }
+  r.x = map[0];
+  r.y = map[1];
+  r.z = map[2];
+  return r;
+}
+
+// clear_voxel() keeps every voxel clear that has a point this close to the
+// origin, its center is at most half a diagonal further away
+static const float clear_radius = 29.f;
+
+// faceOcclusion() from the shader: the occlusion of the corners of the face
+// the ray entered the voxel through, interpolated at where it did
+static float face_occlusion(const world *w, const float origin[3]
+    , const float dir[3], const ray_hit &r) {
+  const int map[3] = { r.x, r.y, r.z };
+  const float cx = map[0] + 0.5f, cy = map[1] + 0.5f, cz = map[2] + 0.5f;
+  if (sqrtf(cx * cx + cy * cy + cz * cz) < 33.f)
+    return 1.f;
+  int corner[3];
+  float f[3];
+  for (int i = 0; i < 3; i++) {
+    const float p = std::min(std::max(origin[i] + dir[i] * r.t
+          , (float)map[i]), map[i] + 1.f);
+    corner[i] = i == r.axis ? map[i] + (dir[i] < 0.f) : map[i];
+    f[i] = i == r.axis ? 0.f : p - map[i];
+  }
+  float solid = 0.f;
+  for (int k = 0; k < 2; k++)
+    for (int j = 0; j < 2; j++)
+      for (int i = 0; i < 2; i++) {
+        const float weight = (i ? f[0] : 1.f - f[0]) * (j ? f[1] : 1.f - f[1])
+          * (k ? f[2] : 1.f - f[2]);
+        if (weight > 0.f)
+          solid += weight * w->occlusion(floor_mod(corner[0] + i, w->w)
+              , floor_mod(corner[1] + j, w->h), floor_mod(corner[2] + k, w->d));
+      }
+  return 1.f - cpu_occlusion_strength
+    * std::min(std::max(2.f * solid / 255.f - 1.f, 0.f), 1.f);
+}
+
+// coneStart() from the shader. the cone has its apex at origin, unit axis a
+// and a radius of k per voxel along the axis. it first runs to where its
+// widest part leaves the clear sphere, then from box to box of empty cells
+// around the cube that bounds its cross section, grown by half a voxel so
+// that no ray of it ends up on the face of a voxel it has not cleared. every
+// box holds the cube where the march is and the cone stays in the box up to
+// where the cube reaches one of its faces
+static float cone_march(const world *w, const float o[3], const float a[3]
+    , float k, uint64_t &steps) {
+  float s = 0.f;
+  const float dd = o[0] * o[0] + o[1] * o[1] + o[2] * o[2]
+    , b = a[0] * o[0] + a[1] * o[1] + a[2] * o[2] + clear_radius * k
+    , q = 1.f - k * k;
+  if (dd < clear_radius * clear_radius && q > 0.f)
+    s = (-b + sqrtf(b * b - q * (dd - clear_radius * clear_radius))) / q;
+  int level = 0, i;
+  for (i = 0; i < cpu_max_cone_steps; i++) {
+    const float r = s * k + 0.5f;
+    const int size = brick_size << level;
+    // the box is 2 cells along every axis at most while the cube is
+    // narrower than one
+    if (2.f * r >= size) {
+      if (level + 1 >= w->occupancy_levels)
+        break;
+      level++;
+      continue;
+    }
+    int lo[3], hi[3];
+    for (int j = 0; j < 3; j++) {
+      const float p = o[j] + a[j] * s;
+      lo[j] = ((int)ceilf((p - r) / size) - 1) * size;
+      hi[j] = ((int)floorf((p + r) / size) + 1) * size;
+    }
+    bool empty = true;
+    for (int z = lo[2]; z < hi[2] && empty; z += size)
+      for (int y = lo[1]; y < hi[1] && empty; y += size)
+        for (int x = lo[0]; x < hi[0] && empty; x += size)
+          empty = w->empty_cell(level, floor_mod(x, w->w), floor_mod(y, w->h)
+              , floor_mod(z, w->d));
+    if (!empty) {
+      if (level == 0)
+        break;
+      level--;
+      continue;
+    }
+    float next = 1e30f;
+    for (int j = 0; j < 3; j++) {
+      if (a[j] + k > 0.f)
+        next = std::min(next, (hi[j] - o[j] - 0.5f) / (a[j] + k));
+      if (k - a[j] > 0.f)
+        next = std::min(next, (o[j] - 0.5f - lo[j]) / (k - a[j]));
+    }
+    s = next;
+    level = std::min(level + 1, w->occupancy_levels - 1);
+  }
+  steps += i;
+  return s;
+}
+
+float cone_start(const world *w, float x0, float y0, float x1, float y1
+    , float resx, float resy, float time, uint64_t &steps) {
+  float origin[3], axis[3], dir[3];
+  camera_ray((x0 + x1) * 0.5f, (y0 + y1) * 0.5f, resx, resy, time, origin
+      , axis);
+  const float axis_length = sqrtf(axis[0] * axis[0] + axis[1] * axis[1]
+      + axis[2] * axis[2]);
+  for (int i = 0; i < 3; i++)
+    axis[i] /= axis_length;
+  // the widest angle to the axis is at a corner, the cone reaches that far
+  float c = 1.f;
+  for (int i = 0; i < 4; i++) {
+    camera_ray(i % 2 ? x1 : x0, i / 2 ? y1 : y0, resx, resy, time, origin
+        , dir);
+    c = std::min(c, (axis[0] * dir[0] + axis[1] * dir[1] + axis[2] * dir[2])
+        / sqrtf(dir[0] * dir[0] + dir[1] * dir[1] + dir[2] * dir[2]));
+  }
+  return cone_march(w, origin, axis, sqrtf(std::max(1.f - c * c, 0.f)) / c
+      , steps);
+}
+
+// the distance along the normalized ray at which it enters voxel v, or a
+// negative one when it misses it. edge is how much further the ray enters
+// the slab of the face it came through than the next one, close to 0 on
+// the voxel's edges
+static float enter_voxel(const float origin[3], const float dir[3]
+    , const int v[3], float &edge) {
+  const float length = sqrtf(dir[0] * dir[0] + dir[1] * dir[1]
+      + dir[2] * dir[2]);
+  float enter = -1e30f, next = -1e30f, leave = 1e30f;
+  for (int i = 0; i < 3; i++) {
+    const float a = (v[i] - origin[i]) * length / dir[i]
+      , b = (v[i] + 1 - origin[i]) * length / dir[i];
+    next = std::max(next, std::min(enter, std::min(a, b)));
+    enter = std::max(enter, std::min(a, b));
+    leave = std::min(leave, std::max(a, b));
+  }
+  edge = enter - next;
+  return enter <= leave ? enter : -1.f;
+}
+
+cpu_renderer::cpu_renderer(const world *n_world, thread_pool *n_pool
+    , int n_width, int n_height, int n_tile_size)
+  : _world(n_world), _pool(n_pool), _tile_size(n_tile_size)
+    , _reprojecting(false), _traced_steps(1e30), width(n_width)
+    , height(n_height)
+    , pixels(std::vector<uint32_t>(width * height, 0)), frame_x(0), frame_y(0)
+    , frame_width(width), frame_height(height), hierarchical(true)
+    , max_ray_steps(cpu_max_ray_steps), distance_field(false)
+    , ambient_occlusion(false), prepass_block(0), reproject(false) {
+}
+
+// the checking trace starts this far in front of the voxel, and gives up
+// after as many steps as it takes to cross that at the worst angle. closer
+// than 8 voxels, hits behind a voxel that the last frame did not see get
+// through in scenes as busy as the default one
+static const float reuse_distance = 8.f;
+static const int reuse_steps = 16;
+// further away than where a pixel grows this wide, in voxels, a voxel can
+// fall between the last frame's rays and go unseen in front of a hit
+static const float reuse_footprint = 0.5f;
+// a ray that enters the voxel this close to an edge, relative to how far it
+// went, can round onto either face, which a full trace from the camera may
+// not agree with the checking trace on
+static const float reuse_edge = 1e-4f;
+// the tiles of edit_depths() for the reused rays
+static const int edit_tile = 8;
+
+// camera_ray() the other way around, from a point to the pixel it lands on
+void cpu_renderer::reproject_history(float time) {
+  profile_zone("reproject");
+  _reprojected.assign(_history.size(), reprojected_hit { { 0, 0, 0 }, -1.f });
+  float origin[3], dir[3];
+  camera_ray(0.f, 0.f, width, height, time, origin, dir);
+  const float sina = sinf(-time), cosa = cosf(-time);
+  for (size_t i = 0; i < _history.size(); i++) {
+    if (!_history_kept[i])
+      continue;
+    const history_hit &h = _history[i];
+    const float dx = h.point[0] - origin[0], dy = h.point[1] - origin[1]
+      , dz = h.point[2] - origin[2], x = dx * cosa - dz * sina
+      , depth = dz * cosa + dx * sina;
+    if (depth <= 0.f)
+      continue;
+    const float fragx = (x / depth * 0.8f + 1.f) * 0.5f * width
+      , fragy = (dy / depth * 0.8f * width / height + 1.f) * 0.5f * height;
+    if (fragx < 0.f || fragy < 0.f || fragx >= width || fragy >= height)
+      continue;
+    reprojected_hit &r = _reprojected[(height - 1 - (int)fragy) * width
+      + (int)fragx];
+    if (r.depth < 0.f || depth < r.depth)
+      r = reprojected_hit { { h.voxel[0], h.voxel[1], h.voxel[2] }, depth };
+  }
+}
+
+bool edit_depths(const world *w, const std::vector<box> &boxes, float time
+    , int width, int height, int tile, float reach
+    , std::vector<float> &depths) {
+  const int tiles_x = (width + tile - 1) / tile
+    , tiles_y = (height + tile - 1) / tile;
+  depths.assign((size_t)tiles_x * tiles_y, 1e30f);
+  float origin[3], dir[3];
+  camera_ray(0.f, 0.f, width, height, time, origin, dir);
+  const float sina = sinf(-time), cosa = cosf(-time), near = 0.01f;
+  const double dims[3] = { (double)w->w, (double)w->h, (double)w->d };
+  int copies = 0;
+  for (const box &b : boxes) {
+    const double lo[3] = { (double)b.x0, (double)b.y0, (double)b.z0 }
+      , hi[3] = { (double)b.x1, (double)b.y1, (double)b.z1 };
+    // the copies that overlap the cube of reach around the camera
+    int k0[3], k1[3], count = 1;
+    for (int i = 0; i < 3; i++) {
+      k0[i] = std::floor((origin[i] - reach - hi[i]) / dims[i]) + 1;
+      k1[i] = std::floor((origin[i] + reach - lo[i]) / dims[i]);
+      count *= std::max(k1[i] - k0[i] + 1, 0);
+    }
+    copies += count;
+    if (copies > max_edit_copies)
+      return false;
+    for (int kz = k0[2]; kz <= k1[2]; kz++)
+      for (int ky = k0[1]; ky <= k1[1]; ky++)
+        for (int kx = k0[0]; kx <= k1[0]; kx++) {
+          const int k[3] = { kx, ky, kz };
+          // the corners in view space, x, y and depth
+          float corners[8][3];
+          for (int c = 0; c < 8; c++) {
+            float p[3];
+            for (int i = 0; i < 3; i++)
+              p[i] = (c >> i & 1 ? hi[i] : lo[i]) + k[i] * dims[i] - origin[i];
+            corners[c][0] = p[0] * cosa - p[2] * sina;
+            corners[c][1] = p[1];
+            corners[c][2] = p[2] * cosa + p[0] * sina;
+          }
+          float nearest = 1e30f, x0 = 1e30f, y0 = 1e30f, x1 = -1e30f
+            , y1 = -1e30f;
+          for (int c = 0; c < 8; c++)
+            for (int bit = 1; bit < 8; bit <<= 1) {
+              if (c & bit)
+                continue;
+              const float *a = corners[c], *e = corners[c | bit];
+              if (a[2] < near && e[2] < near)
+                continue;
+              // the edge's ends, moved onto the near plane where behind it
+              for (int j = 0; j < 2; j++) {
+                const float *p = j ? e : a, *q = j ? a : e;
+                const float f = p[2] < near ? (near - p[2]) / (q[2] - p[2])
+                  : 0.f, x = p[0] + (q[0] - p[0]) * f
+                  , y = p[1] + (q[1] - p[1]) * f
+                  , depth = p[2] + (q[2] - p[2]) * f
+                  , fx = (x / depth * 0.8f + 1.f) * 0.5f * width
+                  , fy = (y / depth * 0.8f * width / height + 1.f) * 0.5f
+                    * height;
+                nearest = std::min(nearest, depth);
+                x0 = std::min(x0, fx);
+                x1 = std::max(x1, fx);
+                y0 = std::min(y0, fy);
+                y1 = std::max(y1, fy);
+              }
+            }
+          if (nearest == 1e30f)
+            continue;
+          // a pixel more on every side for the rays that graze an edge
+          const int tx0 = std::max<float>(0, (x0 - 1.f) / tile)
+            , tx1 = std::min<float>(tiles_x - 1, (x1 + 1.f) / tile)
+            , ty0 = std::max<float>(0, (y0 - 1.f) / tile)
+            , ty1 = std::min<float>(tiles_y - 1, (y1 + 1.f) / tile);
+          for (int ty = ty0; ty <= ty1; ty++)
+            for (int tx = tx0; tx <= tx1; tx++) {
+              float &depth = depths[ty * tiles_x + tx];
+              depth = std::min(depth, nearest);
+            }
+        }
+  }
+  return true;
+}
+
+// true when the ray between the distances t0 and t1 along the normalized d
+// crosses the copy of b that reaches into the brick at cell, a slab test.
+// along an axis where two copies can reach into one brick any position
+// counts as inside
+static bool crosses_copy(const world *w, const box &b, const int cell[3]
+    , const float origin[3], const float d[3], float t0, float t1) {
+  const int64_t dims[3] = { w->w, w->h, w->d }, b0[3] = { b.x0, b.y0, b.z0 }
+    , b1[3] = { b.x1, b.y1, b.z1 };
+  for (int i = 0; i < 3; i++) {
+    const int64_t width = b1[i] - b0[i], begin = (int64_t)cell[i] * brick_size;
+    if (width + brick_size > dims[i])
+      continue;
+    // the last copy that begins before the brick ends
+    const int64_t end = begin + brick_size - 1 - b0[i]
+      , k = end >= 0 ? end / dims[i] : -((dims[i] - 1 - end) / dims[i])
+      , lo = b0[i] + k * dims[i], hi = lo + width;
+    if (hi <= begin)
+      return false;
+    if (d[i] == 0.f) {
+      if (origin[i] < lo || origin[i] >= hi)
+        return false;
+      continue;
+    }
+    const float a = (lo - origin[i]) / d[i], c = (hi - origin[i]) / d[i];
+    t0 = std::max(t0, std::min(a, c));
+    t1 = std::min(t1, std::max(a, c));
+    if (t0 > t1)
+      return false;
+  }
+  return true;
+}
+
+// true when the ray passes through an edited box between the distances t0
+// and t1 along the normalized dir. a DDA over the bricks of the repeating
+// world finds the ones with an edit in them, the boxes are only tested
+// there
+bool cpu_renderer::crosses_edit(const float origin[3], const float dir[3]
+    , float t0, float t1) const {
+  const float length = sqrtf(dir[0] * dir[0] + dir[1] * dir[1]
+      + dir[2] * dir[2]);
+  const int size[3] = { (int)_world->bw, (int)_world->bh, (int)_world->bd };
+  int cell[3], step[3];
+  float next[3], delta[3], d[3];
+  for (int i = 0; i < 3; i++) {
+    d[i] = dir[i] / length;
+    const float p = origin[i] + d[i] * t0;
+    cell[i] = floorf(p / brick_size);
+    step[i] = signf(d[i]);
+    delta[i] = d[i] != 0.f ? brick_size / fabsf(d[i]) : 1e30f;
+    next[i] = d[i] != 0.f ? t0 + ((cell[i] + (d[i] > 0.f))
+        * (float)brick_size - p) / d[i] : 1e30f;
+  }
+  for (;;) {
+    if (_edited_bricks[((uint64_t)floor_mod(cell[2], size[2]) * size[1]
+          + floor_mod(cell[1], size[1])) * size[0]
+        + floor_mod(cell[0], size[0])])
+      for (const box &b : _edited)
+        if (crosses_copy(_world, b, cell, origin, d, t0, t1))
+          return true;
+    const int a = next[0] < next[1] ? (next[0] < next[2] ? 0 : 2)
+      : (next[1] < next[2] ? 1 : 2);
+    if (next[a] > t1)
+      return false;
+    cell[a] += step[a];
+    next[a] += delta[a];
+  }
+}
+
+// takes the nearest hits that landed on the pixel or around it. a voxel
+// that comes closer spreads its hits apart, and the pixels in between would
+// otherwise go by hits behind it. hits further back than the checking trace
+// reaches past the nearest one are not tried, the pixel is on an edge or
+// just came out from behind something then, and there may be voxels in
+// between that the last frame did not see
+bool cpu_renderer::reuse_hit(int x, int y, const float origin[3]
+    , const float dir[3], float start, ray_hit &r, uint64_t &steps) const {
+  // depths are along the camera's axis, on which dir is 0.8 long
+  const float length = sqrtf(dir[0] * dir[0] + dir[1] * dir[1]
+      + dir[2] * dir[2]), to_distance = length / 0.8f
+    , far = reuse_footprint * 0.5f * width * length;
+  const reprojected_hit *candidates[9];
+  int count = 0;
+  float nearest = -1.f;
+  for (int ny = std::max(y - 1, 0); ny <= std::min(y + 1, height - 1); ny++)
+    for (int nx = std::max(x - 1, 0); nx <= std::min(x + 1, width - 1); nx++) {
+      const reprojected_hit &c = _reprojected[ny * width + nx];
+      if (c.depth < 0.f)
+        continue;
+      if (nearest < 0.f || c.depth < nearest)
+        nearest = c.depth;
+      // when the pre-pass already starts the ray that close, checking is no
+      // shorter than tracing. the depth is of a point on the voxel, which
+      // narrows it down enough to leave the exact test for later
+      const float guess = (c.depth - 2.f) * to_distance;
+      if (guess - reuse_distance <= start || guess > far)
+        continue;
+      bool seen = false;
+      for (int i = 0; i < count && !seen; i++)
+        seen = std::equal(c.voxel, c.voxel + 3, candidates[i]->voxel);
+      if (seen)
+        continue;
+      // kept sorted by depth
+      int i = count++;
+      for (; i > 0 && candidates[i - 1]->depth > c.depth; i--)
+        candidates[i] = candidates[i - 1];
+      candidates[i] = &c;
+    }
+  const float last = nearest + reuse_distance * 0.5f;
+  for (int i = 0; i < count && candidates[i]->depth <= last; i++) {
+    const reprojected_hit &c = *candidates[i];
+    float edge;
+    const float enter = enter_voxel(origin, dir, c.voxel, edge);
+    if (enter - reuse_distance <= start || enter > far
+        || edge < reuse_edge * enter)
+      continue;
+    // the checking trace sees edits in front of the voxel, and the pre-pass
+    // ran on this frame's world, what is left is the way in between
+    if (!_edited.empty() && enter - reuse_distance > _edit_depths[
+          (height - 1 - y) / edit_tile * ((width + edit_tile - 1) / edit_tile)
+          + x / edit_tile] * to_distance && crosses_edit(origin, dir, start
+            , enter - reuse_distance))
+      continue;
+    ray_hit h = hierarchical && !distance_field
+      ? trace_ray_hierarchical(_world, origin, dir, reuse_steps
+          , enter - reuse_distance)
+      : trace_ray(_world, origin, dir, reuse_steps, enter - reuse_distance
+          , distance_field);
+    steps += h.steps;
+    if (h.hit && h.x == c.voxel[0] && h.y == c.voxel[1] && h.z == c.voxel[2]
+        && h.axis >= 0) {
+      r = h;
+      return true;
+    }
+  }
+  return false;
+}
+
+// false when the pre-pass starts every ray of the pixels [x0, x1) x [y0, y1)
+// so close to all hits that landed on them or around them that reuse_hit()
+// would not try one. it passes over the hits once, reuse_hit() sorts them
+// for every pixel
+bool cpu_renderer::reusable(int x0, int y0, int x1, int y1, float start)
+  const {
+  if (start <= 0.f)
+    return true;
+  // rays are longest through the corners of the frame
+  const float aspect = (float)height / width, to_distance = sqrtf(1.f
+      + aspect * aspect + 0.8f * 0.8f) / 0.8f;
+  for (int y = std::max(y0 - 1, 0); y < std::min(y1 + 1, height); y++)
+    for (int x = std::max(x0 - 1, 0); x < std::min(x1 + 1, width); x++) {
+      const float depth = _reprojected[y * width + x].depth;
+      if (depth >= 0.f && (depth - 2.f) * to_distance - reuse_distance > start)
+        return true;
+    }
+  return false;
+}
+
+void cpu_renderer::render_tile(int tile, float time, int worker) {
+  profile_zone("render tile");
+  auto begin = std::chrono::steady_clock::now();
+  const int tiles_x = (width + _tile_size - 1) / _tile_size
+    , x0 = tile % tiles_x * _tile_size, y0 = tile / tiles_x * _tile_size
+    , x1 = std::min(x0 + _tile_size, width)
+    , y1 = std::min(y0 + _tile_size, height);
+  static const uint32_t axis_colors[3] = { 0x808080, 0xFFFFFF, 0xBFBFBF };
+  uint64_t steps = 0, cone_steps = 0, reused = 0, traced = 0;
+  // without the pre-pass the whole tile is one block that starts at 0
+  const int block = prepass_block > 0 ? prepass_block : _tile_size;
+  // where the tile is in the frame, gl_FragCoord has its origin in the
+  // bottom left corner
+  const int fx = frame_x, fy = frame_height - frame_y;
+  for (int by = y0; by < y1; by += block)
+    for (int bx = x0; bx < x1; bx += block) {
+      const int bx1 = std::min(bx + block, x1), by1 = std::min(by + block, y1);
+      const float start = prepass_block > 0 ? cone_start(_world, fx + bx
+          , fy - by1, fx + bx1, fy - by, frame_width, frame_height, time
+          , cone_steps) : 0.f;
+      const bool reuse = _reprojecting && !_reprojected.empty()
+        && reusable(bx, by, bx1, by1, start);
+      for (int y = by; y < by1; y++)
+        for (int x = bx; x < bx1; x++) {
+          float origin[3], dir[3];
+          camera_ray(fx + x + 0.5f, fy - y - 0.5f, frame_width, frame_height
+              , time, origin, dir);
+          ray_hit r;
+          if (reuse && reuse_hit(x, y, origin, dir, start, r, steps))
+            reused++;
+          else {
+            r = hierarchical && !distance_field
+              ? trace_ray_hierarchical(_world, origin, dir, max_ray_steps
+                  , start)
+              : trace_ray(_world, origin, dir, max_ray_steps, start
+                  , distance_field);
+            steps += r.steps;
+            traced += r.steps;
+          }
+          uint32_t color = r.axis < 0 ? 0xFF00FF : axis_colors[r.axis];
+          if (ambient_occlusion && r.hit && r.axis >= 0) {
+            const float shade = face_occlusion(_world, origin, dir, r);
+            const uint32_t gray = (color & 0xFF) * shade + 0.5f;
+            color = gray << 16 | gray << 8 | gray;
+          }
+          pixels[y * width + x] = color;
+          // hits too close for the next frame's checking trace to start
+          // past the pre-pass are still kept, as they hide the ones behind
+          // them from the pixels around
+          if (_reprojecting) {
+            const bool keep = r.hit && r.axis >= 0;
+            _history_kept[y * width + x] = keep;
+            if (keep) {
+              history_hit &h = _history[y * width + x];
+              const int voxel[3] = { r.x, r.y, r.z };
+              for (int i = 0; i < 3; i++) {
+                h.point[i] = origin[i] + dir[i] * r.t;
+                h.voxel[i] = voxel[i];
+              }
+            }
+          }
+        }
+    }
+  stats.worker_rays[worker] += (x1 - x0) * (y1 - y0);
+  stats.worker_seconds[worker] += std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - begin).count();
+  stats.worker_steps[worker] += steps;
+  stats.worker_cone_steps[worker] += cone_steps;
+  stats.worker_reused[worker] += reused;
+  _worker_traced_steps[worker] += traced;
+}
+
+void cpu_renderer::render(float time) {
+  assertf(!reproject || (frame_width == width && frame_height == height)
+      , "a window of a larger frame cannot be reprojected");
+  auto begin = std::chrono::steady_clock::now();
+  stats.rays = (uint64_t)width * height;
+  stats.worker_steps.assign(_pool->size(), 0);
+  stats.worker_cone_steps.assign(_pool->size(), 0);
+  stats.worker_reused.assign(_pool->size(), 0);
+  const bool history = _reprojecting;
+  _reprojecting = reproject && _traced_steps >= reuse_steps;
+  if (_reprojecting && history)
+    reproject_history(time);
+  else
+    _reprojected.clear();
+  _worker_traced_steps.assign(_pool->size(), 0);
+  if (!_reprojected.empty() && !_edited.empty()) {
+    const uint32_t bw = _world->bw, bh = _world->bh, bd = _world->bd;
+    _edited_bricks.assign((uint64_t)bw * bh * bd, 0);
+    for (const box &b : _edited)
+      for (uint32_t z = b.z0 / brick_size; z <= (b.z1 - 1) / brick_size; z++)
+        for (uint32_t y = b.y0 / brick_size; y <= (b.y1 - 1) / brick_size
+            ; y++)
+          for (uint32_t x = b.x0 / brick_size; x <= (b.x1 - 1) / brick_size
+              ; x++)
+            _edited_bricks[((uint64_t)(z % bd) * bh + y % bh) * bw
+              + x % bw] = 1;
+    // as far as reuse_hit() tries hits, through the corners of the frame
+    const float aspect = (float)height / width, reach = reuse_footprint
+      * 0.5f * width * sqrtf(1.f + aspect * aspect + 0.8f * 0.8f);
+    if (!edit_depths(_world, _edited, time, width, height, edit_tile, reach
+          , _edit_depths))
+      _edit_depths.assign(_edit_depths.size(), 0.f);
+  }
+  _history.resize(reproject ? width * height : 0);
+  _history_kept.resize(_history.size());
+  stats.worker_rays.assign(_pool->size(), 0);
+  stats.worker_seconds.assign(_pool->size(), 0);
+  const int tiles = ((width + _tile_size - 1) / _tile_size)
+    * ((height + _tile_size - 1) / _tile_size);
+  _pool->parallel_for(tiles, [&](size_t tile, int worker) {
+    render_tile(tile, time, worker);
+  });
+  stats.seconds = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - begin).count();
+  stats.steps = 0;
+  for (uint64_t s : stats.worker_steps)
+    stats.steps += s;
+  stats.cone_steps = 0;
+  for (uint64_t s : stats.worker_cone_steps)
+    stats.cone_steps += s;
+  stats.reused = 0;
+  for (uint64_t s : stats.worker_reused)
+    stats.reused += s;
+  uint64_t traced = 0;
+  for (uint64_t s : _worker_traced_steps)
+    traced += s;
+  if (stats.reused < stats.rays)
+    _traced_steps = (double)traced / (stats.rays - stats.reused);
+  _edited.clear();
+}
+
+void cpu_renderer::invalidate(const box &b) {
+  _edited.push_back(b);
+}
+
+void cpu_renderer::print_stats() const {
+  printf("cpu: %d threads, %7.2f ms/frame, %7.2f Mrays/s, %7.2f Mrays/s/core"
+      ", %5.1f steps/ray\n", _pool->size(), stats.seconds * 1000.
+      , stats.rays / stats.seconds / 1e6
+      , stats.rays / stats.seconds / 1e6 / _pool->size()
+      , (double)stats.steps / stats.rays);
+  if (prepass_block > 0)
+    printf("  pre-pass: %dx%d blocks, %5.1f cone steps/block\n"
+        , prepass_block, prepass_block, (double)stats.cone_steps
+        / stats.rays * prepass_block * prepass_block);
+  if (reproject)
+    printf("  reprojection: %5.1f%% of the rays reused a hit\n"
+        , 100. * stats.reused / stats.rays);
+  for (size_t i = 0; i < stats.worker_rays.size(); i++)
+    printf("  worker %2zu: %8lu rays, %7.2f Mrays/s while busy\n", i
+        , (unsigned long)stats.worker_rays[i], stats.worker_seconds[i] > 0
+        ? stats.worker_rays[i] / stats.worker_seconds[i] / 1e6 : 0.);
+}
+
+void write_ppm(const char *path, int width, int height
+    , const std::vector<uint32_t> &pixels) {
+  FILE *f = fopen(path, "wb");
+  assertf(f, "failed to open %s for writing", path);
+  fprintf(f, "P6 %d %d 255\n", width, height);
+  // a row at a time, frames for print are tens of millions of pixels
+  std::vector<uint8_t> row(width * 3);
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      const uint32_t p = pixels[(size_t)y * width + x];
+      row[x * 3] = p >> 16;
+      row[x * 3 + 1] = p >> 8;
+      row[x * 3 + 2] = p;
+    }
+    fwrite(&row[0], 1, row.size(), f);
+  }
+  fclose(f);
+}
+
+void cpu_renderer::write_ppm(const char *path) const {
+  ::write_ppm(path, width, height, pixels);
+}
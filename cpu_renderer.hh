@@ -0,0 +1,143 @@
+#pragma once
+
+#include "world.hh"
+#include "thread_pool.hh"
+#include <vector>
+#include <cstdint>
+
+// software version of the raymarching fragment shader in main.cc. it uses the
+// same camera, the same DDA and the same face shading, so its output can be
+// compared against the gpu and it runs on machines without one
+
+// MAX_RAY_STEPS of the shader's default variant, see shader_variant.hh
+const int cpu_max_ray_steps = 128;
+const int cpu_max_cone_steps = 64; // MAX_CONE_STEPS in the shader
+// OCCLUSION_STRENGTH in the shader, how much the face of a voxel in a corner
+// darkens
+const float cpu_occlusion_strength = 0.7f;
+
+struct ray_hit {
+  int x, y, z;
+  int axis; // axis of the last step, -1 when the ray never stepped
+  float t; // where along dir the last step entered the voxel
+  bool hit;
+  int steps;
+};
+
+void camera_ray(float fragx, float fragy, float resx, float resy, float time
+    , float origin[3], float dir[3]);
+// the rays begin start voxels away from the origin, which cone_start() finds
+// for a block of them. with distance_field the ray first jumps out of the
+// box of empty voxels that the world's distance field puts around the one it
+// is in, as long as that is more than the voxel itself. the field has to be
+// up to date, see world::update_distance()
+ray_hit trace_ray(const world *w, const float origin[3], const float dir[3]
+    , int max_steps, float start = 0.f, bool distance_field = false);
+// every jump across an empty cell of the occupancy pyramid counts as one
+// step, like an iteration of the shader's loop. the pyramid has to be up to
+// date, see world::update_occupancy()
+ray_hit trace_ray_hierarchical(const world *w, const float origin[3]
+    , const float dir[3], int max_steps, float start = 0.f);
+// the depth pre-pass of the shader: how far every ray through the pixels
+// [x0, x1) x [y0, y1) travels through empty voxels at least, found by
+// marching the cone around all of them through the occupancy pyramid. its
+// iterations are added to steps
+float cone_start(const world *w, float x0, float y0, float x1, float y1
+    , float resx, float resy, float time, uint64_t &steps);
+
+// with more copies of the boxes than that in reach edit_depths() gives up
+const int max_edit_copies = 1 << 16;
+// the depth along the camera's axis from which on the rays through each
+// tile of tile^2 pixels can cross a copy of one of the boxes of voxels, for
+// rays that reach no further than reach. the tiles go by gl_FragCoord,
+// bottom row first. every copy in reach covers the tiles under its edges,
+// clipped to the front of the camera and projected, 1e30 where none does.
+// false when there are too many copies
+bool edit_depths(const world *w, const std::vector<box> &boxes, float time
+    , int width, int height, int tile, float reach
+    , std::vector<float> &depths);
+
+struct cpu_frame_stats {
+  double seconds;
+  uint64_t rays, steps, cone_steps;
+  uint64_t reused; // rays that took their hit from the last frame
+  std::vector<uint64_t> worker_rays, worker_steps, worker_cone_steps
+    , worker_reused;
+  std::vector<double> worker_seconds;
+};
+
+// a frame of width by height pixels 0xRRGGBB, top row first, as a binary ppm
+void write_ppm(const char *path, int width, int height
+    , const std::vector<uint32_t> &pixels);
+
+class cpu_renderer {
+  const world *_world;
+  thread_pool *_pool;
+  int _tile_size;
+  // what every pixel's ray hit in the last frame, and those hits moved to
+  // where they land in this one. the nearest hit wins a pixel
+  struct history_hit {
+    float point[3]; // where the ray entered the voxel, on the face it hit
+    int voxel[3];
+  };
+  struct reprojected_hit {
+    int voxel[3];
+    float depth; // negative when no hit landed on the pixel
+  };
+  std::vector<history_hit> _history;
+  // whether the pixel's history_hit is there. kept apart so that pixels
+  // whose ray missed only write a byte
+  std::vector<uint8_t> _history_kept;
+  std::vector<reprojected_hit> _reprojected;
+  std::vector<box> _edited; // since the last frame
+  // the bricks of the world that one of them overlaps, and the edit_depths()
+  // of them, which rays in front of need not walk those
+  std::vector<uint8_t> _edited_bricks;
+  std::vector<float> _edit_depths;
+  // whether this frame reprojects. that only pays while the rays traced in
+  // full take more steps than checking a reused hit does
+  bool _reprojecting;
+  double _traced_steps; // per ray traced in full in the last frame
+  std::vector<uint64_t> _worker_traced_steps;
+  void reproject_history(float time);
+  bool reusable(int x0, int y0, int x1, int y1, float start) const;
+  bool crosses_edit(const float origin[3], const float dir[3], float t0
+      , float t1) const;
+  bool reuse_hit(int x, int y, const float origin[3], const float dir[3]
+      , float start, ray_hit &r, uint64_t &steps) const;
+  void render_tile(int tile, float time, int worker);
+public:
+  int width, height;
+  std::vector<uint32_t> pixels; // 0xRRGGBB, top row first
+  // the pixels are the window at frame_x, frame_y, from the top left, of a
+  // frame_width by frame_height frame, by default the whole of one their
+  // size. a window of a larger frame cannot be reprojected
+  int frame_x, frame_y, frame_width, frame_height;
+  cpu_frame_stats stats;
+  bool hierarchical;
+  int max_ray_steps; // of a ray, like the variant's in the shader
+  // traces with the world's distance field instead, which has to be enabled
+  bool distance_field;
+  // shades faces with the world's ambient occlusion, which has to be enabled
+  // and up to date, see world::update_occlusion()
+  bool ambient_occlusion;
+  // with a block size the rays of every block of prepass_block^2 pixels start
+  // at their cone_start(), 0 traces them from the camera
+  int prepass_block;
+  // with reproject the hits of the last frame are moved to where they land
+  // in this one, and a pixel that one lands on only traces a few steps in
+  // front of it to check that its ray still hits the same voxel first. it
+  // traces in full when none did, the check fails, or the way there crosses
+  // an edited brick. frames whose rays would trace fewer steps than that
+  // check, like behind the pre-pass, leave it out
+  bool reproject;
+  cpu_renderer(const world *n_world, thread_pool *n_pool, int n_width
+      , int n_height, int n_tile_size = 32);
+  void render(float time);
+  // has the next frame trace the pixels whose rays cross a brick of b in
+  // full. b is in voxels
+  void invalidate(const box &b);
+  void print_stats() const;
+  void write_ppm(const char *path) const;
+};
+
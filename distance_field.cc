@@ -0,0 +1,153 @@
+#include "distance_field.hh"
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+// a brick with voxels further away than this along some axis is
+// distance_cap or more away, so the passes look no further
+static const int reach = distance_cap - 1;
+
+// the passes run over chunk values at a time in loops of a fixed length,
+// which the compiler turns into vector instructions. rows of the buffer are
+// padded to a multiple of it
+static const int chunk = 16;
+
+static int floor_mod(int x, int n) {
+  return ((x % n) + n) % n;
+}
+
+// out may overlap a and b as far as the compiler knows, it goes through a
+// copy so that no check for that is needed
+static void minmax_chunk(uint8_t *out, const uint8_t *a, const uint8_t *b
+    , uint8_t d) {
+  uint8_t next[chunk];
+  for (int k = 0; k < chunk; k++)
+    next[k] = std::min(out[k], std::max(d, std::min(a[k], b[k])));
+  memcpy(out, next, chunk);
+}
+
+// the min-max transform of rows lines side by side, lanes values each:
+// out[i] = min over |i - j| <= reach of max(|i - j|, in[j]). lines past the
+// ends wrap around with periodic, and are left out otherwise. lanes is a
+// multiple of chunk
+static void minmax_lines(const uint8_t *in, uint8_t *out, int rows, int lanes
+    , bool periodic) {
+  for (int i = 0; i < rows; i++) {
+    uint8_t *o = out + (size_t)i * lanes;
+    memcpy(o, in + (size_t)i * lanes, lanes);
+    for (int r = 1; r <= reach; r++) {
+      int a = i - r, b = i + r;
+      if (periodic) {
+        a = floor_mod(a, rows);
+        b = floor_mod(b, rows);
+      }
+      if (a < 0 && b >= rows)
+        break;
+      const uint8_t *pa = in + (size_t)(a < 0 ? b : a) * lanes
+        , *pb = in + (size_t)(b >= rows ? a : b) * lanes;
+      for (int k = 0; k < lanes; k += chunk)
+        minmax_chunk(o + k, pa + k, pb + k, r);
+    }
+  }
+}
+
+// the same along a single line of n values, padded by reach on both sides
+// in line, which gets overwritten. out is rounded up to a multiple of chunk,
+// and line has room for that
+static void minmax_line(uint8_t *line, uint8_t *out, int n, bool periodic) {
+  for (int i = 0; i < reach; i++) {
+    line[i] = periodic ? line[reach + floor_mod(i - reach, n)] : distance_cap;
+    line[reach + n + i] = periodic ? line[reach + floor_mod(i, n)]
+      : distance_cap;
+  }
+  const int padded = (n + chunk - 1) / chunk * chunk;
+  memcpy(out, line + reach, padded);
+  for (int r = 1; r <= reach; r++)
+    for (int k = 0; k < padded; k += chunk)
+      minmax_chunk(out + k, line + reach - r + k, line + reach + r + k, r);
+}
+
+void distance_transform(const world *w, const int lo[3], const int hi[3]
+    , uint8_t *field, thread_pool *pool) {
+  const int size[3] = { (int)w->bw, (int)w->bh, (int)w->bd };
+  // an axis the box covers whole wraps around, the others are padded by
+  // reach. the bricks near the ends of a padded axis come out too far, but
+  // none of the box depends on them
+  int origin[3], n[3], inner[3];
+  bool periodic[3], whole = true;
+  for (int i = 0; i < 3; i++) {
+    periodic[i] = hi[i] - lo[i] >= size[i];
+    origin[i] = periodic[i] ? 0 : lo[i] - reach;
+    n[i] = periodic[i] ? size[i] : hi[i] - lo[i] + 2 * reach;
+    inner[i] = periodic[i] ? 0 : reach;
+    whole = whole && periodic[i];
+  }
+  const size_t row = (n[0] + chunk - 1) / chunk * chunk
+    , plane = row * n[1];
+  // the whole world is transformed in place when its rows need no padding
+  const bool in_place = whole && row == (size_t)n[0];
+  std::vector<uint8_t> padded;
+  if (!in_place)
+    padded.resize(plane * n[2]);
+  uint8_t *buffer = in_place ? field : padded.data();
+
+  // bricks with voxels in them at 0, like in the occupancy pyramid, the
+  // empty ones as far as the transform reaches
+  pool->parallel_for(n[2], [&](size_t z, int) {
+    const uint32_t bz = floor_mod(origin[2] + (int)z, size[2]);
+    for (int y = 0; y < n[1]; y++) {
+      const uint32_t by = floor_mod(origin[1] + y, size[1]);
+      uint8_t *r = buffer + z * plane + y * row;
+      for (int x = 0; x < n[0]; x++) {
+        uint8_t value;
+        const bool empty = w->uniform_brick(floor_mod(origin[0] + x, size[0])
+            , by, bz, value) && value == 0;
+        r[x] = empty ? distance_cap : 0;
+      }
+    }
+  });
+
+  pool->parallel_for(n[2], [&](size_t z, int) {
+    std::vector<uint8_t> line(row + 2 * reach);
+    for (int y = 0; y < n[1]; y++) {
+      uint8_t *r = buffer + z * plane + y * row;
+      memcpy(&line[reach], r, row);
+      minmax_line(&line[0], r, n[0], periodic[0]);
+    }
+  });
+  pool->parallel_for(n[2], [&](size_t z, int) {
+    std::vector<uint8_t> in(buffer + z * plane, buffer + (z + 1) * plane);
+    minmax_lines(&in[0], buffer + z * plane, n[1], row, periodic[1]);
+  });
+  // along z the rows of a plane of constant y are gathered first
+  pool->parallel_for(n[1], [&](size_t y, int) {
+    std::vector<uint8_t> in((size_t)n[2] * row), out(in.size());
+    for (int z = 0; z < n[2]; z++)
+      memcpy(&in[z * row], buffer + z * plane + y * row, row);
+    minmax_lines(&in[0], &out[0], n[2], row, periodic[2]);
+    for (int z = 0; z < n[2]; z++)
+      memcpy(buffer + z * plane + y * row, &out[z * row], row);
+  });
+
+  if (in_place)
+    return;
+  // the box goes back into the field, all of a wrapped axis. a row of it
+  // wraps around the end of the world at most once
+  int from[3], out_n[3];
+  for (int i = 0; i < 3; i++) {
+    from[i] = periodic[i] ? 0 : floor_mod(lo[i], size[i]);
+    out_n[i] = periodic[i] ? size[i] : hi[i] - lo[i];
+  }
+  const int head = std::min(out_n[0], size[0] - from[0]);
+  pool->parallel_for(out_n[2], [&](size_t k, int) {
+    const size_t z = floor_mod(from[2] + k, size[2]);
+    for (int j = 0; j < out_n[1]; j++) {
+      const size_t y = floor_mod(from[1] + j, size[1]);
+      const uint8_t *in = buffer + (inner[2] + k) * plane
+        + (inner[1] + j) * row + inner[0];
+      uint8_t *out = field + (z * size[1] + y) * size[0];
+      memcpy(out + from[0], in, head);
+      memcpy(out, in + head, out_n[0] - head);
+    }
+  });
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include "world.hh"
+#include "thread_pool.hh"
+
+// the distance field of the bricks of [lo, hi), in unwrapped brick
+// coordinates, written into field at their place in the repeating world.
+// field holds a byte per brick of w, laid out x first. the transform is
+// separable: a min-max pass along x, then y, then z, each on pool. only the
+// bricks within distance_cap - 1 of the box are looked at in w, an axis that
+// the box covers whole is transformed with wrap around instead
+void distance_transform(const world *w, const int lo[3], const int hi[3]
+    , uint8_t *field, thread_pool *pool);
@@ -0,0 +1,38 @@
+#include "dynamic_resolution.hh"
+#include <algorithm>
+#include <cmath>
+
+// frames below rise_margin of the budget count as comfortable, and this
+// many of them in a row raise the scale a step
+static const double rise_margin = 0.8;
+static const uint32_t rise_frames = 30;
+
+resolution_scaler::resolution_scaler(double n_target_ms, float n_min_scale
+    , float n_max_scale)
+  : _target_ms(n_target_ms), _full_ms(-1), _frames_under(0)
+    , scale(n_max_scale), min_scale(n_min_scale), max_scale(n_max_scale)
+    , changes(0) {}
+
+void resolution_scaler::update(double gpu_ms, float frame_scale) {
+  const double full_ms = gpu_ms / (frame_scale * frame_scale);
+  _full_ms = _full_ms < 0 ? full_ms : _full_ms * 0.8 + full_ms * 0.2;
+  const double ms = _full_ms * scale * scale;
+  float next = scale;
+  if (ms > _target_ms) {
+    // straight down to the largest step that fits
+    next = floorf(sqrtf(_target_ms / _full_ms) / step) * step;
+    _frames_under = 0;
+  } else if (ms < _target_ms * rise_margin
+      && _full_ms * (scale + step) * (scale + step) < _target_ms) {
+    if (++_frames_under >= rise_frames) {
+      next = scale + step;
+      _frames_under = 0;
+    }
+  } else
+    _frames_under = 0;
+  next = std::min(std::max(next, min_scale), max_scale);
+  if (next != scale) {
+    scale = next;
+    changes++;
+  }
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstdint>
+
+// picks the fraction of the window's width and height frames are raymarched
+// at, so that their gpu time stays under a budget. the cost of a frame is
+// taken to grow with its pixels, so a measurement at one scale predicts the
+// others.
+//
+// the scale moves in steps and with hysteresis, so that it does not pump
+// back and forth around the budget: it drops as soon as the smoothed cost
+// goes over the budget, but only rises a step at a time after the frames
+// have fit comfortably for a while
+class resolution_scaler {
+  double _target_ms, _full_ms; // smoothed cost at a scale of 1
+  uint32_t _frames_under;
+public:
+  static constexpr float step = 0.05f;
+  float scale, min_scale, max_scale;
+  uint32_t changes;
+  resolution_scaler(double n_target_ms, float n_min_scale = 0.25f
+      , float n_max_scale = 1.f);
+  // the gpu time of a frame that was rendered at frame_scale, which is not
+  // scale when the time is read back a few frames late
+  void update(double gpu_ms, float frame_scale);
+};
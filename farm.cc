@@ -0,0 +1,398 @@
+#include "farm.hh"
+#include "world_file.hh"
+#include "cpu_renderer.hh"
+#include "utils.hh"
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <chrono>
+#include <deque>
+#include <memory>
+
+static const uint32_t farm_magic = 0x464B4656; // "VFKF"
+static const int tile_words = 16, pixels_words = 5;
+// a worker that stops halfway through its hello is given up on after that.
+// the pixels of a tile are read as they come, under tile_timeout
+static const int message_timeout_seconds = 10;
+
+static double now_seconds() {
+  return std::chrono::duration<double>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void put32(std::vector<uint8_t> &out, uint32_t x) {
+  for (int i = 0; i < 4; i++)
+    out.push_back(x >> 8 * i);
+}
+
+static uint32_t get32(const uint8_t *p) {
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static bool read_all(int fd, void *data, size_t size) {
+  uint8_t *p = (uint8_t*)data;
+  while (size > 0) {
+    const ssize_t n = recv(fd, p, size, 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+// without a SIGPIPE when the other end is gone
+static bool write_all(int fd, const void *data, size_t size) {
+  const uint8_t *p = (const uint8_t*)data;
+  while (size > 0) {
+    const ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+static bool read_words(int fd, uint32_t *words, int count) {
+  std::vector<uint8_t> bytes(count * 4);
+  if (!read_all(fd, &bytes[0], bytes.size()))
+    return false;
+  for (int i = 0; i < count; i++)
+    words[i] = get32(&bytes[i * 4]);
+  return true;
+}
+
+static bool unix_address(const char *path, sockaddr_un &addr) {
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path))
+    return false;
+  strcpy(addr.sun_path, path);
+  return true;
+}
+
+farm_coordinator::farm_coordinator(const char *n_path)
+  : _listen_fd(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0))
+    , _path(n_path), _frame(0), late_factor(3), tile_timeout(60)
+    , connect_timeout(10) {
+  sockaddr_un addr;
+  assertf(unix_address(n_path, addr), "socket path %s is too long", n_path);
+  assertf(_listen_fd >= 0 && bind(_listen_fd, (sockaddr*)&addr
+        , sizeof(addr)) == 0 && listen(_listen_fd, 64) == 0
+      , "failed to listen on %s: %s", n_path, strerror(errno));
+}
+
+farm_coordinator::~farm_coordinator() {
+  for (const worker &wk : _workers)
+    if (wk.fd >= 0)
+      close(wk.fd);
+  close(_listen_fd);
+  unlink(_path.c_str());
+}
+
+void farm_coordinator::accept_worker() {
+  // not inherited by the worker processes started after it, so that the
+  // connection closes when the coordinator closes it
+  const int fd = accept4(_listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+  if (fd < 0)
+    return;
+  const timeval timeout = { message_timeout_seconds, 0 };
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  uint32_t hello[3];
+  if (!read_words(fd, hello, 3) || hello[0] != farm_magic
+      || hello[1] != farm_version) {
+    printf("farm: turned away a worker that does not speak version %u\n"
+        , farm_version);
+    close(fd);
+    return;
+  }
+  _workers.push_back(worker { fd, (int)hello[2], -1, 0, 0., 0, 0, {}, 0
+      , 0. });
+}
+
+bool farm_coordinator::send_tile(const worker &wk, const farm_frame &f
+    , int x0, int y0, int x1, int y1) {
+  uint32_t time;
+  memcpy(&time, &f.time, 4);
+  const uint32_t header[tile_words] = { (uint32_t)wk.tile
+    , (uint32_t)f.width, (uint32_t)f.height, (uint32_t)x0, (uint32_t)y0
+    , (uint32_t)x1, (uint32_t)y1, time, (uint32_t)f.max_ray_steps, f.flags
+    , (uint32_t)f.prepass_block, f.format, f.world_w, f.world_h, f.world_d
+    , (uint32_t)f.world_path.size() };
+  std::vector<uint8_t> message;
+  for (uint32_t word : header)
+    put32(message, word);
+  message.insert(message.end(), f.world_path.begin(), f.world_path.end());
+  message.resize((message.size() + 3) / 4 * 4, 0);
+  return write_all(wk.fd, &message[0], message.size());
+}
+
+// reads what the worker has sent of its pixels message so far, without
+// waiting for the rest, so that a slow worker holds up none of the others.
+// false when it is gone, or when the header is not that of its tile
+bool farm_coordinator::receive(worker &wk) {
+  if (wk.tile < 0)
+    return false;
+  const size_t header_bytes = pixels_words * 4
+    , size = header_bytes + (size_t)wk.width * wk.height * 4;
+  std::vector<uint8_t> &in = wk.received;
+  while (in.size() < size) {
+    // the header first, which is checked before anything is sized by it
+    const size_t have = in.size()
+      , want = have < header_bytes ? header_bytes : size;
+    in.resize(want);
+    const ssize_t n = recv(wk.fd, &in[have], want - have, MSG_DONTWAIT);
+    in.resize(have + std::max(n, (ssize_t)0));
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return true;
+    if (n <= 0)
+      return false;
+    if (have >= header_bytes || in.size() < header_bytes)
+      continue;
+    const uint32_t width = get32(&in[4]), height = get32(&in[8]);
+    if ((int)get32(&in[0]) != wk.tile)
+      return false;
+    if ((int)width != wk.width || (int)height != wk.height) {
+      printf("farm: a worker sent a %ux%u tile for a %dx%d one\n", width
+          , height, wk.width, wk.height);
+      return false;
+    }
+  }
+  return true;
+}
+
+std::vector<uint32_t> farm_coordinator::render(const farm_frame &f
+    , int tile_size) {
+  const double begin = now_seconds();
+  _frame++;
+  stats = farm_stats();
+  const int tiles_x = (f.width + tile_size - 1) / tile_size
+    , tiles = tiles_x * ((f.height + tile_size - 1) / tile_size);
+  std::vector<uint32_t> pixels((size_t)f.width * f.height, 0);
+  // copies is how many workers have a tile, a late one gets a second
+  std::vector<bool> done(tiles, false);
+  std::vector<int> copies(tiles, 0);
+  std::deque<int> pending;
+  for (int i = 0; i < tiles; i++)
+    pending.push_back(i);
+  int remaining = tiles, finished = 0;
+  double tile_seconds = 0, alive = begin;
+
+  auto drop = [&](worker &wk) {
+    close(wk.fd);
+    wk.fd = -1;
+    wk.received.clear();
+    stats.workers_lost++;
+    if (wk.tile >= 0 && wk.frame == _frame && --copies[wk.tile] == 0
+        && !done[wk.tile]) {
+      pending.push_front(wk.tile);
+      stats.redispatched++;
+    }
+    wk.tile = -1;
+  };
+
+  while (remaining > 0) {
+    const double now = now_seconds();
+    // a hung worker would keep its tile forever, a late copy of it included
+    for (worker &wk : _workers)
+      if (wk.fd >= 0 && wk.tile >= 0 && now - wk.sent > tile_timeout) {
+        printf("farm: dropped a worker that had a tile for %g seconds\n"
+            , tile_timeout);
+        drop(wk);
+      }
+    // hands out the pending tiles first, then the one out the longest once
+    // it is late
+    for (worker &wk : _workers) {
+      if (wk.fd < 0 || wk.tile >= 0)
+        continue;
+      while (!pending.empty() && done[pending.front()])
+        pending.pop_front();
+      int tile = -1;
+      if (!pending.empty()) {
+        tile = pending.front();
+        pending.pop_front();
+      } else if (finished > 0) {
+        double oldest = late_factor * tile_seconds / finished;
+        for (const worker &other : _workers)
+          if (other.fd >= 0 && other.tile >= 0 && other.frame == _frame
+              && copies[other.tile] == 1 && now - other.sent > oldest) {
+            oldest = now - other.sent;
+            tile = other.tile;
+          }
+        if (tile >= 0)
+          stats.redispatched++;
+      }
+      if (tile < 0)
+        break;
+      const int x0 = tile % tiles_x * tile_size
+        , y0 = tile / tiles_x * tile_size
+        , x1 = std::min(x0 + tile_size, f.width)
+        , y1 = std::min(y0 + tile_size, f.height);
+      wk.tile = tile;
+      wk.frame = _frame;
+      wk.sent = now;
+      wk.width = x1 - x0;
+      wk.height = y1 - y0;
+      copies[tile]++;
+      if (!send_tile(wk, f, x0, y0, x1, y1))
+        drop(wk);
+    }
+
+    std::vector<pollfd> fds(1, pollfd { _listen_fd, POLLIN, 0 });
+    std::vector<worker*> polled;
+    for (worker &wk : _workers)
+      if (wk.fd >= 0) {
+        fds.push_back(pollfd { wk.fd, POLLIN, 0 });
+        polled.push_back(&wk);
+      }
+    if (!polled.empty())
+      alive = now;
+    else
+      assertf(now - alive < connect_timeout, "no worker connected for %g "
+          "seconds, %d of %d tiles left", connect_timeout, remaining, tiles);
+    // wakes up now and then to look for late tiles
+    if (poll(&fds[0], fds.size(), 100) <= 0)
+      continue;
+    for (size_t i = 0; i < polled.size(); i++) {
+      if (!fds[i + 1].revents)
+        continue;
+      worker &wk = *polled[i];
+      if (!receive(wk)) {
+        drop(wk);
+        continue;
+      }
+      if (wk.received.size() < (pixels_words + (size_t)wk.width * wk.height)
+          * 4)
+        continue;
+      std::vector<uint8_t> message;
+      message.swap(wk.received);
+      const uint8_t *in = &message[0];
+      const int tile = wk.tile;
+      const double seconds = now_seconds() - wk.sent;
+      wk.tile = -1;
+      wk.busy_seconds += seconds;
+      // from a worker that fell behind on the last frame
+      if (wk.frame != _frame)
+        continue;
+      copies[tile]--;
+      if (done[tile]) {
+        stats.duplicates++;
+        continue;
+      }
+      const int x0 = tile % tiles_x * tile_size
+        , y0 = tile / tiles_x * tile_size;
+      for (int y = 0; y < wk.height; y++)
+        for (int x = 0; x < wk.width; x++)
+          pixels[(size_t)(y0 + y) * f.width + x0 + x] = get32(in
+              + (pixels_words + (size_t)y * wk.width + x) * 4);
+      done[tile] = true;
+      remaining--;
+      finished++;
+      tile_seconds += seconds;
+      wk.tiles++;
+      stats.steps += get32(in + 12) | (uint64_t)get32(in + 16) << 32;
+    }
+    // last, it moves the workers polled points into
+    if (fds[0].revents & POLLIN)
+      accept_worker();
+  }
+  stats.tiles = tiles;
+  stats.rays = (uint64_t)f.width * f.height;
+  stats.seconds = now_seconds() - begin;
+  return pixels;
+}
+
+void farm_coordinator::print_stats() const {
+  int connected = 0;
+  for (const worker &wk : _workers)
+    connected += wk.fd >= 0;
+  printf("farm: %d tiles in %.2f s on %d workers, %7.2f Mrays/s, %5.1f "
+      "steps/ray\n", stats.tiles, stats.seconds, connected
+      , stats.rays / stats.seconds / 1e6, (double)stats.steps / stats.rays);
+  printf("  %d tiles sent again, %d duplicates thrown away, %d workers lost\n"
+      , stats.redispatched, stats.duplicates, stats.workers_lost);
+  for (size_t i = 0; i < _workers.size(); i++)
+    printf("  worker %2zu: %2d threads, %5d tiles, %7.2f s busy%s\n", i
+        , _workers[i].threads, _workers[i].tiles, _workers[i].busy_seconds
+        , _workers[i].fd < 0 ? ", lost" : "");
+}
+
+void run_farm_worker(const char *path, int threads) {
+  sockaddr_un addr;
+  const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  assertf(unix_address(path, addr), "socket path %s is too long", path);
+  assertf(fd >= 0 && connect(fd, (sockaddr*)&addr, sizeof(addr)) == 0
+      , "failed to connect to %s: %s", path, strerror(errno));
+  thread_pool pool(threads);
+  std::vector<uint8_t> hello;
+  put32(hello, farm_magic);
+  put32(hello, farm_version);
+  put32(hello, pool.size());
+  if (!write_all(fd, &hello[0], hello.size()))
+    die("lost the coordinator at %s", path);
+
+  // the world of the last tile, loaded again for another path or format.
+  // a tile that needs a field the world lacks has it computed then, the
+  // fields stay with the world for the tiles after it
+  std::unique_ptr<world> w;
+  std::string world_path;
+  uint32_t header[tile_words];
+  while (read_words(fd, header, tile_words)) {
+    std::string tile_path((header[15] + 3) / 4 * 4, 0);
+    if (!tile_path.empty() && !read_all(fd, &tile_path[0], tile_path.size()))
+      break;
+    tile_path.resize(header[15]);
+    const uint32_t flags = header[9];
+    const voxel_format format = (voxel_format)header[11];
+    if (!w || tile_path != world_path || w->format != format) {
+      w.reset(load_world(tile_path.c_str(), &pool, format));
+      world_path = tile_path;
+      w->update_occupancy();
+    }
+    if (flags & farm_distance_field)
+      w->enable_distance_field(&pool);
+    if (flags & farm_ambient_occlusion)
+      w->enable_ambient_occlusion(&pool);
+    assertf(w->w == header[12] && w->h == header[13] && w->d == header[14]
+        , "%s holds a %ux%ux%u world rather than a %ux%ux%u one"
+        , world_path.c_str(), w->w, w->h, w->d, header[12], header[13]
+        , header[14]);
+    const int x0 = header[3], y0 = header[4], x1 = header[5], y1 = header[6];
+    cpu_renderer r(w.get(), &pool, x1 - x0, y1 - y0);
+    r.frame_x = x0;
+    r.frame_y = y0;
+    r.frame_width = header[1];
+    r.frame_height = header[2];
+    r.max_ray_steps = header[8];
+    r.hierarchical = flags & farm_hierarchical;
+    r.distance_field = flags & farm_distance_field;
+    r.ambient_occlusion = flags & farm_ambient_occlusion;
+    r.prepass_block = header[10];
+    float time;
+    memcpy(&time, &header[7], 4);
+    r.render(time);
+
+    std::vector<uint8_t> message;
+    message.reserve((pixels_words + r.pixels.size()) * 4);
+    put32(message, header[0]);
+    put32(message, r.width);
+    put32(message, r.height);
+    put32(message, r.stats.steps);
+    put32(message, r.stats.steps >> 32);
+    for (uint32_t p : r.pixels)
+      put32(message, p);
+    if (!write_all(fd, &message[0], message.size()))
+      break;
+  }
+  close(fd);
+}
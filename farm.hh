@@ -0,0 +1,102 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+// frames too large or too slow for one process are split into tiles that
+// worker processes render with the cpu renderer. workers connect to the
+// coordinator's socket and render one tile at a time. everything is sent
+// little endian, as messages of 32 bit words:
+//
+//   hello   worker to coordinator once: magic "VFKF", farm_version and its
+//           number of threads
+//   tile    coordinator to worker: tile id, the frame's width and height,
+//           the tile's x0, y0, x1, y1 from the top left, the time as float
+//           bits, max ray steps, flags, pre-pass block, voxel format, the
+//           world's w, h and d, then the length of the world's path and the
+//           path, padded to a word
+//   pixels  worker to coordinator: tile id, the tile's width and height, the
+//           steps its rays took as 64 bits, then 0xRRGGBB per pixel of the
+//           tile, top row first
+//
+// the world travels by reference, as the path of a .vfk file that every
+// worker maps, which is shared through the page cache between the processes
+// on one machine and can live on a shared file system for several. a worker
+// loads it on the first tile with its path and voxel format, adds the
+// distance field and occlusion when a tile first asks for them, and checks
+// its size against the tile's. a worker exits when the coordinator closes
+// its connection
+const uint32_t farm_version = 1;
+const uint32_t farm_hierarchical = 1, farm_distance_field = 2
+  , farm_ambient_occlusion = 4;
+
+// what every tile of a frame is rendered with, see cpu_renderer
+struct farm_frame {
+  std::string world_path;
+  uint32_t format; // a voxel_format
+  uint32_t world_w, world_h, world_d;
+  int width, height;
+  float time;
+  int max_ray_steps;
+  uint32_t flags;
+  int prepass_block;
+};
+
+struct farm_stats {
+  double seconds;
+  int tiles;
+  int redispatched; // tiles sent again because their worker died or lagged
+  int duplicates; // results thrown away because another copy came first
+  int workers_lost;
+  uint64_t rays, steps;
+};
+
+class farm_coordinator {
+  // in the order they connected, the lost ones with fd -1
+  struct worker {
+    int fd;
+    int threads;
+    int tile; // -1 when idle
+    uint64_t frame; // the tile's
+    double sent; // when the tile went out
+    int width, height; // of the tile
+    std::vector<uint8_t> received; // of its pixels message, so far
+    int tiles; // rendered and kept, over all frames
+    double busy_seconds;
+  };
+  int _listen_fd;
+  std::string _path;
+  std::vector<worker> _workers;
+  uint64_t _frame;
+  void accept_worker();
+  bool send_tile(const worker &wk, const farm_frame &f, int x0, int y0
+      , int x1, int y1);
+  bool receive(worker &wk);
+public:
+  farm_stats stats;
+  // a tile that has been out for late_factor times as long as the tiles
+  // took on average is sent again to the next idle worker, and the first of
+  // the copies to come back is kept
+  double late_factor;
+  // a worker that has not sent back its tile tile_timeout seconds after it
+  // went out is dropped, like one that died, and the tile goes to another
+  double tile_timeout;
+  // with no worker connected for that long render() gives up
+  double connect_timeout;
+  // listens on the unix socket at n_path, which must not exist yet
+  farm_coordinator(const char *n_path);
+  // closes every connection, which has the workers exit, and removes the
+  // socket
+  ~farm_coordinator();
+  const std::string &path() const { return _path; }
+  // renders the frame in tiles of tile_size^2 pixels on whichever workers
+  // are or get connected, and returns its pixels 0xRRGGBB, top row first.
+  // workers stay connected for the next frame
+  std::vector<uint32_t> render(const farm_frame &f, int tile_size);
+  void print_stats() const;
+};
+
+// connects to the coordinator at path and renders the tiles it is sent on a
+// pool of threads, until the coordinator closes the connection
+void run_farm_worker(const char *path, int threads);
@@ -0,0 +1,237 @@
+#include "generator.hh"
+#include "utils.hh"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+// the brick kernels are compiled a second time for avx2 and picked at load
+// time, their loops over rows of a brick vectorize
+#define generator_kernel __attribute__((target_clones("avx2", "default")))
+
+static inline uint32_t fmix32(uint32_t h) {
+  h ^= h >> 16;
+  h *= 0x85EBCA6Bu;
+  h ^= h >> 13;
+  h *= 0xC2B2AE35u;
+  h ^= h >> 16;
+  return h;
+}
+
+static inline uint32_t fold(int64_t x) {
+  return (uint32_t)x ^ (uint32_t)((uint64_t)x >> 32);
+}
+
+// hash32() split in two, so that a row of a brick only redoes the x part
+static inline uint32_t hash_yz(uint32_t seed, int64_t y, int64_t z) {
+  return seed ^ fold(y) * 0xD8163841u ^ fold(z) * 0xCB1AB31Fu;
+}
+
+static inline uint32_t hash_x(uint32_t yz, int64_t x) {
+  return fmix32(yz ^ fmix32(fold(x) * 0x8DA6B343u));
+}
+
+uint32_t hash32(uint32_t seed, int64_t x, int64_t y, int64_t z) {
+  return hash_x(hash_yz(seed, y, z), x);
+}
+
+static inline float lattice_value(uint32_t seed, int64_t x, int64_t y
+    , int64_t z) {
+  return (hash32(seed, x, y, z) & 0xFFFF) * (2.f / 0xFFFF) - 1.f;
+}
+
+static inline float lerp(float a, float b, float t) {
+  return a + (b - a) * t;
+}
+
+// weight of the upper lattice point at offset o into a cell of period voxels
+static inline float smooth_weight(uint32_t o, uint32_t period) {
+  const float t = (float)o / period;
+  return t * t * (3.f - 2.f * t);
+}
+
+static uint32_t period_shift(uint32_t period) {
+  uint32_t shift = 0;
+  while (1u << shift < period)
+    shift++;
+  assertf(1u << shift == period && period >= brick_size, "noise period %u "
+      "is not a power of two of at least %u", period, brick_size);
+  return shift;
+}
+
+// the 8 lattice values around the cell that contains x, y, z, x first
+static void cell_corners(uint32_t seed, int64_t x, int64_t y, int64_t z
+    , uint32_t shift, float c[8]) {
+  const int64_t cx = x >> shift, cy = y >> shift, cz = z >> shift;
+  for (int i = 0; i < 8; i++)
+    c[i] = lattice_value(seed, cx + (i & 1), cy + (i >> 1 & 1), cz + (i >> 2));
+}
+
+static inline float trilinear(const float c[8], float wx, float wy
+    , float wz) {
+  return lerp(lerp(lerp(c[0], c[1], wx), lerp(c[2], c[3], wx), wy)
+      , lerp(lerp(c[4], c[5], wx), lerp(c[6], c[7], wx), wy), wz);
+}
+
+float value_noise(uint32_t seed, int64_t x, int64_t y, int64_t z
+    , uint32_t period) {
+  const uint32_t shift = period_shift(period), m = period - 1;
+  float c[8];
+  cell_corners(seed, x, y, z, shift, c);
+  return trilinear(c, smooth_weight(x & m, period)
+      , smooth_weight(y & m, period), smooth_weight(z & m, period));
+}
+
+float sd_sphere(float x, float y, float z, float radius) {
+  return sqrtf(x * x + y * y + z * z) - radius;
+}
+
+float sd_box(float x, float y, float z, float bx, float by, float bz) {
+  const float dx = fabsf(x) - bx, dy = fabsf(y) - by, dz = fabsf(z) - bz
+    , ox = std::max(dx, 0.f), oy = std::max(dy, 0.f), oz = std::max(dz, 0.f);
+  return std::min(std::max(dx, std::max(dy, dz)), 0.f)
+    + sqrtf(ox * ox + oy * oy + oz * oz);
+}
+
+random_generator::random_generator(uint32_t n_seed, float n_fill)
+  : _seed(n_seed), _fill(n_fill) {}
+
+// the x part of the hash is the same for every row of the brick, so a row
+// is a single fmix32() per voxel in 32 bit lanes
+generator_kernel
+static void random_brick(uint32_t seed, int64_t x0, int64_t y0, int64_t z0
+    , uint8_t *voxels) {
+  uint32_t hx[brick_size];
+  for (uint32_t x = 0; x < brick_size; x++)
+    hx[x] = fmix32(fold(x0 + x) * 0x8DA6B343u);
+  uint32_t hyz[brick_size * brick_size];
+  for (uint32_t row = 0; row < brick_size * brick_size; row++)
+    hyz[row] = hash_yz(seed, y0 + row % brick_size, z0 + row / brick_size);
+  for (uint32_t i = 0; i < brick_voxels; i++)
+    voxels[i] = -(fmix32(hyz[i / brick_size] ^ hx[i % brick_size]) & 1);
+}
+
+void random_generator::brick(int64_t x0, int64_t y0, int64_t z0
+    , uint8_t *voxels) const {
+  // bricks are picked by a hash of their own, with another seed than the
+  // voxels
+  if (_fill < 1.f && (hash32(~_seed, x0 >> brick_shift, y0 >> brick_shift
+          , z0 >> brick_shift) & 1023) >= _fill * 1024) {
+    memset(voxels, 0, brick_voxels);
+    return;
+  }
+  random_brick(_seed, x0, y0, z0, voxels);
+}
+
+density_generator::density_generator(uint32_t n_seed, float n_density)
+  : _seed(n_seed), _density(n_density) {}
+
+void density_generator::brick(int64_t x0, int64_t y0, int64_t z0
+    , uint8_t *voxels) const {
+  const uint64_t threshold = _density * 4294967296.;
+  for (uint32_t i = 0; i < brick_voxels; i++)
+    voxels[i] = hash32(_seed, x0 + i % brick_size
+        , y0 + i / brick_size % brick_size, z0 + i / (brick_size * brick_size))
+      < threshold ? 255 : 0;
+}
+
+terrain_generator::terrain_generator(uint32_t n_seed) : _seed(n_seed) {}
+
+// adds an octave of value noise to a brick of densities. the period is at
+// least a brick, so the whole brick lies in one lattice cell
+generator_kernel
+static void add_octave(float *density, const float c[8], const float *wx
+    , const float *wy, const float *wz, float amplitude) {
+  for (uint32_t z = 0; z < brick_size; z++)
+    for (uint32_t y = 0; y < brick_size; y++, density += brick_size)
+      for (uint32_t x = 0; x < brick_size; x++)
+        density[x] += amplitude * trilinear(c, wx[x], wy[y], wz[z]);
+}
+
+void terrain_generator::brick(int64_t x0, int64_t y0, int64_t z0
+    , uint8_t *voxels) const {
+  // the octaves add up to less than 2 either way, so the ground is all air
+  // above y = 32 and all rock below y = -32 and only the bricks in between
+  // need the noise
+  if (y0 >= 32) {
+    memset(voxels, 0, brick_voxels);
+    return;
+  }
+  if (y0 + (int64_t)brick_size <= -32)
+    memset(voxels, 255, brick_voxels);
+  else {
+    float density[brick_voxels];
+    for (uint32_t i = 0; i < brick_voxels; i++)
+      density[i] = -(float)(y0 + (i >> brick_shift) % brick_size) / 16.f;
+    static const uint32_t periods[] = { 64, 32, 16, 8 };
+    float amplitude = 1.f;
+    for (uint32_t octave = 0; octave < 4; octave++, amplitude *= 0.5f) {
+      const uint32_t period = periods[octave], m = period - 1;
+      float c[8], wx[brick_size], wy[brick_size], wz[brick_size];
+      cell_corners(_seed + octave, x0, y0, z0, period_shift(period), c);
+      for (uint32_t i = 0; i < brick_size; i++) {
+        wx[i] = smooth_weight((x0 + i) & m, period);
+        wy[i] = smooth_weight((y0 + i) & m, period);
+        wz[i] = smooth_weight((z0 + i) & m, period);
+      }
+      add_octave(density, c, wx, wy, wz, amplitude);
+    }
+    for (uint32_t i = 0; i < brick_voxels; i++)
+      voxels[i] = density[i] > 0.f ? 255 : 0;
+  }
+
+  // a cave stays 1 voxel inside its cell, so that only the brick's own
+  // cell has to be looked at
+  const int64_t cx = x0 >> 5, cy = y0 >> 5, cz = z0 >> 5;
+  const uint32_t h = hash32(_seed ^ 0xCA7E, cx, cy, cz), shape = h & 3;
+  if (shape > 1)
+    return;
+  const float center[3] = { (float)(cx * 32 + 12 + (h >> 2) % 9)
+    , (float)(cy * 32 + 12 + (h >> 6) % 9)
+    , (float)(cz * 32 + 12 + (h >> 10) % 9) }
+    , size = 4.f + (h >> 14) % 8, corner[3] = { (float)x0, (float)y0
+      , (float)z0 };
+  // both shapes fit in a cube of size around the center
+  for (int axis = 0; axis < 3; axis++)
+    if (center[axis] + size <= corner[axis]
+        || center[axis] - size >= corner[axis] + brick_size)
+      return;
+  for (uint32_t z = 0, i = 0; z < brick_size; z++)
+    for (uint32_t y = 0; y < brick_size; y++)
+      for (uint32_t x = 0; x < brick_size; x++, i++) {
+        const float px = x0 + x + 0.5f - center[0]
+          , py = y0 + y + 0.5f - center[1], pz = z0 + z + 0.5f - center[2];
+        if (shape == 0 ? sd_sphere(px, py, pz, size) < 0.f
+            : sd_box(px, py, pz, size, size * 0.5f, size) < 0.f)
+          voxels[i] = 0;
+      }
+}
+
+void generate(world *w, const generator &g, thread_pool *pool) {
+  const uint32_t slab_bricks = w->bw * w->bh
+    , batch = std::min<uint32_t>(std::max(pool->size() * 2, 1), w->bd);
+  std::vector<std::vector<uint8_t>> slabs(batch
+      , std::vector<uint8_t>((uint64_t)slab_bricks * brick_voxels));
+  for (uint32_t first = 0; first < w->bd; first += batch) {
+    const uint32_t n = std::min(batch, w->bd - first);
+    pool->parallel_for(n, [&](size_t i, int) {
+      for (uint32_t b = 0; b < slab_bricks; b++)
+        g.brick((int64_t)(b % w->bw) * brick_size
+            , (int64_t)(b / w->bw) * brick_size
+            , (int64_t)(first + i) * brick_size
+            , &slabs[i][(uint64_t)b * brick_voxels]);
+    });
+    for (uint32_t i = 0; i < n; i++)
+      for (uint32_t b = 0; b < slab_bricks; b++) {
+        const uint8_t *voxels = &slabs[i][(uint64_t)b * brick_voxels];
+        const uint32_t bx = b % w->bw, by = b / w->bw, bz = first + i;
+        if (std::all_of(voxels, voxels + brick_voxels
+              , [&](uint8_t v) { return v == voxels[0]; }))
+          w->fill(box { bx * brick_size, by * brick_size, bz * brick_size
+              , (bx + 1) * brick_size, (by + 1) * brick_size
+              , (bz + 1) * brick_size }, voxels[0]);
+        else
+          w->set_brick(bx, by, bz, voxels);
+      }
+  }
+}
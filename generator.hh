@@ -0,0 +1,63 @@
+#pragma once
+
+#include "world.hh"
+#include "thread_pool.hh"
+#include <cstdint>
+
+// procedural worlds come from a generator that fills one brick at a time
+// from its position. the voxels of a brick may only depend on the seed and
+// their coordinates, never on shared state like rand(), so that bricks can be
+// generated on any thread in any order and a seed always gives the same world
+
+// counter based random numbers: a hash of the seed and a position
+uint32_t hash32(uint32_t seed, int64_t x, int64_t y, int64_t z);
+
+// smooth value noise in [-1, 1] with lattice points period voxels apart
+float value_noise(uint32_t seed, int64_t x, int64_t y, int64_t z
+    , uint32_t period);
+
+// the sdSphere() and sdBox() of the shader, for a point relative to the
+// shape's center
+float sd_sphere(float x, float y, float z, float radius);
+float sd_box(float x, float y, float z, float bx, float by, float bz);
+
+class generator {
+public:
+  virtual ~generator() {}
+  // fills brick_voxels voxels, x first, of the brick whose lowest corner is
+  // at x0, y0, z0 in world coordinates
+  virtual void brick(int64_t x0, int64_t y0, int64_t z0, uint8_t *voxels)
+    const = 0;
+};
+
+// half of the voxels solid in about fill of the bricks
+class random_generator : public generator {
+  uint32_t _seed;
+  float _fill;
+public:
+  random_generator(uint32_t n_seed, float n_fill = 1.f);
+  void brick(int64_t x0, int64_t y0, int64_t z0, uint8_t *voxels) const;
+};
+
+// every voxel solid with probability density, independent of the others
+class density_generator : public generator {
+  uint32_t _seed;
+  float _density;
+public:
+  density_generator(uint32_t n_seed, float n_density);
+  void brick(int64_t x0, int64_t y0, int64_t z0, uint8_t *voxels) const;
+};
+
+// rolling ground of a few octaves of value noise around y = 0, with a
+// sphere or box shaped cave carved into some of the 32^3 cells around it
+class terrain_generator : public generator {
+  uint32_t _seed;
+public:
+  terrain_generator(uint32_t n_seed);
+  void brick(int64_t x0, int64_t y0, int64_t z0, uint8_t *voxels) const;
+};
+
+// fills w on the pool. a task generates a slab of bricks along z into a
+// buffer of its own, and the slabs are copied into w in order, so that the
+// world and even its brick pool come out the same for any number of threads
+void generate(world *w, const generator &g, thread_pool *pool);
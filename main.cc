@@ -2,16 +2,418 @@
 #include "utils.hh"
 #include "ogl.hh"
 #include "world.hh"
+#include "thread_pool.hh"
+#include "cpu_renderer.hh"
+#include "bench.hh"
+#include "streamer.hh"
+#include "world_file.hh"
+#include "generator.hh"
+#include "program_cache.hh"
+#include "profiler.hh"
+#include "triple_buffer.hh"
+#include "dynamic_resolution.hh"
+#include "brush.hh"
+#include "raster.hh"
+#include "shader_variant.hh"
+#include "perf_counters.hh"
+#include "farm.hh"
+#include <sys/wait.h>
+#include <csignal>
+#include <unistd.h>
+#include <climits>
+#include <chrono>
+#include <random>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
 #include <string>
+#include <map>
+#include <algorithm>
 
 shaderprogram *sp;
 GLint vattr;
 array_buffer *screenverts;
-GLint resolution_unif, time_unif;
-shader *vs, *fs;
+GLint resolution_unif, time_unif, view_offset_unif;
+program_cache *programs;
+// without --no-shader-cache, linked programs are saved to and loaded from
+// default_program_cache_dir()
+bool shader_cache = true;
+// builds with VFK_PROFILE write their zones there at exit and when p is
+// pressed
+const char *trace_path = "vfk_trace.json";
+std::string vsrc, fsrc, atlas_bytes_src, atlas_bits_src, reproject_vsrc
+  , reproject_fsrc;
 world *w;
+uint32_t world_edge = 64;
+float world_fill = 1.f;
+// with --density every voxel is solid with that probability instead
+float world_density = -1.f;
+voxel_format world_format = material_voxels;
+// generated and streamed worlds come from world_generator, seeded with
+// --seed. --terrain picks noise terrain over random voxels
+uint32_t world_seed = 1;
+bool terrain_world = false;
+generator *world_generator;
+// with --load the world comes from a .vfk file instead of being generated
+const char *world_path = nullptr;
+double startup_ms = 0;
+// with --stream, w is the window of a chunk_streamer and the camera travels
+// along x through an unbounded world at stream_speed voxels per second
+bool stream_world = false;
+uint64_t stream_budget = 256 << 20;
+const float stream_speed = 32.f;
+thread_pool *stream_pool;
+chunk_streamer *streamer;
+// the scheduler of screen::mainloop(), see screen.hh
+double step_ms = 16;
+int max_steps = 5;
+bool threaded_simulation = false;
+// what a tick hands to drawing. the camera follows from the time alone, so
+// that is all there is to interpolate
+struct sim_state {
+  double prev_time, time; // of the tick before and this one, in seconds
+};
+triple_buffer<sim_state> simulation;
+// with --dynres MS frames are raymarched into the lower left corner of fb,
+// at the scaler's fraction of the window, and stretched over the window.
+// the raymarch is timed with a few stopwatches used round robin, so that
+// their times are read back frames later without waiting on the gpu
+double dynres_target_ms = 0;
+float dynres_min_scale = 0.25f;
+struct dynamic_resolution {
+  static const int stopwatch_count = 4;
+  resolution_scaler scaler;
+  framebuffer fb;
+  gpu_stopwatch stopwatches[stopwatch_count];
+  float scales[stopwatch_count]; // the scale each stopwatch timed
+  uint64_t frame;
+  double last_ms, scale_sum;
+  dynamic_resolution(int n_width, int n_height)
+    : scaler(dynres_target_ms, dynres_min_scale), fb(n_width, n_height, true)
+      , frame(0), last_ms(0), scale_sum(0) {}
+};
+dynamic_resolution *dynres;
+// with --prepass N the rays of every N by N block of pixels are first traced
+// together, as the cone around them, into a target at 1/N of the
+// resolution. the raymarch then starts every ray where the cone of its block
+// came near a solid voxel, rather than stepping through the empty space
+// around the camera that all of them share
+int prepass_block = 0;
+struct depth_prepass {
+  shaderprogram *sp;
+  GLint vattr, resolution_unif, time_unif, view_offset_unif;
+  float_framebuffer starts;
+  int width, height; // of the window
+  depth_prepass(int n_width, int n_height)
+    : sp(nullptr), starts(n_width / prepass_block + 1
+          , n_height / prepass_block + 1, GL_TEXTURE3)
+      , width(n_width), height(n_height) {}
+};
+depth_prepass *prepass;
+// --reproject has the renderers reuse the last frame's hits, see
+// cpu_renderer::reproject. on the gpu the raymarch writes the voxel every
+// ray hit into one of two history targets next to its color, a pass of one
+// point per pixel of the other one, which the last frame wrote, moves those
+// to where this frame sees them and the raymarch tries them like
+// cpu_renderer::reuse_hit(). it needs the full resolution and a camera that
+// stays put, so neither --dynres nor --stream
+bool reproject = false;
+// the gpu leaves it out behind the depth pre-pass, whose rays take fewer
+// steps than checking a reused hit does, see cpu_renderer::reproject
+bool gpu_reproject() {
+  return reproject && prepass_block == 0;
+}
+// the tiles of the edit_depths() that the raymarch gets
+const int edit_tile = 8;
+struct gpu_reprojection {
+  hit_framebuffer targets[2];
+  scatter_framebuffer reprojected;
+  GLuint edit_texture;
+  int edit_width, edit_height;
+  std::vector<float> depths; // of the edits, see cover_edits()
+  int current; // the target this frame writes
+  bool valid; // whether the other one holds the last frame's hits
+  float time; // of the last frame
+  shaderprogram *sp;
+  GLint resolution_unif, history_origin_unif, history_turn_unif
+    , origin_unif, turn_unif;
+  // of the raymarch
+  GLint history_valid_unif;
+  gpu_reprojection(int width, int height)
+    : targets{ { width, height, GL_TEXTURE6 }, { width, height, GL_TEXTURE6 } }
+      , reprojected(width, height, GL_TEXTURE7)
+      , edit_width((width + edit_tile - 1) / edit_tile)
+      , edit_height((height + edit_tile - 1) / edit_tile), current(0)
+      , valid(false), time(0.f), sp(nullptr) {
+    glActiveTexture(GL_TEXTURE8);
+    glGenTextures(1, &edit_texture);
+    glBindTexture(GL_TEXTURE_2D, edit_texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, edit_width, edit_height, 0
+        , GL_RED, GL_FLOAT, nullptr);
+    glActiveTexture(GL_TEXTURE0);
+  }
+  ~gpu_reprojection() {
+    glDeleteTextures(1, &edit_texture);
+  }
+  bool cover_edits(const std::vector<box> &edited, float now);
+};
+gpu_reprojection *reprojection;
+
+// uploads the edit_depths() of the brick boxes edited, which a reused hit
+// has to lie in front of, false when there are too many copies of them
+bool gpu_reprojection::cover_edits(const std::vector<box> &edited
+    , float now) {
+  std::vector<box> voxels;
+  for (const box &b : edited)
+    voxels.push_back(box { b.x0 * brick_size, b.y0 * brick_size
+        , b.z0 * brick_size, b.x1 * brick_size, b.y1 * brick_size
+        , b.z1 * brick_size });
+  // as far as reuseHit() tries hits, through the corners of the frame. see
+  // REUSE_FOOTPRINT
+  const int width = targets[0].width, height = targets[0].height;
+  const float aspect = (float)height / width, reach = 0.5f * 0.5f * width
+    * sqrtf(1.f + aspect * aspect + 0.8f * 0.8f);
+  if (!edit_depths(w, voxels, now, width, height, edit_tile, reach
+        , depths))
+    return false;
+  glActiveTexture(GL_TEXTURE8);
+  glBindTexture(GL_TEXTURE_2D, edit_texture);
+  glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, edit_width, edit_height, GL_RED
+      , GL_FLOAT, depths.data());
+  glActiveTexture(GL_TEXTURE0);
+  return true;
+}
+
+// the time set_time() last set up
+float view_time = 0.f;
+// with --raster, or after r is pressed, the world is drawn by raster_renderer
+// rather than raymarched. it is created the first time it is used, and
+// meshes on a pool of its own
+bool rasterize = false;
+float draw_distance = 128;
+thread_pool *raster_pool;
+raster_renderer *raster;
+// with --distance-field, or after f is pressed, rays jump through the empty
+// bricks that the world's distance field finds around them, and take single
+// steps of the plain DDA in bricks with voxels in them. the field is
+// computed the first time it is used, and kept up to date on field_pool from
+// then on
+bool distance_field = false;
+// with --ao, or after o is pressed, the face a ray hits is shaded by the
+// occlusion baked at its corners, for one more fetch per pixel. the baking
+// works like the distance field's, on the same pool
+bool ambient_occlusion = false;
+thread_pool *field_pool;
+
+// the knobs compiled into the raymarching shader. unless --flat,
+// --branchless or --variant picked them, load() takes the ones --autotune
+// found fastest on the renderer, at the step limit of --ray-steps
+shader_variant variant = default_variant;
+bool variant_picked = false;
+// with --autotune the variants are timed offscreen like --bench, and the
+// fastest one is saved for load() to find
+bool autotune = false;
+// with hit_output the shader writes the voxel its ray hit, wrapped into the
+// world, and the axis of the face it entered through instead of a color,
+// see run_dda()
+bool hit_output = false;
+
+// the traversal is picked by the variant's defines after the #version line
+// rather than by uniforms, so that the one not in use costs nothing in the
+// compiled program. the atlas lookup for the world's voxel format is spliced
+// in there as well, the packed one needs integer textures and bit
+// operations from glsl 1.30. the depth pre-pass is the same source with
+// cone_pass set, it never uses the distance field
+std::string fragment_source(const shader_variant &v, bool cone_pass = false) {
+  const bool bits = world_format == occupancy_bits;
+  std::string source = fsrc;
+  const size_t version = source.find('\n') + 1;
+  source.replace(0, version, std::string("#version ")
+      + (bits ? "130" : "120") + "\n" + v.defines() + "#define DEPTH_PREPASS "
+      + (cone_pass ? "1" : "0") + "\n#define DISTANCE_FIELD "
+      + (distance_field && !cone_pass ? "1" : "0")
+      + "\n#define AMBIENT_OCCLUSION " + (ambient_occlusion ? "1" : "0")
+      + "\n#define HIT_OUTPUT " + (hit_output ? "1" : "0")
+      + "\n#define REPROJECT " + (gpu_reproject() && !cone_pass ? "1" : "0")
+      + "\n"
+      + (bits ? atlas_bits_src : atlas_bytes_src) + "\n");
+  return source;
+}
+
+// what --autotune saves the fastest variant for: the renderer and the
+// driver version, since a driver update can change which variant wins
+std::string tuning_renderer() {
+  return std::string((const char*)glGetString(GL_RENDERER)) + ", "
+    + (const char*)glGetString(GL_VERSION);
+}
+
+// both traversals are requested up front, so that the driver builds them
+// while the world is created and switching between them never compiles
+void request_programs() {
+  shader_variant other = variant;
+  other.hierarchical = !variant.hierarchical;
+  programs->request(vsrc, fragment_source(variant));
+  programs->request(vsrc, fragment_source(other));
+  if (prepass_block > 0)
+    programs->request(vsrc, fragment_source(default_variant, true));
+  if (!stream_world)
+    programs->request(raster_renderer::vsrc, raster_renderer::fsrc);
+  if (gpu_reproject())
+    programs->request(reproject_vsrc, reproject_fsrc);
+}
+
+void build_program(screen *s) {
+  sp = programs->get(vsrc, fragment_source(variant));
+
+  vattr = sp->bind_attrib("position");
+  resolution_unif = sp->bind_uniform("iResolution");
+
+  sp->use_this_prog();
+  glUniform2f(resolution_unif, s->window_width, s->window_height);
+  sp->dont_use_this_prog();
+
+  time_unif = sp->bind_uniform("iGlobalTime");
+  view_offset_unif = sp->bind_uniform("view_offset");
+  GLint starts_unif = sp->bind_uniform("ray_starts")
+    , starts_size_unif = sp->bind_uniform("ray_starts_size")
+    , block_unif = sp->bind_uniform("ray_start_block");
+  sp->use_this_prog();
+  glUniform1i(starts_unif, 3);
+  if (prepass)
+    glUniform2f(starts_size_unif, prepass->starts.width
+        , prepass->starts.height);
+  glUniform1f(block_unif, prepass ? prepass_block : 0);
+  sp->dont_use_this_prog();
+  if (reprojection) {
+    gpu_reprojection &rp = *reprojection;
+    rp.history_valid_unif = sp->bind_uniform("history_valid");
+    GLint reprojected_unif = sp->bind_uniform("reprojected")
+      , edits_unif = sp->bind_uniform("edit_depths")
+      , tile_unif = sp->bind_uniform("edit_tile");
+    sp->use_this_prog();
+    glUniform1i(reprojected_unif, 7);
+    glUniform1i(edits_unif, 8);
+    glUniform1f(tile_unif, edit_tile);
+    sp->dont_use_this_prog();
+    rp.sp = programs->get(reproject_vsrc, reproject_fsrc);
+    rp.resolution_unif = rp.sp->bind_uniform("iResolution");
+    rp.history_origin_unif = rp.sp->bind_uniform("history_origin");
+    rp.history_turn_unif = rp.sp->bind_uniform("history_turn");
+    rp.origin_unif = rp.sp->bind_uniform("origin");
+    rp.turn_unif = rp.sp->bind_uniform("turn");
+    GLint history_unif = rp.sp->bind_uniform("history");
+    rp.sp->use_this_prog();
+    glUniform2f(rp.resolution_unif, s->window_width, s->window_height);
+    glUniform1i(history_unif, 6);
+    rp.sp->dont_use_this_prog();
+    // the hits were found by another program
+    rp.valid = false;
+  }
+
+  if (prepass) {
+    shaderprogram *cones = prepass->sp = programs->get(vsrc
+        , fragment_source(default_variant, true));
+    prepass->vattr = cones->bind_attrib("position");
+    prepass->resolution_unif = cones->bind_uniform("iResolution");
+    prepass->time_unif = cones->bind_uniform("iGlobalTime");
+    prepass->view_offset_unif = cones->bind_uniform("view_offset");
+    block_unif = cones->bind_uniform("ray_start_block");
+    cones->use_this_prog();
+    glUniform1f(block_unif, prepass_block);
+    cones->dont_use_this_prog();
+    // the world keeps the uniforms of the last program bound up to date,
+    // the cones only read ones that never change
+    if (w)
+      w->bind_program(cones);
+  }
+  if (w)
+    w->bind_program(sp);
+}
+
+// switches between the plain DDA and the one that skips empty cells of the
+// occupancy pyramid
+void set_hierarchical(bool on, screen *s) {
+  variant.hierarchical = on;
+  build_program(s);
+}
+
+void enable_distance_field() {
+  if (!field_pool)
+    field_pool = new thread_pool;
+  w->enable_distance_field(field_pool);
+}
+
+void enable_ambient_occlusion() {
+  if (!field_pool)
+    field_pool = new thread_pool;
+  w->enable_ambient_occlusion(field_pool);
+}
+
+// switches between the distance field traversal and the one picked by h
+void set_distance_field(bool on, screen *s) {
+  distance_field = on;
+  if (on)
+    enable_distance_field();
+  build_program(s);
+}
+
+void set_ambient_occlusion(bool on, screen *s) {
+  ambient_occlusion = on;
+  if (on)
+    enable_ambient_occlusion();
+  build_program(s);
+}
+
+// switches between raymarching and the raster backend, which cannot follow
+// the streamer
+void set_rasterize(bool on, screen *s) {
+  if (on && stream_world) {
+    puts("the raster backend does not support --stream");
+    return;
+  }
+  rasterize = on;
+  if (on && !raster) {
+    raster_pool = new thread_pool;
+    raster = new raster_renderer(w, raster_pool, programs->get(
+          raster_renderer::vsrc, raster_renderer::fsrc), s->window_width
+        , s->window_height);
+    raster->draw_distance = draw_distance;
+  }
+}
+
+// the empty window of the streamer, or the world loaded or generated up
+// front. the time this takes goes into startup_ms
+world *create_world() {
+  profile_zone("create world");
+  auto begin = std::chrono::steady_clock::now();
+  // a loaded world needs no generator, and a streamed one starts empty and
+  // is filled on the streamer's own pool
+  if (!world_path || stream_world) {
+    if (terrain_world)
+      world_generator = new terrain_generator(world_seed);
+    else if (world_density >= 0.f)
+      world_generator = new density_generator(world_seed, world_density);
+    else
+      world_generator = new random_generator(world_seed, world_fill);
+  }
+  world *created;
+  if (stream_world)
+    created = new world(world_edge, world_edge, world_edge, world_format);
+  else if (world_path) {
+    thread_pool pool;
+    created = load_world(world_path, &pool, world_format);
+  } else {
+    thread_pool pool;
+    created = new world(world_edge, world_edge, world_edge, world_format);
+    generate(created, *world_generator, &pool);
+  }
+  startup_ms = std::chrono::duration<double, std::milli>(
+      std::chrono::steady_clock::now() - begin).count();
+  return created;
+}
 
 void load(screen *s) {
   int vertex_texture_units;
@@ -35,24 +437,89 @@ void load(screen *s) {
   screenverts = new array_buffer;
   screenverts->upload(vertices);
 
-  const char *vsrc = _glsl(
+  vsrc = _glsl(
     attribute vec2 position;
     void main() {
       gl_Position = vec4(position, 0.0, 1.0);
     }
   );
-  const char *fsrc = _glsl(
+  // atlasVoxel() returns the voxel at atlas coordinate a, in voxels
+  atlas_bytes_src = _glsl_part(
+    uniform sampler3D world_atlas;
+    uniform vec3 atlas_size;
+
+    float atlasVoxel(vec3 a) {
+      return texture3D(world_atlas, (a + 0.5) / atlas_size).r;
+    }
+  );
+  // every texel is a 4^3 block of the packed atlas, its voxels are the bits
+  // (z * 4 + y) * 4 + x of r and then g
+  atlas_bits_src = _glsl_part(
+    uniform usampler3D world_atlas;
+
+    float atlasVoxel(vec3 a) {
+      ivec3 v = ivec3(a);
+      uvec2 block = texelFetch(world_atlas, v / 4, 0).rg;
+      int bit = ((v.z % 4) * 4 + v.y % 4) * 4 + v.x % 4;
+      uint word = bit < 32 ? block.r : block.g;
+      return float((word >> uint(bit % 32)) & 1u);
+    }
+  );
+  fsrc = _glsl(
     uniform vec2 iResolution;
     uniform float iGlobalTime;
     // uniform vec3 viewOrigin;
     // uniform mat4 invProjView;
-    uniform sampler3D world_data;
-    uniform int w;
-    uniform int h;
-    uniform int d;
+    uniform sampler3D world_index;
+    uniform vec3 world_size;
+    uniform vec3 index_size;
+    uniform vec3 view_offset;
+    uniform sampler3D world_occupancy;
+    uniform vec3 occupancy_size;
+    uniform float occupancy_levels;
+    uniform sampler2D ray_starts;
+    uniform vec2 ray_starts_size;
+    uniform float ray_start_block; // 0 without the depth pre-pass
+    uniform sampler3D world_distance;
+    uniform sampler3D world_occlusion;
+    // the last frame's hits moved to where this frame sees them, the voxel
+    // and the depth along the camera's axis, negative where none landed.
+    // see reproject_vsrc
+    uniform sampler2D reprojected;
+    uniform float history_valid;
+    // per tile of edit_tile^2 pixels the depth along the camera's axis from
+    // which on its rays can cross what the world changed in since then
+    uniform sampler2D edit_depths;
+    uniform float edit_tile;
 
-    const bool USE_BRANCHLESS_DDA = false;
-    const int MAX_RAY_STEPS = 128;
+    const bool USE_BRANCHLESS_DDA = BRANCHLESS_DDA != 0;
+    const int MAX_RAY_STEPS = MAX_STEPS;
+    // the distance field takes the place of the pyramid, the fetches of
+    // both in every step cost more than the pyramid's longer jumps save
+    const bool USE_DISTANCE = DISTANCE_FIELD != 0;
+    const bool USE_HIERARCHY = HIERARCHICAL != 0 && !USE_DISTANCE;
+    const bool USE_OCCLUSION = AMBIENT_OCCLUSION != 0;
+    // how much the face of a voxel in a corner darkens
+    const float OCCLUSION_STRENGTH = 0.7;
+    const bool CONE_PASS = DEPTH_PREPASS != 0;
+    const bool HIT_PASS = HIT_OUTPUT != 0;
+    const bool USE_HISTORY = REPROJECT != 0;
+    // the checking trace of a reused hit starts this far in front of its
+    // voxel, and gives up after as many steps as it takes to cross that at
+    // the worst angle, like cpu_renderer's
+    const float REUSE_DISTANCE = 8.0;
+    const int REUSE_STEPS = 16;
+    // further away than where a pixel grows this wide, in voxels, a voxel
+    // can fall between the last frame's rays and go unseen in front of a hit
+    const float REUSE_FOOTPRINT = 0.5;
+    // a ray that enters a voxel this close to an edge, relative to how far it
+    // went, can round onto either face
+    const float REUSE_EDGE = 1e-4;
+    const int MAX_CONE_STEPS = 64;
+    const float BRICK_SIZE = 8.0;
+    // clearVoxel() keeps every voxel clear that has a point this close to
+    // view_offset, its center is at most half a diagonal further away
+    const float CLEAR_RADIUS = 29.0;
 
     float noise(float x) { return fract(sin(x * 113.0) * 43758.5453123); }
 
@@ -66,13 +533,47 @@ void load(screen *s) {
       length(max(d,0.0));
     }
 
+    vec4 fetchEntry(vec3 p) {
+      return texture3D(world_index, (floor(p / BRICK_SIZE) + 0.5) / index_size);
+    }
+
+    // uniform bricks keep their value in the index texel with alpha 0, the
+    // rest point at their brick in the atlas
+    float fetchVoxel(vec3 p, vec4 entry) {
+      if (entry.a < 0.5)
+        return entry.r;
+      return atlasVoxel(floor(entry.rgb * 255.0 + 0.5) * BRICK_SIZE + mod(p, BRICK_SIZE));
+    }
+
+    // exp2() is not exact everywhere, and the cell sizes have to be
+    float cellSize(float level) {
+      return floor(BRICK_SIZE * exp2(level) + 0.5);
+    }
+
+    // the levels of the occupancy pyramid lie next to each other along x,
+    // level l starting at 2 - 2^(1 - l) times the width of level 0
+    bool emptyCell(vec3 p, float level) {
+      vec3 cell = floor(p / cellSize(level));
+      cell.x += 2.0 * index_size.x - floor(index_size.x * exp2(1.0 - level) + 0.5);
+      return texture3D(world_occupancy, (cell + 0.5) / occupancy_size).r < 0.5;
+    }
+
+    // how far the brick is from the nearest one with voxels in it, in
+    // bricks, see world.hh
+    float fetchDistance(vec3 p) {
+      return floor(texture3D(world_distance, (floor(p / BRICK_SIZE) + 0.5) / index_size).r * 255.0 + 0.5);
+    }
+
+    bool clearVoxel(ivec3 c) {
+      return distance(vec3(c) + vec3(0.5), view_offset) <= 30.0;
+    }
+
     bool getVoxel(ivec3 c) {
       // return noise(c.x) > 0.5;
-      // return texture3D(world_data, c).r > 0.5;
-      vec3 s = vec3(c) + vec3(0.5);
       // float d = min(max(-sdSphere(p, 7.5), sdBox(p, vec3(6.0))), -sdSphere(p, 25.0));
       // return d < 0.0;
-      return distance(s, vec3(0.0)) > 30.0 ? texture3D(world_data, s).r < 0.5 : false;
+      vec3 p = mod(vec3(c), world_size);
+      return clearVoxel(c) ? false : fetchVoxel(p, fetchEntry(p)) > 0.5;
     }
 
     vec2 rotate2d(vec2 v, float a) {
@@ -81,32 +582,195 @@ void load(screen *s) {
       return vec2(v.x * cosA - v.y * sinA, v.y * cosA + v.x * sinA);
     }
 
-    void main() {
-      vec2 screenPos = (gl_FragCoord.xy / iResolution.xy) * 2.0 - 1.0;
+    void cameraRay(vec2 frag, out vec3 rayPos, out vec3 rayDir) {
+      vec2 screenPos = (frag / iResolution.xy) * 2.0 - 1.0;
       vec3 cameraDir = vec3(0.0, 0.0, 0.8);
       vec3 cameraPlaneU = vec3(1.0, 0.0, 0.0);
       vec3 cameraPlaneV = vec3(0.0, 1.0, 0.0) * iResolution.y / iResolution.x;
-      vec3 rayDir = cameraDir + screenPos.x * cameraPlaneU + screenPos.y * cameraPlaneV;
-      vec3 rayPos = vec3(0.0, 2.0 * sin(iGlobalTime * 2.7), -12.0);
+      rayDir = cameraDir + screenPos.x * cameraPlaneU + screenPos.y * cameraPlaneV;
+      rayPos = vec3(0.0, 2.0 * sin(iGlobalTime * 2.7), -12.0);
 
       rayPos.xz = rotate2d(rayPos.xz, iGlobalTime);
       rayDir.xz = rotate2d(rayDir.xz, iGlobalTime);
+      rayPos += view_offset;
+    }
+
+    // how far the cone from o around the unit axis a, k voxels wide per
+    // voxel along it, gets through empty voxels. it runs to where its widest
+    // part leaves the clear sphere, then from box to box of empty cells
+    // around the cube that bounds its cross section, grown by half a voxel so
+    // that no ray of it ends on the face of a voxel it has not cleared. the
+    // cone stays in a box up to where the cube reaches one of its faces
+    float coneStart(vec3 o, vec3 a, float k) {
+      float s = 0.0;
+      vec3 d = o - view_offset;
+      float b = dot(a, d) + CLEAR_RADIUS * k;
+      float q = 1.0 - k * k;
+      float c = dot(d, d) - CLEAR_RADIUS * CLEAR_RADIUS;
+      if (c < 0.0 && q > 0.0)
+        s = (-b + sqrt(b * b - q * c)) / q;
+      float level = 0.0;
+      for (int i = 0; i < MAX_CONE_STEPS; i++) {
+        float r = s * k + 0.5;
+        float size = cellSize(level);
+        // the box is 2 cells along every axis at most while the cube is
+        // narrower than one
+        if (2.0 * r >= size) {
+          if (level + 1.0 >= occupancy_levels)
+            break;
+          level += 1.0;
+          continue;
+        }
+        vec3 p = o + a * s;
+        vec3 lo = (ceil((p - r) / size) - 1.0) * size;
+        vec3 cells = floor((p + r) / size) + 1.0 - lo / size;
+        bool empty = true;
+        for (int j = 0; j < 8; j++) {
+          vec3 cell = vec3(mod(float(j), 2.0), mod(floor(float(j) / 2.0), 2.0)
+              , floor(float(j) / 4.0));
+          if (all(lessThan(cell, cells))
+              && !emptyCell(mod(lo + cell * size + 0.5, world_size), level))
+            empty = false;
+        }
+        if (!empty) {
+          if (level == 0.0)
+            break;
+          level -= 1.0;
+          continue;
+        }
+        vec3 hi = lo + cells * size;
+        vec3 up = mix(vec3(1e30), (hi - o - 0.5) / max(a + k, 1e-6)
+            , step(1e-6, a + k));
+        vec3 down = mix(vec3(1e30), (o - 0.5 - lo) / max(k - a, 1e-6)
+            , step(1e-6, k - a));
+        vec3 exits = min(up, down);
+        s = min(exits.x, min(exits.y, exits.z));
+        level = min(level + 1.0, occupancy_levels - 1.0);
+      }
+      return s;
+    }
+
+    float cornerCos(vec2 frag, vec3 axis) {
+      vec3 rayPos;
+      vec3 rayDir;
+      cameraRay(frag, rayPos, rayDir);
+      return dot(axis, normalize(rayDir));
+    }
 
-      ivec3 mapPos = ivec3(floor(rayPos + 0.));
+    // the rays through the pixels of block b lie in the cone around the one
+    // through its middle that reaches out to the widest of its corners
+    float blockStart(vec2 b) {
+      vec2 lo = b * ray_start_block;
+      vec2 hi = lo + ray_start_block;
+      vec3 rayPos;
+      vec3 axis;
+      cameraRay((lo + hi) * 0.5, rayPos, axis);
+      axis = normalize(axis);
+      float c = min(min(cornerCos(lo, axis), cornerCos(hi, axis))
+          , min(cornerCos(vec2(lo.x, hi.y), axis), cornerCos(vec2(hi.x, lo.y), axis)));
+      return coneStart(rayPos, axis, sqrt(max(1.0 - c * c, 0.0)) / c);
+    }
+
+    // moves mapPos to the voxel past the face where the ray leaves the empty
+    // box of size voxels at lo, and sideDist to match. returns the axes of
+    // that face
+    bvec3 leaveBox(vec3 lo, float size, vec3 rayPos, vec3 rayDir, vec3 deltaDist
+        , inout ivec3 mapPos, inout vec3 sideDist) {
+      vec3 exitDist = (mix(lo, lo + size, step(0.0, rayDir)) - rayPos) / rayDir;
+      bvec3 mask = lessThanEqual(exitDist.xyz, min(exitDist.yzx, exitDist.zxy));
+      vec3 exitPos = floor(rayPos + rayDir * min(exitDist.x, min(exitDist.y, exitDist.z)));
+      // floor() can land on either side of a face of the box, snap the
+      // position into it and across the face the ray leaves by
+      exitPos = mix(clamp(exitPos, lo, lo + size - 1.0), mix(lo - 1.0, lo + size, step(0.0, rayDir)), vec3(mask));
+      mapPos = ivec3(exitPos);
+      sideDist = (sign(rayDir) * (exitPos - rayPos) + sign(rayDir) * 0.5 + 0.5) * deltaDist;
+      return mask;
+    }
+
+    // the baked occlusion of the corners of the face the ray entered the voxel
+    // through, interpolated by the texture unit at where it did. the voxels
+    // that clearVoxel() empties still count in it, faces of voxels that
+    // close to the clear sphere go without
+    float faceOcclusion(ivec3 mapPos, bvec3 mask, vec3 rayPos, vec3 rayDir
+        , vec3 sideDist, vec3 deltaDist) {
+      vec3 voxel = vec3(mapPos);
+      if (distance(voxel + 0.5, view_offset) < 33.0)
+        return 1.0;
+      vec3 enter = sideDist - deltaDist;
+      vec3 hit = clamp(rayPos + rayDir * max(enter.x, max(enter.y, enter.z)), voxel, voxel + 1.0);
+      hit = mix(hit, voxel + vec3(lessThan(rayDir, vec3(0.0))), vec3(mask));
+      float solid = texture3D(world_occlusion, (mod(hit, world_size) + 0.5) / world_size).r;
+      return 1.0 - OCCLUSION_STRENGTH * clamp(2.0 * solid - 1.0, 0.0, 1.0);
+    }
+
+    // the distance along the unit ray d at which it enters voxel v, or a
+    // negative one when it misses it. edge is how much further that is than
+    // where it enters the next slab, close to 0 on the voxel's edges
+    float enterVoxel(vec3 o, vec3 d, vec3 v, out float edge) {
+      vec3 a = (v - o) / d;
+      vec3 b = (v + 1.0 - o) / d;
+      vec3 lo = min(a, b);
+      vec3 hi = max(a, b);
+      float enter = max(lo.x, max(lo.y, lo.z));
+      edge = 2.0 * enter + min(lo.x, min(lo.y, lo.z)) - lo.x - lo.y - lo.z;
+      return enter <= min(hi.x, min(hi.y, hi.z)) ? enter : -1.0;
+    }
+
+    // steps the ray from start voxels along it for at most maxSteps. leaves
+    // mapPos at the voxel it hit or gave up in, mask at the axes of the face
+    // it entered that through and sideDist to match, true on a hit. the
+    // traversal starts at start, but measures from rayPos
+    bool march(vec3 rayPos, vec3 rayDir, float start, int maxSteps
+        , out ivec3 mapPos, out bvec3 mask, out vec3 sideDist) {
+      vec3 startPos = rayPos + rayDir * (start / length(rayDir));
+      mapPos = ivec3(floor(startPos));
 
       vec3 deltaDist = abs(vec3(1) / rayDir);
 
       ivec3 rayStep = ivec3(sign(rayDir));
 
-      vec3 sideDist = (sign(rayDir) * (vec3(mapPos) - rayPos) + sign(rayDir) * 0.5 + 0.5) * deltaDist;
+      sideDist = (sign(rayDir) * (vec3(mapPos) - rayPos) + sign(rayDir) * 0.5 + 0.5) * deltaDist;
 
-      bvec3 mask;
+      mask = bvec3(false);
+      float level = -1.0; // of the last jump across empty space
 
       for (int i = 0; i < MAX_RAY_STEPS; i++) {
-        if (getVoxel(mapPos))
+        if (i >= maxSteps)
           break;
+        vec3 p = mod(vec3(mapPos), world_size);
+        if (USE_DISTANCE) {
+          // every brick less than k away along all axes is empty, the ray
+          // jumps out of the box of them unless its own brick has voxels
+          float k = fetchDistance(p);
+          if (k > 0.5) {
+            vec3 lo = vec3(mapPos) - mod(vec3(mapPos), BRICK_SIZE) - (k - 1.0) * BRICK_SIZE;
+            mask = leaveBox(lo, (2.0 * k - 1.0) * BRICK_SIZE, rayPos, rayDir, deltaDist, mapPos, sideDist);
+            continue;
+          }
+        }
+        bool clear = USE_HIERARCHY && clearVoxel(mapPos);
+        vec4 entry = USE_HIERARCHY && !clear ? fetchEntry(p) : vec4(1.0);
+        if (USE_HIERARCHY && !clear && entry == vec4(0.0)) {
+          // the brick is empty, so the ray jumps to where it leaves it or a
+          // larger empty cell of the occupancy pyramid around it. every jump
+          // tries one level above the last one, which crosses long runs of
+          // empty space in growing steps with one extra fetch per step
+          float up = min(level + 1.0, occupancy_levels - 1.0);
+          level = up > 0.0 && emptyCell(p, up) ? up : 0.0;
+          float size = cellSize(level);
+          mask = leaveBox(vec3(mapPos) - mod(vec3(mapPos), size), size, rayPos, rayDir, deltaDist, mapPos, sideDist);
+          continue;
+        }
+        // the hierarchical path reuses the entry fetched above
+        if (USE_HIERARCHY ? !clear && fetchVoxel(p, entry) > 0.5
+            : getVoxel(mapPos))
+          return true;
+        level = -1.0;
         if (USE_BRANCHLESS_DDA) {
-          mask = lessThanEqual(sideDist.xyz, min(sideDist.yzx, sideDist.zxy));
+          // a single axis, on a tie the same one the branches pick
+          mask.x = sideDist.x < min(sideDist.y, sideDist.z);
+          mask.z = sideDist.z <= min(sideDist.x, sideDist.y);
+          mask.y = !mask.x && !mask.z;
           sideDist += vec3(mask) * deltaDist;
           mapPos += ivec3(mask) * rayStep;
         } else {
@@ -136,6 +800,114 @@ void load(screen *s) {
           }
         }
       }
+      return false;
+    }
+
+    // like cpu_renderer::reuse_hit(), tries the voxels the last frame hit
+    // around the pixel from the nearest one on, each by a short checking
+    // trace that has to end on it. hits further back than the trace reaches
+    // past the nearest one are not tried, nor ones whose voxel the pre-pass
+    // already starts the ray that close to, or ones beyond the reach of the
+    // last frame's rays or behind an edit. on success march()'s outputs are
+    // the checking trace's
+    bool reuseHit(vec3 rayPos, vec3 rayDir, float start, out ivec3 mapPos
+        , out bvec3 mask, out vec3 sideDist) {
+      // depths are along the camera's axis, on which rayDir is 0.8 long
+      float len = length(rayDir);
+      float toDistance = len / 0.8;
+      float far = REUSE_FOOTPRINT * 0.5 * iResolution.x * len;
+      vec3 dir = rayDir / len;
+      vec4 candidates[9];
+      int count = 0;
+      float nearest = 1e30;
+      for (int j = 0; j < 9; j++) {
+        vec2 frag = floor(gl_FragCoord.xy) + vec2(mod(float(j), 3.0), floor(float(j) / 3.0)) - 1.0;
+        if (any(lessThan(frag, vec2(0.0))) || any(greaterThanEqual(frag, iResolution.xy)))
+          continue;
+        vec4 c = texture2D(reprojected, (frag + 0.5) / iResolution.xy);
+        if (c.a < 0.0)
+          continue;
+        nearest = min(nearest, c.a);
+        float guess = (c.a - 2.0) * toDistance;
+        if (guess - REUSE_DISTANCE <= start || guess > far)
+          continue;
+        bool seen = false;
+        for (int i = 0; i < 9; i++)
+          if (i < count && candidates[i].xyz == c.xyz)
+            seen = true;
+        if (!seen)
+          candidates[count++] = c;
+      }
+      float last = nearest + REUSE_DISTANCE * 0.5;
+      vec2 tiles = ceil(iResolution.xy / edit_tile);
+      float edit = texture2D(edit_depths, (floor(gl_FragCoord.xy / edit_tile) + 0.5) / tiles).r * toDistance;
+      // the candidates in order of depth, ties by their index
+      float depth = -1.0;
+      int index = -1;
+      for (int k = 0; k < 9; k++) {
+        int next = -1;
+        for (int i = 0; i < 9; i++) {
+          if (i >= count)
+            break;
+          float d = candidates[i].a;
+          if ((d > depth || (d == depth && i > index))
+              && (next < 0 || d < candidates[next].a))
+            next = i;
+        }
+        if (next < 0 || candidates[next].a > last)
+          return false;
+        depth = candidates[next].a;
+        index = next;
+        vec3 voxel = candidates[next].xyz;
+        float edge;
+        float enter = enterVoxel(rayPos, dir, voxel, edge);
+        if (enter - REUSE_DISTANCE <= start || enter > far
+            || edge < REUSE_EDGE * enter)
+          continue;
+        // the checking trace sees edits in front of the voxel, what is left
+        // is the way in between
+        if (edit < enter - REUSE_DISTANCE)
+          continue;
+        if (march(rayPos, rayDir, enter - REUSE_DISTANCE, REUSE_STEPS, mapPos, mask, sideDist)
+            && any(mask) && all(equal(mapPos, ivec3(voxel))))
+          return true;
+      }
+      return false;
+    }
+
+    void main() {
+      if (CONE_PASS) {
+        gl_FragData[0] = vec4(blockStart(floor(gl_FragCoord.xy)));
+        return;
+      }
+      vec3 rayPos;
+      vec3 rayDir;
+      cameraRay(gl_FragCoord.xy, rayPos, rayDir);
+
+      // the pre-pass found how far all rays of the block get through empty
+      // voxels
+      float start = 0.0;
+      if (ray_start_block > 0.0) {
+        vec2 block = floor(gl_FragCoord.xy / ray_start_block);
+        start = texture2D(ray_starts, (block + 0.5) / ray_starts_size).r;
+      }
+
+      ivec3 mapPos;
+      bvec3 mask;
+      vec3 sideDist;
+      bool hit = false;
+      if (USE_HISTORY && history_valid > 0.5)
+        hit = reuseHit(rayPos, rayDir, start, mapPos, mask, sideDist);
+      if (!hit)
+        hit = march(rayPos, rayDir, start, MAX_RAY_STEPS, mapPos, mask, sideDist);
+      vec3 deltaDist = abs(vec3(1) / rayDir);
+
+      // the axis goes by the last one of the mask, like the shading
+      if (HIT_PASS) {
+        float axis = mask.z ? 3.0 : (mask.y ? 2.0 : 1.0);
+        gl_FragData[0] = vec4(mod(vec3(mapPos), world_size) / 255.0, hit ? axis / 255.0 : 0.0);
+        return;
+      }
 
       vec3 color = vec3(1.0, 0.0, 1.0);
       if (mask.x) {
@@ -147,42 +919,158 @@ void load(screen *s) {
       if (mask.z) {
         color = vec3(0.75);
       }
-      gl_FragColor = vec4(color, 1.0);
-      // gl_FragColor = vec4(texture3D(data, vec3(0,0,0)).rgb, 1.0);
+      if (USE_OCCLUSION && hit && any(mask))
+        color *= faceOcclusion(mapPos, mask, rayPos, rayDir, sideDist, deltaDist);
+      gl_FragData[0] = vec4(color, 1.0);
+      // gl_FragData[0] = vec4(texture3D(data, vec3(0,0,0)).rgb, 1.0);
+      // with the distance the ray entered its voxel at. hits too close to
+      // be worth trying are kept as well, they hide the ones behind them
+      if (USE_HISTORY) {
+        float edge;
+        float enter = hit && any(mask) ? enterVoxel(rayPos, normalize(rayDir), vec3(mapPos), edge) : -1.0;
+        gl_FragData[1] = vec4(vec3(mapPos), enter);
+      }
     }
   );
+  // one point per pixel of the last frame's history, drawn where this frame
+  // sees the hit, with the depth along the camera's axis. the nearest one on
+  // a pixel wins, like in cpu_renderer::reproject_history(). it indexes the
+  // history by gl_VertexID, from glsl 1.30
+  reproject_vsrc = "#version 130\n" _glsl_part(
+    uniform sampler2D history;
+    uniform vec2 iResolution;
+    // where the camera was for the last frame and is for this one, and the
+    // cosine and sine of the angles that turn into and out of their views
+    uniform vec3 history_origin;
+    uniform vec2 history_turn;
+    uniform vec3 origin;
+    uniform vec2 turn;
+    out vec4 hit;
 
-  vs = new shader(vsrc, GL_VERTEX_SHADER);
-  fs = new shader(fsrc, GL_FRAGMENT_SHADER);
-  sp = new shaderprogram(*vs, *fs);
+    vec2 rotate2d(vec2 v, vec2 turn) {
+      return vec2(v.x * turn.x - v.y * turn.y, v.y * turn.x + v.x * turn.y);
+    }
 
-  vattr = sp->bind_attrib("position");
-  resolution_unif = sp->bind_uniform("iResolution");
+    void main() {
+      ivec2 pixel = ivec2(gl_VertexID % int(iResolution.x), gl_VertexID / int(iResolution.x));
+      vec4 last = texelFetch(history, pixel, 0);
+      // outside of the clip volume unless it lands on a pixel
+      gl_Position = vec4(0.0, 0.0, 2.0, 1.0);
+      hit = vec4(0.0);
+      if (last.a < 0.0)
+        return;
+      // the last frame's ray, like cameraRay()
+      vec2 screenPos = (vec2(pixel) + 0.5) / iResolution * 2.0 - 1.0;
+      vec3 rayDir = vec3(screenPos.x, screenPos.y * iResolution.y / iResolution.x, 0.8);
+      rayDir.xz = rotate2d(rayDir.xz, history_turn);
+      vec3 p = history_origin + normalize(rayDir) * last.a - origin;
+      p.xz = rotate2d(p.xz, turn);
+      if (p.z <= 0.0)
+        return;
+      vec2 frag = floor((vec2(p.x, p.y * iResolution.x / iResolution.y) / p.z * 0.8 + 1.0) * 0.5 * iResolution);
+      if (any(lessThan(frag, vec2(0.0))) || any(greaterThanEqual(frag, iResolution)))
+        return;
+      gl_Position = vec4((frag + 0.5) / iResolution * 2.0 - 1.0, 1.0 - 2.0 / (1.0 + p.z), 1.0);
+      hit = vec4(last.xyz, p.z);
+    }
+  );
+  reproject_fsrc = "#version 130\n" _glsl_part(
+    in vec4 hit;
+    void main() {
+      gl_FragColor = hit;
+    }
+  );
 
+  const std::string cache_dir = shader_cache ? default_program_cache_dir()
+    : "";
+  programs = new program_cache(cache_dir);
+  shader_variant tuned;
+  if (!variant_picked && load_tuned_variant(cache_dir, tuning_renderer()
+        , tuned)) {
+    variant.hierarchical = tuned.hierarchical;
+    variant.branchless = tuned.branchless;
+  }
+  printf("shaders: variant %s\n", variant.name().c_str());
+  request_programs();
+
+  w = create_world();
+  if (prepass_block > 0)
+    prepass = new depth_prepass(s->window_width, s->window_height);
+  if (gpu_reproject())
+    reprojection = new gpu_reprojection(s->window_width, s->window_height);
+  build_program(s);
+  printf("shaders: %u programs, %u from the cache, %.1f ms compiling\n"
+      , programs->hits + programs->misses, programs->hits
+      , programs->compile_ms);
+  if (stream_world) {
+    stream_pool = new thread_pool;
+    streamer = new chunk_streamer(w, stream_pool, world_generator
+        , stream_budget);
+  } else {
+    printf("world: %u bricks resident, %.2f MB, %lu voxels solid, ready in "
+        "%.1f ms\n", w->resident_bricks(), w->memory_usage() / (1024. * 1024.)
+        , (unsigned long)w->count(box { 0, 0, 0, w->w, w->h, w->d })
+        , startup_ms);
+  }
+  if (distance_field)
+    enable_distance_field();
+  if (ambient_occlusion)
+    enable_ambient_occlusion();
+  w->update_texture(sp);
+  if (dynres_target_ms > 0)
+    dynres = new dynamic_resolution(s->window_width, s->window_height);
+  set_rasterize(rasterize, s);
+}
+
+void set_time(float time) {
+  view_time = time;
+  const float offset = stream_world ? time * stream_speed : 0.f;
   sp->use_this_prog();
-  glUniform2f(resolution_unif, s->window_width, s->window_height);
+  glUniform1f(time_unif, time);
+  glUniform3f(view_offset_unif, offset, 0.f, 0.f);
   sp->dont_use_this_prog();
+  if (prepass) {
+    prepass->sp->use_this_prog();
+    glUniform1f(prepass->time_unif, time);
+    glUniform3f(prepass->view_offset_unif, offset, 0.f, 0.f);
+    prepass->sp->dont_use_this_prog();
+  }
+  if (raster)
+    raster->set_time(time);
+  if (stream_world) {
+    float origin[3], dir[3];
+    camera_ray(0.f, 0.f, 1.f, 1.f, time, origin, dir);
+    streamer->update(origin[0] + offset, origin[1], origin[2]);
+  }
+}
 
-  time_unif = sp->bind_uniform("iGlobalTime");
-
-  w = new world(64, 64, 64);
-  w->update_texture(sp);
+void write_trace() {
+  const uint64_t zones = profile_write_trace(trace_path);
+  if (zones)
+    printf("trace: %lu zones written to %s\n", (unsigned long)zones
+        , trace_path);
 }
 
-void update(double dt, uint32_t t, screen *s) {
-  SDL_Event event;
-  while (SDL_PollEvent(&event) != 0) {
-    if (event.type == SDL_QUIT)
-      s->running = false;
-    else if (event.type == SDL_KEYDOWN || event.type == SDL_KEYUP) {
-      uint8_t *keystates = (uint8_t*)SDL_GetKeyboardState(nullptr);
-      int fw = keystates[SDL_SCANCODE_W] - keystates[SDL_SCANCODE_S];
-      int side = keystates[SDL_SCANCODE_D] - keystates[SDL_SCANCODE_A];
-    }
+void event(const SDL_Event &event, screen *s) {
+  if (event.type == SDL_KEYDOWN || event.type == SDL_KEYUP) {
+    if (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_h)
+      set_hierarchical(!variant.hierarchical, s);
+    if (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_r)
+      set_rasterize(!rasterize, s);
+    if (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_f)
+      set_distance_field(!distance_field, s);
+    if (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_o)
+      set_ambient_occlusion(!ambient_occlusion, s);
+    if (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_p)
+      write_trace();
+    uint8_t *keystates = (uint8_t*)SDL_GetKeyboardState(nullptr);
+    int fw = keystates[SDL_SCANCODE_W] - keystates[SDL_SCANCODE_S];
+    int side = keystates[SDL_SCANCODE_D] - keystates[SDL_SCANCODE_A];
   }
-  sp->use_this_prog();
-  glUniform1f(time_unif, (double)t / 1000.);
+}
 
+// may run on the simulation thread, so it only hands its state to draw()
+void update(double dt, uint32_t t, screen *s) {
   /*
   glm::vec3 pos = glm::vec3(cos(t / 1000.0) * 3.0f, sin(t / 1000.0) * 3.0f, 2.5f)
     , target = glm::vec3(0, 0, 0);
@@ -194,34 +1082,1065 @@ void update(double dt, uint32_t t, screen *s) {
   glUniform3f(sp->bind_attrib("viewOrigin"), pos.x, pos.y, pos.z);
   */
 
-  sp->dont_use_this_prog();
+  static double last_time = 0;
+  sim_state &next = simulation.back();
+  next.prev_time = last_time;
+  next.time = last_time = t / 1000.;
+  simulation.publish();
 }
 
-void draw() {
-  glClear(GL_COLOR_BUFFER_BIT);
-
-  sp->use_this_prog();
+// the two triangles over the viewport, which run the fragment shader of the
+// program in use for every pixel
+void draw_screen(GLint attr) {
   screenverts->bind();
-  glEnableVertexAttribArray(vattr);
-  glVertexAttribPointer(vattr, 2, GL_FLOAT, GL_FALSE, 0, 0);
+  glEnableVertexAttribArray(attr);
+  glVertexAttribPointer(attr, 2, GL_FLOAT, GL_FALSE, 0, 0);
   glDrawArrays(GL_TRIANGLES, 0, 6);
-  glDisableVertexAttribArray(vattr);
-  sp->dont_use_this_prog();
+  glDisableVertexAttribArray(attr);
+}
+
+void render() {
+  {
+    profile_zone("flush");
+    w->flush();
+  }
+  if (raster)
+    raster->invalidate(w->flushed);
+  programs->poll();
+
+  GLint target = 0;
+  glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &target);
+  int width = 0, height = 0;
+  gpu_stopwatch *stopwatch = nullptr;
+  if (dynres) {
+    const int i = dynres->frame++ % dynamic_resolution::stopwatch_count;
+    stopwatch = &dynres->stopwatches[i];
+    if (stopwatch->read(dynres->last_ms))
+      dynres->scaler.update(dynres->last_ms, dynres->scales[i]);
+    const float scale = dynres->scales[i] = dynres->scaler.scale;
+    dynres->scale_sum += scale;
+    width = std::max<int>(1, dynres->fb.width * scale + 0.5f);
+    height = std::max<int>(1, dynres->fb.height * scale + 0.5f);
+    sp->use_this_prog();
+    glUniform2f(resolution_unif, width, height);
+    sp->dont_use_this_prog();
+    stopwatch->start();
+  }
+
+  if (prepass && !rasterize) {
+    profile_gpu_zone("depth prepass");
+    const int full_width = dynres ? width : prepass->width
+      , full_height = dynres ? height : prepass->height;
+    prepass->starts.bind();
+    // a block more than needed, for the extra pixel of dynamic resolution
+    glViewport(0, 0, full_width / prepass_block + 1
+        , full_height / prepass_block + 1);
+    prepass->sp->use_this_prog();
+    glUniform2f(prepass->resolution_unif, full_width, full_height);
+    draw_screen(prepass->vattr);
+    prepass->sp->dont_use_this_prog();
+    glBindFramebuffer(GL_FRAMEBUFFER, target);
+    glViewport(0, 0, prepass->width, prepass->height);
+  }
+
+  if (dynres) {
+    // a pixel more on the far sides, which the upscale's filter reaches
+    dynres->fb.bind();
+    glViewport(0, 0, std::min(width + 1, dynres->fb.width)
+        , std::min(height + 1, dynres->fb.height));
+  }
+
+  if (rasterize) {
+    profile_gpu_zone("rasterize");
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    raster->draw();
+    if (reprojection)
+      reprojection->valid = false;
+  } else if (reprojection) {
+    gpu_reprojection &rp = *reprojection;
+    const hit_framebuffer &history = rp.targets[1 - rp.current]
+      , &next = rp.targets[rp.current];
+    const bool valid = rp.valid && rp.cover_edits(w->flushed, view_time);
+    if (valid) {
+      profile_gpu_zone("reproject");
+      rp.reprojected.bind();
+      glClearColor(0.f, 0.f, 0.f, -1.f);
+      glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+      glClearColor(0.85f, 0.f, 1.f, 1);
+      glEnable(GL_DEPTH_TEST);
+      rp.sp->use_this_prog();
+      float origin[3], dir[3];
+      camera_ray(0.f, 0.f, 1.f, 1.f, rp.time, origin, dir);
+      glUniform3fv(rp.history_origin_unif, 1, origin);
+      glUniform2f(rp.history_turn_unif, cosf(rp.time), sinf(rp.time));
+      camera_ray(0.f, 0.f, 1.f, 1.f, view_time, origin, dir);
+      glUniform3fv(rp.origin_unif, 1, origin);
+      glUniform2f(rp.turn_unif, cosf(-view_time), sinf(-view_time));
+      glActiveTexture(GL_TEXTURE6);
+      glBindTexture(GL_TEXTURE_2D, history.texture);
+      glActiveTexture(GL_TEXTURE0);
+      glDrawArrays(GL_POINTS, 0, history.width * history.height);
+      rp.sp->dont_use_this_prog();
+      glDisable(GL_DEPTH_TEST);
+    }
+    profile_gpu_zone("raymarch");
+    sp->use_this_prog();
+    glUniform1f(rp.history_valid_unif, valid);
+    next.bind();
+    draw_screen(vattr);
+    sp->dont_use_this_prog();
+    // the color goes on to the target the frame was meant for
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, next.id);
+    glReadBuffer(GL_COLOR_ATTACHMENT0);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, target);
+    glBlitFramebuffer(0, 0, next.width, next.height, 0, 0, next.width
+        , next.height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    glBindFramebuffer(GL_FRAMEBUFFER, target);
+    rp.current = 1 - rp.current;
+    rp.valid = true;
+    rp.time = view_time;
+  } else {
+    profile_gpu_zone("raymarch");
+    glClear(GL_COLOR_BUFFER_BIT);
+
+    sp->use_this_prog();
+    draw_screen(vattr);
+    sp->dont_use_this_prog();
+  }
+
+  if (dynres) {
+    stopwatch->stop();
+    profile_gpu_zone("upscale");
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, dynres->fb.id);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, target);
+    glBlitFramebuffer(0, 0, width, height, 0, 0, dynres->fb.width
+        , dynres->fb.height, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+    glBindFramebuffer(GL_FRAMEBUFFER, target);
+    glViewport(0, 0, dynres->fb.width, dynres->fb.height);
+  }
+}
+
+// the uniforms and the streamer follow the camera, at a time interpolated
+// between the last two ticks
+void draw(double now) {
+  const sim_state &state = simulation.front();
+  const double step = state.time - state.prev_time
+    , alpha = step > 0 ? std::min(std::max((now / 1000. - state.time) / step
+          , 0.), 1.) : 1.;
+  set_time(state.prev_time + step * alpha);
+
+  static double last_print = 0;
+  if (now - last_print >= 1000) {
+    if (stream_world)
+      streamer->print_stats();
+    if (dynres)
+      printf("resolution: %.0f%% of the window, raymarch %.2f ms of %.2f "
+          "ms\n", dynres->scaler.scale * 100., dynres->last_ms
+          , dynres_target_ms);
+    if (rasterize)
+      printf("raster: %u chunks drawn, %lu vertices, %u meshed in %.2f ms\n"
+          , raster->stats.draws, (unsigned long)raster->stats.vertices
+          , raster->stats.meshed, raster->stats.mesh_ms);
+    last_print = now;
+  }
+  render();
 }
 
 void cleanup() {
-  delete vs;
-  delete fs;
-  delete sp;
+  write_trace();
+  delete streamer;
+  delete stream_pool;
+  delete dynres;
+  delete prepass;
+  delete reprojection;
+  delete raster;
+  delete raster_pool;
+  delete programs;
   delete screenverts;
   delete w;
+  delete field_pool;
+  delete world_generator;
+}
+
+struct options {
+  bool cpu = false, bench = false, dda = false;
+  int width = 800, height = 450, frames = 1, threads = 0, edits = 0
+    , rays = 0, carve = 0;
+  const char *out = nullptr, *json = nullptr;
+  // --farm N renders in tiles of tile_size^2 on N worker processes and on
+  // any that join with --worker socket, see run_farm(). tiles are a whole
+  // number of the cpu renderer's, so that the pre-pass blocks fall where
+  // they would in a frame rendered in one piece
+  int farm = -1, tile_size = 256;
+  const char *socket = nullptr, *worker = nullptr;
+  float time = 0.f;
+};
+
+void write_report(const options &o, const bench_report &report) {
+  FILE *f = o.json ? fopen(o.json, "w") : stdout;
+  assertf(f, "failed to open %s for writing", o.json);
+  report.write_json(f);
+  if (o.json)
+    fclose(f);
+}
+
+// the voxels of bricks as they were before a run of edits, by brick index
+typedef std::map<uint64_t, std::vector<uint8_t>> brick_backup;
+
+// saves the bricks that b touches into backup, unless they are in it already
+void back_up_bricks(const box &b, brick_backup &backup) {
+  const uint32_t x1 = std::min(b.x1, w->w), y1 = std::min(b.y1, w->h)
+    , z1 = std::min(b.z1, w->d);
+  for (uint32_t bz = b.z0 >> brick_shift; bz <= (z1 - 1) >> brick_shift; bz++)
+    for (uint32_t by = b.y0 >> brick_shift; by <= (y1 - 1) >> brick_shift
+        ; by++)
+      for (uint32_t bx = b.x0 >> brick_shift; bx <= (x1 - 1) >> brick_shift
+          ; bx++) {
+        std::vector<uint8_t> &voxels = backup[((uint64_t)bz * w->bh + by)
+          * w->bw + bx];
+        if (voxels.empty()) {
+          voxels.resize(brick_voxels);
+          w->get_brick(bx, by, bz, &voxels[0]);
+        }
+      }
+}
+
+// puts the bricks of backup back and empties it. a brick of a single value
+// goes back as a fill, which keeps it collapsed
+void restore_bricks(brick_backup &backup) {
+  for (const auto &saved : backup) {
+    const uint32_t bx = saved.first % w->bw, by = saved.first / w->bw % w->bh
+      , bz = saved.first / ((uint64_t)w->bw * w->bh);
+    const std::vector<uint8_t> &voxels = saved.second;
+    if (std::count(voxels.begin(), voxels.end(), voxels[0])
+        == (ptrdiff_t)voxels.size())
+      w->fill(box { bx * brick_size, by * brick_size, bz * brick_size
+          , (bx + 1) * brick_size, (by + 1) * brick_size
+          , (bz + 1) * brick_size }, voxels[0]);
+    else
+      w->set_brick(bx, by, bz, &voxels[0]);
+  }
+  backup.clear();
+}
+
+// fills a few random brick sized boxes, like a player digging and building,
+// and returns them. with backup the bricks they touch are saved into it
+// first, see back_up_bricks()
+std::vector<box> random_edits(int count, brick_backup *backup = nullptr) {
+  std::vector<box> edits;
+  for (int i = 0; i < count; i++) {
+    const uint32_t x = rand() % w->w, y = rand() % w->h, z = rand() % w->d;
+    edits.push_back(box { x, y, z, x + brick_size, y + brick_size
+        , z + brick_size });
+    if (backup)
+      back_up_bricks(edits.back(), *backup);
+    w->fill(edits.back(), 255 * (rand() % 2));
+  }
+  return edits;
+}
+
+// renders frames with the software raymarcher into memory, without opening a
+// window or touching opengl
+void run_cpu(const options &o) {
+  profile_thread("main");
+  w = create_world();
+  w->update_occupancy();
+  thread_pool pool(o.threads);
+  if (distance_field)
+    w->enable_distance_field(&pool);
+  if (ambient_occlusion)
+    w->enable_ambient_occlusion(&pool);
+  cpu_renderer r(w, &pool, o.width, o.height);
+  r.hierarchical = variant.hierarchical;
+  r.max_ray_steps = variant.max_steps;
+  r.distance_field = distance_field;
+  r.ambient_occlusion = ambient_occlusion;
+  r.prepass_block = prepass_block;
+  r.reproject = reproject;
+  bench_report report;
+  report.backend = "cpu";
+  report.renderer = std::to_string(pool.size()) + " threads";
+  report.width = o.width;
+  report.height = o.height;
+  uint64_t rays = 0, steps = 0, cone_steps = 0, reused = 0;
+  for (int i = 0; i < o.frames; i++) {
+    // edits go in between frames, like they would on the main thread
+    if (i > 0) {
+      for (const box &b : random_edits(o.edits))
+        r.invalidate(b);
+      w->update_occupancy();
+      w->update_distance();
+      w->update_occlusion();
+    }
+    r.render(bench_time(i));
+    rays += r.stats.rays;
+    steps += r.stats.steps;
+    cone_steps += r.stats.cone_steps;
+    reused += r.stats.reused;
+    if (o.bench)
+      report.frame.ms.push_back(r.stats.seconds * 1000.);
+    else
+      r.print_stats();
+  }
+  report.counters.push_back(std::make_pair("hierarchical"
+        , variant.hierarchical));
+  report.counters.push_back(std::make_pair("max_ray_steps"
+        , variant.max_steps));
+  report.counters.push_back(std::make_pair("distance_field"
+        , distance_field));
+  report.counters.push_back(std::make_pair("ambient_occlusion"
+        , ambient_occlusion));
+  report.counters.push_back(std::make_pair("steps_per_ray"
+        , (double)steps / rays));
+  report.counters.push_back(std::make_pair("prepass_block", prepass_block));
+  report.counters.push_back(std::make_pair("cone_steps_per_ray"
+        , (double)cone_steps / rays));
+  report.counters.push_back(std::make_pair("reproject", reproject));
+  report.counters.push_back(std::make_pair("reuse_ratio"
+        , (double)reused / rays));
+  report.counters.push_back(std::make_pair("startup_ms", startup_ms));
+  if (o.bench)
+    write_report(o, report);
+  if (o.out)
+    r.write_ppm(o.out);
+  write_trace();
+  delete w;
+  delete world_generator;
 }
 
-int main() {
-  screen s(800, 450);
+// the gpu cannot count its steps, so they are counted by tracing a grid of
+// the frame's rays with the cpu version of the shader's traversal, from the
+// start the depth pre-pass finds for their block
+double sample_steps(float time, int width, int height
+    , double &cone_steps_per_ray) {
+  const int grid = 8;
+  uint64_t rays = 0, steps = 0, cone_steps = 0;
+  for (int y = grid / 2; y < height; y += grid)
+    for (int x = grid / 2; x < width; x += grid) {
+      float origin[3], dir[3], start = 0.f;
+      camera_ray(x + 0.5f, y + 0.5f, width, height, time, origin, dir);
+      if (prepass_block > 0) {
+        const int bx = x / prepass_block * prepass_block
+          , by = y / prepass_block * prepass_block;
+        start = cone_start(w, bx, by, bx + prepass_block, by + prepass_block
+            , width, height, time, cone_steps);
+      }
+      ray_hit r = variant.hierarchical && !distance_field
+        ? trace_ray_hierarchical(w, origin, dir, variant.max_steps, start)
+        : trace_ray(w, origin, dir, variant.max_steps, start
+            , distance_field);
+      rays++;
+      steps += r.steps;
+    }
+  // every sampled cone is shared by a block of rays
+  cone_steps_per_ray = prepass_block > 0
+    ? (double)cone_steps / rays / (prepass_block * prepass_block) : 0.;
+  return (double)steps / rays;
+}
 
-  s.mainloop(load, update, draw, cleanup);
+// renders frames into an offscreen framebuffer of a headless screen, which
+// needs no display server. every frame is finished before the clock stops,
+// so frame_ms is the full cpu and gpu cost of the frame, including uploading
+// --edits random edits, and gpu_ms is the draw alone where timer queries are
+// supported
+void run_bench(const options &o) {
+  const int warmup = 3;
+  screen s(o.width, o.height, true);
+  profile_thread("main");
+  load(&s);
+  bench_report report;
+  report.backend = "gpu";
+  report.renderer = (const char*)glGetString(GL_RENDERER);
+  report.width = o.width;
+  report.height = o.height;
+  {
+    framebuffer fb(o.width, o.height, true);
+    gpu_timer timer;
+    // what flush() sent each frame, in bytes
+    std::vector<uint64_t> upload_bytes;
+    fb.bind();
+    for (int i = -warmup; i < o.frames; i++) {
+      profile_zone("frame");
+      auto begin = std::chrono::steady_clock::now();
+      set_time(bench_time(std::max(i, 0)));
+      random_edits(o.edits);
+      timer.begin();
+      render();
+      timer.end();
+      glFinish();
+      profile_gpu_collect();
+      const double ms = std::chrono::duration<double, std::milli>(
+          std::chrono::steady_clock::now() - begin).count();
+      if (i < 0)
+        continue;
+      report.frame.ms.push_back(ms);
+      upload_bytes.push_back(w->flushed_bytes);
+      if (gpu_timer::available())
+        report.gpu.ms.push_back(timer.ms());
+    }
+    fb.unbind();
+    report.counters.push_back(std::make_pair("hierarchical"
+          , variant.hierarchical));
+    report.counters.push_back(std::make_pair("branchless"
+          , variant.branchless));
+    report.counters.push_back(std::make_pair("max_ray_steps"
+          , variant.max_steps));
+    report.counters.push_back(std::make_pair("distance_field"
+          , distance_field));
+    report.counters.push_back(std::make_pair("ambient_occlusion"
+          , ambient_occlusion));
+    report.counters.push_back(std::make_pair("prepass_block"
+          , prepass_block));
+    report.counters.push_back(std::make_pair("reproject", gpu_reproject()));
+    report.counters.push_back(std::make_pair("raster", rasterize));
+    if (rasterize) {
+      report.counters.push_back(std::make_pair("raster_draws"
+            , raster->stats.draws));
+      report.counters.push_back(std::make_pair("raster_vertices"
+            , raster->stats.vertices));
+      report.counters.push_back(std::make_pair("raster_bytes"
+            , raster->memory_usage()));
+    } else if (!stream_world) {
+      double cone_steps;
+      report.counters.push_back(std::make_pair("steps_per_ray"
+            , sample_steps(bench_time(o.frames - 1), o.width, o.height
+              , cone_steps)));
+      report.counters.push_back(std::make_pair("cone_steps_per_ray"
+            , cone_steps));
+    }
+    report.counters.push_back(std::make_pair("world_bytes"
+          , w->memory_usage()));
+    report.counters.push_back(std::make_pair("startup_ms", startup_ms));
+    report.counters.push_back(std::make_pair("shader_cache_hits"
+          , programs->hits));
+    report.counters.push_back(std::make_pair("shader_compile_ms"
+          , programs->compile_ms));
+    if (dynres) {
+      report.counters.push_back(std::make_pair("resolution_scale_mean"
+            , dynres->scale_sum / dynres->frame));
+      report.counters.push_back(std::make_pair("resolution_changes"
+            , dynres->scaler.changes));
+    }
+    uint64_t upload_sum = 0, upload_max = 0;
+    for (uint64_t bytes : upload_bytes) {
+      upload_sum += bytes;
+      upload_max = std::max(upload_max, bytes);
+    }
+    report.counters.push_back(std::make_pair("upload_bytes_mean"
+          , upload_bytes.empty() ? 0. : (double)upload_sum
+          / upload_bytes.size()));
+    report.counters.push_back(std::make_pair("upload_bytes_max"
+          , (double)upload_max));
+    if (stream_world) {
+      report.counters.push_back(std::make_pair("resident_chunks"
+            , streamer->stats.resident));
+      report.counters.push_back(std::make_pair("chunk_loads"
+            , streamer->stats.loads));
+      report.counters.push_back(std::make_pair("chunk_evictions"
+            , streamer->stats.evictions));
+      report.counters.push_back(std::make_pair("load_ms_mean"
+            , streamer->stats.load_ms_mean));
+      report.counters.push_back(std::make_pair("load_ms_max"
+            , streamer->stats.load_ms_max));
+    }
+  }
+  cleanup();
+  write_report(o, report);
+}
 
-  return 0;
+// times every candidate variant at the step limit in use like run_bench()
+// does, at least 10 frames each, and saves the fastest by median for the
+// renderer. with the distance field the hit test is always the flat one, so
+// only the way of stepping is tuned. every candidate makes the same --edits
+// to the same world, its edits are undone before the next one
+void run_autotune(const options &o) {
+  const int warmup = 3, frames = std::max(o.frames, 10);
+  screen s(o.width, o.height, true);
+  load(&s);
+  const std::string renderer = tuning_renderer();
+  std::vector<shader_variant> candidates;
+  for (const shader_variant &c : tuning_candidates(variant.max_steps))
+    if (!distance_field || c.hierarchical == variant.hierarchical) {
+      candidates.push_back(c);
+      programs->request(vsrc, fragment_source(c));
+    }
+  printf("autotune: %s, %dx%d, %d frames\n", renderer.c_str(), o.width
+      , o.height, frames);
+  shader_variant fastest = variant;
+  double fastest_ms = 0.;
+  {
+    framebuffer fb(o.width, o.height, true);
+    fb.bind();
+    for (const shader_variant &c : candidates) {
+      variant = c;
+      build_program(&s);
+      bench_series series;
+      brick_backup backup;
+      // rand() as a bench run finds it, which never seeds it
+      srand(1);
+      for (int i = -warmup; i < frames; i++) {
+        auto begin = std::chrono::steady_clock::now();
+        set_time(bench_time(std::max(i, 0)));
+        random_edits(o.edits, &backup);
+        render();
+        glFinish();
+        if (i >= 0)
+          series.ms.push_back(std::chrono::duration<double, std::milli>(
+                std::chrono::steady_clock::now() - begin).count());
+      }
+      restore_bricks(backup);
+      const double ms = series.percentile(50);
+      printf("  %-28s %8.3f ms median, %8.3f ms min\n", c.name().c_str(), ms
+          , series.min());
+      if (&c == &candidates[0] || ms < fastest_ms) {
+        fastest = c;
+        fastest_ms = ms;
+      }
+    }
+    fb.unbind();
+  }
+  printf("autotune: %s is fastest\n", fastest.name().c_str());
+  if (shader_cache)
+    save_tuned_variant(default_program_cache_dir(), renderer, fastest);
+  cleanup();
+}
+
+// world::raycast() without the occupancy pyramid, a step per voxel
+raycast_hit reference_raycast(const world *wd, const float origin[3]
+    , const float dir[3], float max_dist) {
+  raycast_hit r = {};
+  const float length = sqrtf(dir[0] * dir[0] + dir[1] * dir[1]
+      + dir[2] * dir[2]);
+  const int size[3] = { (int)wd->w, (int)wd->h, (int)wd->d };
+  int map[3], step[3], axis = -1;
+  float dn[3], side[3];
+  auto boundary = [&](int i) {
+    return dn[i] == 0.f ? std::numeric_limits<float>::infinity()
+      : ((step[i] > 0 ? map[i] + 1 : map[i]) - origin[i]) / dn[i];
+  };
+  for (int i = 0; i < 3; i++) {
+    dn[i] = dir[i] / length;
+    map[i] = floorf(origin[i]);
+    step[i] = dn[i] < 0.f ? -1 : 1;
+    side[i] = boundary(i);
+  }
+  float t = 0.f;
+  while (t <= max_dist) {
+    const bool inside = map[0] >= 0 && map[1] >= 0 && map[2] >= 0
+      && map[0] < size[0] && map[1] < size[1] && map[2] < size[2];
+    if (inside && wd->get(map[0], map[1], map[2]) > 127) {
+      r.x = map[0];
+      r.y = map[1];
+      r.z = map[2];
+      if (axis >= 0)
+        r.normal[axis] = -step[axis];
+      r.distance = t;
+      r.hit = true;
+      break;
+    }
+    axis = side[0] < side[1] ? (side[0] < side[2] ? 0 : 2)
+      : (side[1] < side[2] ? 1 : 2);
+    t = side[axis];
+    map[axis] += step[axis];
+    side[axis] = boundary(axis);
+  }
+  return r;
+}
+
+// casts --raycast N random rays through worlds of a few densities, --frames
+// times each, and checks the hits against reference_raycast(). a ray that
+// passes through an edge or corner to within float precision can go either
+// way in the two, so a few mismatches in a large batch are expected
+void run_raycast(const options &o) {
+  thread_pool pool(o.threads);
+  printf("%u^3 world, %d rays per batch, %d threads\n", world_edge, o.rays
+      , pool.size());
+  const float fills[] = { 0.01f, 0.1f, 0.5f, 1.f, -1.f };
+  for (float fill : fills) {
+    world wd(world_edge, world_edge, world_edge, world_format);
+    if (fill < 0.f)
+      generate(&wd, terrain_generator(world_seed), &pool);
+    else
+      generate(&wd, random_generator(world_seed, fill), &pool);
+    wd.update_occupancy();
+    const float max_dist = world_edge;
+    std::mt19937 rng(world_seed);
+    std::uniform_real_distribution<float> position(0.f, world_edge);
+    std::normal_distribution<float> direction;
+    ray_batch rays;
+    rays.resize(o.rays);
+    for (int i = 0; i < o.rays; i++) {
+      rays.ox[i] = position(rng);
+      rays.oy[i] = position(rng);
+      rays.oz[i] = position(rng);
+      rays.dx[i] = direction(rng);
+      rays.dy[i] = direction(rng);
+      rays.dz[i] = direction(rng);
+    }
+    std::vector<raycast_hit> hits;
+    double seconds = 0;
+    for (int f = 0; f < o.frames; f++) {
+      auto begin = std::chrono::steady_clock::now();
+      hits = wd.raycast_batch(rays, max_dist, &pool);
+      seconds += std::chrono::duration<double>(
+          std::chrono::steady_clock::now() - begin).count();
+    }
+    int hit = 0, mismatches = 0;
+    for (int i = 0; i < o.rays; i++) {
+      const float origin[3] = { rays.ox[i], rays.oy[i], rays.oz[i] }
+        , dir[3] = { rays.dx[i], rays.dy[i], rays.dz[i] };
+      const raycast_hit a = hits[i]
+        , b = reference_raycast(&wd, origin, dir, max_dist);
+      hit += a.hit;
+      if (a.hit != b.hit || (a.hit && (a.x != b.x || a.y != b.y || a.z != b.z
+              || !std::equal(a.normal, a.normal + 3, b.normal)
+              || fabsf(a.distance - b.distance) > 1e-3f)))
+        mismatches++;
+    }
+    char name[16];
+    snprintf(name, sizeof(name), fill < 0.f ? "terrain" : "fill %.2f", fill);
+    printf("%-10s: %8.2f Mrays/s, %5.1f%% hit, %d mismatches\n", name
+        , (double)o.rays * o.frames / seconds / 1e6, 100. * hit / o.rays
+        , mismatches);
+  }
+}
+
+// the traversal kernels on their own: each cpu one on one thread over the
+// rays of a --size frame, each gpu one drawing that frame, --frames times.
+// the worlds have no voxels, 1% and 50% of them solid at random, and the
+// random bricks of the default world. the gpu cannot count its steps, so
+// its steps per second are those of its cpu version, whose hits it has to
+// match: the same voxel through the same face, read back from the shader's
+// hit output. false when a gpu kernel misses more of them than
+// max_mismatches allows
+bool run_dda(const options &o) {
+  const int warmup = 3, rays = o.width * o.height;
+  // the gpu's floats round differently from the cpu's where a ray passes
+  // close to a voxel's edge, which sends a few rays to a neighbour. runs
+  // have seen up to 0.15% of them, a broken kernel gets far more wrong
+  const double max_mismatches = 0.005;
+  bool matched = true;
+  struct kernel {
+    const char *name;
+    bool hierarchical, branchless, distance;
+    int reference; // the cpu kernel with the same hit test
+  };
+  const kernel kernels[] = {
+    { "cpu flat", false, false, false, 0 },
+    { "cpu hierarchical", true, false, false, 1 },
+    { "cpu distance", false, false, true, 2 },
+    { "gpu flat-branchy", false, false, false, 0 },
+    { "gpu flat-branchless", false, true, false, 0 },
+    { "gpu hierarchical-branchy", true, false, false, 1 },
+    { "gpu hierarchical-branchless", true, true, false, 1 },
+    { "gpu distance-branchy", false, false, true, 2 },
+    { "gpu distance-branchless", false, true, true, 2 },
+  };
+  const int cpu_kernels = 3;
+  const struct {
+    const char *name;
+    float density;
+  } worlds[] = {
+    { "empty", 0.f }, { "1% solid", 0.01f }, { "50% solid", 0.5f }
+    , { "default", -1.f },
+  };
+  screen s(o.width, o.height, true);
+  world_density = worlds[0].density;
+  load(&s);
+  std::vector<float> origins(3 * rays), dirs(3 * rays);
+  for (int i = 0; i < rays; i++)
+    camera_ray(i % o.width + 0.5f, i / o.width + 0.5f, o.width, o.height
+        , bench_time(0), &origins[3 * i], &dirs[3 * i]);
+  perf_counters counters;
+  printf("dda: %dx%d rays, %d frames, %d max steps, branch misses %s\n"
+      , o.width, o.height, o.frames, variant.max_steps
+      , counters.available() ? "counted" : "not available");
+  for (const auto &world : worlds) {
+    if (&world != worlds) {
+      delete w;
+      delete world_generator;
+      world_generator = nullptr;
+      world_density = world.density;
+      w = create_world();
+      w->update_texture(sp);
+    }
+    enable_distance_field();
+    const uint64_t solid = w->count(box { 0, 0, 0, w->w, w->h, w->d });
+    printf("%s world: %.2f%% of the voxels solid\n", world.name
+        , 100. * solid / ((uint64_t)w->w * w->h * w->d));
+    std::vector<ray_hit> hits[cpu_kernels];
+    uint64_t steps[cpu_kernels];
+    for (const kernel &k : kernels) {
+      const int index = &k - kernels;
+      const bool gpu = index >= cpu_kernels;
+      double seconds = 0;
+      int mismatches = 0;
+      if (!gpu) {
+        std::vector<ray_hit> &h = hits[index];
+        h.resize(rays);
+        counters.start();
+        auto begin = std::chrono::steady_clock::now();
+        for (int f = 0; f < o.frames; f++)
+          for (int i = 0; i < rays; i++)
+            h[i] = k.hierarchical
+              ? trace_ray_hierarchical(w, &origins[3 * i], &dirs[3 * i]
+                  , variant.max_steps)
+              : trace_ray(w, &origins[3 * i], &dirs[3 * i], variant.max_steps
+                  , 0.f, k.distance);
+        seconds = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - begin).count();
+        counters.stop();
+        steps[index] = 0;
+        for (const ray_hit &r : h)
+          steps[index] += r.steps;
+      } else {
+        variant.hierarchical = k.hierarchical;
+        variant.branchless = k.branchless;
+        distance_field = k.distance;
+        framebuffer fb(o.width, o.height, true);
+        fb.bind();
+        build_program(&s);
+        for (int f = -warmup; f < o.frames; f++) {
+          auto begin = std::chrono::steady_clock::now();
+          set_time(bench_time(0));
+          render();
+          glFinish();
+          if (f >= 0)
+            seconds += std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - begin).count();
+        }
+        hit_output = true;
+        build_program(&s);
+        set_time(bench_time(0));
+        render();
+        std::vector<uint8_t> pixels(rays * 4);
+        glReadPixels(0, 0, o.width, o.height, GL_RGBA, GL_UNSIGNED_BYTE
+            , &pixels[0]);
+        hit_output = false;
+        fb.unbind();
+        // a ray that starts in a solid voxel has no face
+        for (int i = 0; i < rays; i++) {
+          const ray_hit &r = hits[k.reference][i];
+          const uint8_t *p = &pixels[4 * i];
+          if (r.hit && r.axis < 0)
+            continue;
+          const int voxel[3] = { r.x, r.y, r.z }
+            , size[3] = { (int)w->w, (int)w->h, (int)w->d };
+          bool same = r.hit == (p[3] > 0) && (!r.hit || p[3] == r.axis + 1);
+          for (int a = 0; a < 3 && r.hit; a++)
+            same = same && p[a] == ((voxel[a] % size[a]) + size[a]) % size[a];
+          mismatches += !same;
+        }
+      }
+      const double ray_steps = (double)steps[k.reference] * o.frames;
+      printf("  %-28s %8.2f Msteps/s, %6.2f steps/ray", k.name
+          , ray_steps / seconds / 1e6, (double)steps[k.reference] / rays);
+      if (gpu && mismatches > max_mismatches * rays) {
+        printf(", %d of %d rays mismatch, more than %.1f%%\n", mismatches
+            , rays, 100. * max_mismatches);
+        matched = false;
+      } else if (gpu)
+        printf(", %d of %d rays mismatch\n", mismatches, rays);
+      else if (counters.available())
+        printf(", %.4f branch misses/step, %.4f of branches\n"
+            , counters.branch_misses / ray_steps
+            , (double)counters.branch_misses / counters.branches);
+      else
+        printf("\n");
+    }
+  }
+  cleanup();
+  if (!matched)
+    printf("dda: a gpu kernel does not match its cpu kernel\n");
+  return matched;
+}
+
+// carves a sphere of radius --carve R out of the middle of the world, then
+// builds and cuts a few more shapes around it, and times every brush
+void run_carve(const options &o) {
+  w = create_world();
+  w->update_occupancy();
+  thread_pool pool(o.threads);
+  const float c = world_edge * 0.5f, r = o.carve;
+  const struct {
+    const char *name;
+    brush b;
+  } brushes[] = {
+    { "subtract sphere", { brush_sphere, brush_subtract, c, c, c, r, r, r
+      , 0 } },
+    { "union sphere", { brush_sphere, brush_union, c, c, c, r * 0.5f
+      , r * 0.5f, r * 0.5f, 255 } },
+    { "union box", { brush_box, brush_union, c + r, c, c, r, r * 0.25f, r
+      , 255 } },
+    { "subtract box", { brush_box, brush_subtract, c, c + r * 0.5f, c
+      , r * 0.25f, r, r * 0.25f, 0 } },
+    { "intersect sphere", { brush_sphere, brush_intersect, c, c, c
+      , r * 1.5f, r * 1.5f, r * 1.5f, 0 } },
+  };
+  printf("%u^3 world, %d threads\n", world_edge, pool.size());
+  for (const auto &brush : brushes) {
+    auto begin = std::chrono::steady_clock::now();
+    const box changed = apply_brush(w, brush.b, &pool);
+    const double ms = std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now() - begin).count();
+    printf("%-16s: %8.3f ms, changed %u %u %u - %u %u %u\n", brush.name, ms
+        , changed.x0, changed.y0, changed.z0, changed.x1, changed.y1
+        , changed.z1);
+  }
+  delete w;
+  delete world_generator;
 }
 
+// renders one frame at --time on worker processes, see farm.hh. the world
+// they load is the --load file, or the generated one saved next to the
+// socket. --farm N of the workers are started here, each with --threads or
+// its share of the cores, and more can join from elsewhere with --worker
+void run_farm(const options &o) {
+  const std::string socket = o.socket ? o.socket
+    : "/tmp/vfk-farm-" + std::to_string(getpid());
+  farm_frame f;
+  std::string saved;
+  if (world_path) {
+    char path[PATH_MAX];
+    assertf(realpath(world_path, path), "failed to find %s", world_path);
+    f.world_path = path;
+    world_file file(path);
+    f.world_w = file.w;
+    f.world_h = file.h;
+    f.world_d = file.d;
+  } else {
+    w = create_world();
+    saved = f.world_path = socket + ".vfk";
+    save_world(w, saved.c_str());
+    f.world_w = w->w;
+    f.world_h = w->h;
+    f.world_d = w->d;
+    delete w;
+  }
+  f.format = world_format;
+  f.width = o.width;
+  f.height = o.height;
+  f.time = o.time;
+  f.max_ray_steps = variant.max_steps;
+  f.flags = (variant.hierarchical ? farm_hierarchical : 0)
+    | (distance_field ? farm_distance_field : 0)
+    | (ambient_occlusion ? farm_ambient_occlusion : 0);
+  f.prepass_block = prepass_block;
+
+  farm_coordinator *coordinator = new farm_coordinator(socket.c_str());
+  const std::string threads = std::to_string(o.threads > 0 ? o.threads
+      : std::max(1, (int)std::thread::hardware_concurrency()
+        / std::max(o.farm, 1)));
+  std::vector<pid_t> workers;
+  for (int i = 0; i < o.farm; i++) {
+    const pid_t pid = fork();
+    assertf(pid >= 0, "failed to start a worker");
+    if (pid == 0) {
+      execl("/proc/self/exe", "vfk", "--worker", socket.c_str(), "--threads"
+          , threads.c_str(), (char*)nullptr);
+      _exit(1);
+    }
+    workers.push_back(pid);
+  }
+  printf("farm: %dx%d in %dx%d tiles, %s world, listening on %s\n", o.width
+      , o.height, o.tile_size, o.tile_size, f.world_path.c_str()
+      , socket.c_str());
+  const std::vector<uint32_t> pixels = coordinator->render(f, o.tile_size);
+  coordinator->print_stats();
+  // a worker can still be busy with a tile that another one finished for it,
+  // or be hung, and has nothing left to send
+  delete coordinator;
+  for (pid_t pid : workers) {
+    kill(pid, SIGKILL);
+    waitpid(pid, nullptr, 0);
+  }
+  if (!saved.empty())
+    unlink(saved.c_str());
+  if (o.out)
+    write_ppm(o.out, o.width, o.height, pixels);
+  delete world_generator;
+}
+
+void usage() {
+  puts("usage: vfk [--cpu] [--bench N] [--json file] [--size WxH] [--frames N]"
+      " [--threads N] [--out file.ppm] [--world N] [--edits N]\n"
+      "           [--stream] [--budget MB] [--flat] [--fill F] [--bits]"
+      " [--load file.vfk]\n"
+      "           [--seed N] [--terrain] [--no-shader-cache] [--trace "
+      "file.json]\n"
+      "           [--step MS] [--max-steps N] [--sim-thread] [--dynres MS]"
+      " [--min-scale F]\n"
+      "           [--prepass N] [--reproject] [--raycast N] [--carve R]"
+      " [--raster]\n"
+      "           [--draw-distance N] [--distance-field] [--branchless]"
+      " [--variant NAME]\n"
+      "           [--ray-steps N] [--autotune] [--ao] [--dda] [--density F]\n"
+      "           [--farm N] [--tile N] [--socket path] [--time S]"
+      " [--worker socket]");
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  options o;
+  int ray_steps = 0;
+  for (int i = 1; i < argc; i++) {
+    const std::string arg = argv[i];
+    const bool has_value = i + 1 < argc;
+    if (arg == "--cpu")
+      o.cpu = true;
+    else if (arg == "--bench" && has_value) {
+      o.bench = true;
+      o.frames = atoi(argv[++i]);
+    } else if (arg == "--json" && has_value)
+      o.json = argv[++i];
+    else if (arg == "--size" && has_value) {
+      if (sscanf(argv[++i], "%dx%d", &o.width, &o.height) != 2)
+        usage();
+    } else if (arg == "--frames" && has_value)
+      o.frames = atoi(argv[++i]);
+    else if (arg == "--threads" && has_value)
+      o.threads = atoi(argv[++i]);
+    else if (arg == "--out" && has_value)
+      o.out = argv[++i];
+    else if (arg == "--world" && has_value)
+      world_edge = atoi(argv[++i]);
+    else if (arg == "--edits" && has_value)
+      o.edits = atoi(argv[++i]);
+    else if (arg == "--stream") {
+      stream_world = true;
+      world_edge = std::max<uint32_t>(world_edge, 256);
+    } else if (arg == "--fill" && has_value)
+      world_fill = atof(argv[++i]);
+    else if (arg == "--flat") {
+      variant.hierarchical = false;
+      variant_picked = true;
+    } else if (arg == "--branchless") {
+      variant.branchless = true;
+      variant_picked = true;
+    } else if (arg == "--variant" && has_value) {
+      if (!variant.parse(argv[++i]))
+        usage();
+      variant_picked = true;
+    } else if (arg == "--ray-steps" && has_value) {
+      ray_steps = atoi(argv[++i]);
+      if (ray_steps < 1)
+        usage();
+    } else if (arg == "--autotune")
+      autotune = true;
+    else if (arg == "--dda")
+      o.dda = true;
+    else if (arg == "--density" && has_value)
+      world_density = atof(argv[++i]);
+    else if (arg == "--bits")
+      world_format = occupancy_bits;
+    else if (arg == "--load" && has_value)
+      world_path = argv[++i];
+    else if (arg == "--seed" && has_value)
+      world_seed = strtoul(argv[++i], nullptr, 0);
+    else if (arg == "--terrain")
+      terrain_world = true;
+    else if (arg == "--no-shader-cache")
+      shader_cache = false;
+    else if (arg == "--trace" && has_value)
+      trace_path = argv[++i];
+    else if (arg == "--step" && has_value)
+      step_ms = atof(argv[++i]);
+    else if (arg == "--max-steps" && has_value)
+      max_steps = atoi(argv[++i]);
+    else if (arg == "--sim-thread")
+      threaded_simulation = true;
+    else if (arg == "--dynres" && has_value)
+      dynres_target_ms = atof(argv[++i]);
+    else if (arg == "--min-scale" && has_value)
+      dynres_min_scale = atof(argv[++i]);
+    else if (arg == "--prepass" && has_value)
+      prepass_block = atoi(argv[++i]);
+    else if (arg == "--reproject")
+      reproject = true;
+    else if (arg == "--raster")
+      rasterize = true;
+    else if (arg == "--draw-distance" && has_value)
+      draw_distance = atof(argv[++i]);
+    else if (arg == "--distance-field")
+      distance_field = true;
+    else if (arg == "--ao")
+      ambient_occlusion = true;
+    else if (arg == "--raycast" && has_value)
+      o.rays = atoi(argv[++i]);
+    else if (arg == "--carve" && has_value)
+      o.carve = atoi(argv[++i]);
+    else if (arg == "--farm" && has_value)
+      o.farm = atoi(argv[++i]);
+    else if (arg == "--tile" && has_value)
+      o.tile_size = atoi(argv[++i]);
+    else if (arg == "--socket" && has_value)
+      o.socket = argv[++i];
+    else if (arg == "--time" && has_value)
+      o.time = atof(argv[++i]);
+    else if (arg == "--worker" && has_value)
+      o.worker = argv[++i];
+    else if (arg == "--budget" && has_value)
+      stream_budget = (uint64_t)atoi(argv[++i]) << 20;
+    else
+      usage();
+  }
+
+  if (step_ms <= 0 || max_steps < 1 || dynres_min_scale <= 0
+      || dynres_min_scale > 1 || prepass_block < 0 || draw_distance <= 0
+      || (rasterize && stream_world) || (autotune && (rasterize || o.cpu))
+      || (o.dda && (rasterize || stream_world || reproject
+          || world_edge > 256))
+      || (reproject && !o.cpu && (dynres_target_ms > 0 || stream_world))
+      || (o.farm >= 0 && (stream_world || reproject || o.tile_size < 32
+          || o.tile_size % 32 != 0)))
+    usage();
+  if (ray_steps > 0)
+    variant.max_steps = ray_steps;
+
+  if (o.worker) {
+    run_farm_worker(o.worker, o.threads);
+    return 0;
+  }
+
+  if (o.farm >= 0) {
+    run_farm(o);
+    return 0;
+  }
+
+  if (o.carve > 0) {
+    run_carve(o);
+    return 0;
+  }
+
+  if (o.rays > 0) {
+    run_raycast(o);
+    return 0;
+  }
+
+  if (o.cpu) {
+    run_cpu(o);
+    return 0;
+  }
+
+  if (autotune) {
+    run_autotune(o);
+    return 0;
+  }
+
+  if (o.dda)
+    return run_dda(o) ? 0 : 1;
+
+  if (o.bench) {
+    run_bench(o);
+    return 0;
+  }
+
+  screen s(o.width, o.height);
+
+  s.step_ms = step_ms;
+  s.max_steps = max_steps;
+  s.threaded_simulation = threaded_simulation;
+  s.mainloop(load, event, update, draw, cleanup);
+
+  return 0;
+}
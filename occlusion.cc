@@ -0,0 +1,50 @@
+#include "occlusion.hh"
+#include <vector>
+
+static int floor_mod(int x, int n) {
+  return ((x % n) + n) % n;
+}
+
+void bake_occlusion(const world *w, const int lo[3], const int hi[3]
+    , uint8_t *occlusion, thread_pool *pool) {
+  const int size[3] = { (int)w->w, (int)w->h, (int)w->d };
+  // the corners of the box and the voxels before them along every axis, an
+  // axis the box covers whole is baked once
+  int from[3], n[3];
+  for (int i = 0; i < 3; i++) {
+    const bool whole = hi[i] - lo[i] >= size[i];
+    from[i] = whole ? 0 : lo[i];
+    n[i] = (whole ? size[i] : hi[i] - lo[i]) + 1;
+  }
+  const int origin[3] = { from[0] - 1, from[1] - 1, from[2] - 1 };
+  const size_t row = n[0], plane = row * n[1];
+  std::vector<uint8_t> buffer(plane * n[2]);
+  w->copy_solid(origin, n, row, plane, 1, 0, &buffer[0], pool);
+
+  // after the passes along x and y every value is the sum of the 2^2 voxels
+  // from it on in its plane
+  pool->parallel_for(n[2], [&](size_t z, int) {
+    uint8_t *p = &buffer[z * plane];
+    for (int y = 0; y < n[1]; y++)
+      for (int x = 0; x + 1 < n[0]; x++)
+        p[y * row + x] += p[y * row + x + 1];
+    for (int y = 0; y + 1 < n[1]; y++)
+      for (int x = 0; x < n[0]; x++)
+        p[y * row + x] += p[(y + 1) * row + x];
+  });
+  // the pass along z adds up the 2^3 voxels around every corner, and scales
+  // them to a byte on the way out
+  uint8_t scale[9];
+  for (int i = 0; i <= 8; i++)
+    scale[i] = (i * 255 + 4) / 8;
+  pool->parallel_for(n[2] - 1, [&](size_t k, int) {
+    const size_t z = floor_mod(from[2] + k, size[2]);
+    for (int j = 0; j + 1 < n[1]; j++) {
+      const size_t y = floor_mod(from[1] + j, size[1]);
+      const uint8_t *a = &buffer[k * plane + j * row], *b = a + plane;
+      uint8_t *out = occlusion + (z * size[1] + y) * size[0];
+      for (int i = 0; i + 1 < n[0]; i++)
+        out[floor_mod(from[0] + i, size[0])] = scale[a[i] + b[i]];
+    }
+  });
+}
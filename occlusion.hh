@@ -0,0 +1,12 @@
+#pragma once
+
+#include "world.hh"
+#include "thread_pool.hh"
+
+// the ambient occlusion of the corners [lo, hi), in unwrapped voxel
+// coordinates, written into occlusion at their place in the repeating world.
+// corner x, y, z is the one voxel x, y, z has nearest the origin. occlusion
+// holds a byte per corner of w, laid out x first. the voxels around the box
+// are read on pool and summed in pairs along x, then y, then z
+void bake_occlusion(const world *w, const int lo[3], const int hi[3]
+    , uint8_t *occlusion, thread_pool *pool);
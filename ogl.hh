@@ -5,6 +5,7 @@
 #include <vector>
 #include <string>
 #include <cstring>
+#include <algorithm>
 
 class ogl_buffer {
 protected:
@@ -34,6 +35,60 @@ public:
         , GL_STATIC_DRAW);
     unbind();
   }
+  // storage for size bytes that update() writes in parts
+  void allocate(size_t size, GLenum usage = GL_DYNAMIC_DRAW) {
+    bind();
+    glBufferData(GL_ARRAY_BUFFER, size, nullptr, usage);
+    unbind();
+  }
+  void update(size_t offset, const void *data, size_t size) {
+    bind();
+    glBufferSubData(GL_ARRAY_BUFFER, offset, size, data);
+    unbind();
+  }
+};
+
+class pixel_unpack_buffer : public ogl_buffer {
+public:
+  size_t capacity;
+  pixel_unpack_buffer() : ogl_buffer(GL_PIXEL_UNPACK_BUFFER), capacity(0) {}
+};
+
+// a few pixel unpack buffers used round robin, so that the driver can still
+// be copying out of the last frame's buffer while this frame fills the next
+class unpack_ring {
+  std::vector<pixel_unpack_buffer*> _buffers;
+  size_t _next;
+public:
+  unpack_ring(int n_buffers = 3) : _next(0) {
+    for (int i = 0; i < n_buffers; i++)
+      _buffers.push_back(new pixel_unpack_buffer);
+  }
+  ~unpack_ring() {
+    for (pixel_unpack_buffer *b : _buffers)
+      delete b;
+  }
+  // binds the next buffer and maps size bytes of it for writing. texture
+  // uploads made before unbind() take byte offsets into it
+  uint8_t *map(size_t size) {
+    pixel_unpack_buffer *b = _buffers[_next++ % _buffers.size()];
+    b->bind();
+    if (b->capacity < size) {
+      b->capacity = std::max(size, b->capacity * 2);
+      glBufferData(GL_PIXEL_UNPACK_BUFFER, b->capacity, nullptr
+          , GL_STREAM_DRAW);
+    }
+    void *ptr = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size
+        , GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+    assertf(ptr, "failed to map a pixel unpack buffer of %zu bytes", size);
+    return (uint8_t*)ptr;
+  }
+  void unmap() {
+    glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+  }
+  void unbind() {
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  }
 };
 
 static std::string
@@ -61,11 +116,17 @@ get_ogl_shader_err(GLint loglen
 struct shader {
   GLuint type;
   GLuint id;
-  shader(std::string source, GLuint ntype) : type(ntype) {
+  // with n_check false the compile may still be running on the driver's
+  // threads when this returns, and check() reports its errors later
+  shader(std::string source, GLuint ntype, bool n_check = true) : type(ntype) {
     id = glCreateShader(type);
     const char *csrc = source.c_str();
     glShaderSource(id, 1, &csrc, NULL);
     glCompileShader(id);
+    if (n_check)
+      check();
+  }
+  void check() const {
     GLint loglen;
     glGetShaderiv(id, GL_INFO_LOG_LENGTH, &loglen);
     if (loglen != 0) {
@@ -96,6 +157,11 @@ struct shaderprogram {
     glAttachShader(id, vert.id);
     glAttachShader(id, frag.id);
     glLinkProgram(id);
+    check(vert, frag);
+  }
+  // takes over a program that was linked or loaded from a binary elsewhere
+  explicit shaderprogram(GLuint n_id) : id(n_id) {}
+  void check(const shader &vert, const shader &frag) {
     GLint loglen;
     glGetProgramiv(id, GL_INFO_LOG_LENGTH, &loglen);
     if (loglen != 0) {
@@ -150,6 +216,251 @@ struct shaderprogram {
   }
 };
 
+// offscreen render target with a single rgba8 color buffer, and a depth
+// buffer with n_depth
+struct framebuffer {
+  GLuint id, color, depth;
+  int width, height;
+  framebuffer(int n_width, int n_height, bool n_depth = false)
+    : depth(0), width(n_width), height(n_height) {
+    glGenRenderbuffers(1, &color);
+    glBindRenderbuffer(GL_RENDERBUFFER, color);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    if (n_depth) {
+      glGenRenderbuffers(1, &depth);
+      glBindRenderbuffer(GL_RENDERBUFFER, depth);
+      glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width
+          , height);
+    }
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+    glGenFramebuffers(1, &id);
+    glBindFramebuffer(GL_FRAMEBUFFER, id);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0
+        , GL_RENDERBUFFER, color);
+    if (depth)
+      glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT
+          , GL_RENDERBUFFER, depth);
+    GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    assertf(status == GL_FRAMEBUFFER_COMPLETE, "framebuffer of %dx%d is "
+        "incomplete: 0x%x", width, height, status);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  }
+  ~framebuffer() {
+    glDeleteFramebuffers(1, &id);
+    glDeleteRenderbuffers(1, &color);
+    if (depth)
+      glDeleteRenderbuffers(1, &depth);
+  }
+  void bind() const {
+    glBindFramebuffer(GL_FRAMEBUFFER, id);
+    glViewport(0, 0, width, height);
+  }
+  void unbind() const {
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  }
+};
+
+// offscreen render target with a single float channel, kept in a texture on
+// the given unit so that later passes can sample it
+struct float_framebuffer {
+  GLuint id, texture;
+  int width, height;
+  float_framebuffer(int n_width, int n_height, GLenum unit)
+    : width(n_width), height(n_height) {
+    glActiveTexture(unit);
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, width, height, 0, GL_RED
+        , GL_FLOAT, nullptr);
+    glActiveTexture(GL_TEXTURE0);
+    glGenFramebuffers(1, &id);
+    glBindFramebuffer(GL_FRAMEBUFFER, id);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D
+        , texture, 0);
+    GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    assertf(status == GL_FRAMEBUFFER_COMPLETE, "float framebuffer of %dx%d is "
+        "incomplete: 0x%x", width, height, status);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  }
+  ~float_framebuffer() {
+    glDeleteFramebuffers(1, &id);
+    glDeleteTextures(1, &texture);
+  }
+  void bind() const {
+    glBindFramebuffer(GL_FRAMEBUFFER, id);
+    glViewport(0, 0, width, height);
+  }
+};
+
+// offscreen render target with an rgba8 color buffer and a second, rgba32f
+// one kept in a texture on the given unit, for a pass that writes what it
+// found for every pixel next to its color. the texture starts out zero
+struct hit_framebuffer {
+  GLuint id, color, texture;
+  int width, height;
+  hit_framebuffer(int n_width, int n_height, GLenum unit)
+    : width(n_width), height(n_height) {
+    glGenRenderbuffers(1, &color);
+    glBindRenderbuffer(GL_RENDERBUFFER, color);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+    const std::vector<float> zero(4 * width * height, 0.f);
+    glActiveTexture(unit);
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, width, height, 0, GL_RGBA
+        , GL_FLOAT, zero.data());
+    glActiveTexture(GL_TEXTURE0);
+    glGenFramebuffers(1, &id);
+    glBindFramebuffer(GL_FRAMEBUFFER, id);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0
+        , GL_RENDERBUFFER, color);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D
+        , texture, 0);
+    const GLenum buffers[] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+    glDrawBuffers(2, buffers);
+    GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    assertf(status == GL_FRAMEBUFFER_COMPLETE, "hit framebuffer of %dx%d is "
+        "incomplete: 0x%x", width, height, status);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  }
+  ~hit_framebuffer() {
+    glDeleteFramebuffers(1, &id);
+    glDeleteTextures(1, &texture);
+    glDeleteRenderbuffers(1, &color);
+  }
+  void bind() const {
+    glBindFramebuffer(GL_FRAMEBUFFER, id);
+    glViewport(0, 0, width, height);
+  }
+};
+
+// offscreen render target with an rgba32f color buffer kept in a texture on
+// the given unit and a depth buffer, for a pass that scatters points of which
+// the nearest one on a pixel wins
+struct scatter_framebuffer {
+  GLuint id, texture, depth;
+  int width, height;
+  scatter_framebuffer(int n_width, int n_height, GLenum unit)
+    : width(n_width), height(n_height) {
+    glGenRenderbuffers(1, &depth);
+    glBindRenderbuffer(GL_RENDERBUFFER, depth);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width
+        , height);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+    glActiveTexture(unit);
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, width, height, 0, GL_RGBA
+        , GL_FLOAT, nullptr);
+    glActiveTexture(GL_TEXTURE0);
+    glGenFramebuffers(1, &id);
+    glBindFramebuffer(GL_FRAMEBUFFER, id);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D
+        , texture, 0);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT
+        , GL_RENDERBUFFER, depth);
+    GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    assertf(status == GL_FRAMEBUFFER_COMPLETE, "scatter framebuffer of %dx%d "
+        "is incomplete: 0x%x", width, height, status);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  }
+  ~scatter_framebuffer() {
+    glDeleteFramebuffers(1, &id);
+    glDeleteTextures(1, &texture);
+    glDeleteRenderbuffers(1, &depth);
+  }
+  void bind() const {
+    glBindFramebuffer(GL_FRAMEBUFFER, id);
+    glViewport(0, 0, width, height);
+  }
+};
+
+// GL_TIME_ELAPSED query around a stretch of gpu work. available() is false
+// on drivers without ARB_timer_query, in which case the timer does nothing
+struct gpu_timer {
+  GLuint id;
+  gpu_timer() : id(0) {
+    if (available())
+      glGenQueries(1, &id);
+  }
+  ~gpu_timer() {
+    if (id)
+      glDeleteQueries(1, &id);
+  }
+  static bool available() {
+    return GLEW_ARB_timer_query || GLEW_VERSION_3_3;
+  }
+  void begin() {
+    if (id)
+      glBeginQuery(GL_TIME_ELAPSED, id);
+  }
+  void end() {
+    if (id)
+      glEndQuery(GL_TIME_ELAPSED);
+  }
+  // blocks until the result is available
+  double ms() const {
+    if (!id)
+      return 0;
+    GLuint64 ns;
+    glGetQueryObjectui64v(id, GL_QUERY_RESULT, &ns);
+    return ns / 1e6;
+  }
+};
+
+// a GL_TIMESTAMP query at either end of a stretch of gpu work. unlike
+// gpu_timer it can be read without waiting and can sit inside a gpu_timer
+struct gpu_stopwatch {
+  GLuint ids[2];
+  bool stopped;
+  gpu_stopwatch() : stopped(false) {
+    ids[0] = ids[1] = 0;
+    if (gpu_timer::available())
+      glGenQueries(2, ids);
+  }
+  ~gpu_stopwatch() {
+    if (ids[0])
+      glDeleteQueries(2, ids);
+  }
+  void start() {
+    if (ids[0])
+      glQueryCounter(ids[0], GL_TIMESTAMP);
+  }
+  void stop() {
+    if (ids[0]) {
+      glQueryCounter(ids[1], GL_TIMESTAMP);
+      stopped = true;
+    }
+  }
+  // false until the gpu got to stop(), and again after the time was read
+  bool read(double &ms) {
+    GLint available = 0;
+    if (stopped)
+      glGetQueryObjectiv(ids[1], GL_QUERY_RESULT_AVAILABLE, &available);
+    if (!available)
+      return false;
+    GLuint64 begin, end;
+    glGetQueryObjectui64v(ids[0], GL_QUERY_RESULT, &begin);
+    glGetQueryObjectui64v(ids[1], GL_QUERY_RESULT, &end);
+    ms = (end - begin) / 1e6;
+    stopped = false;
+    return true;
+  }
+};
+
 struct vertexarray {
   GLuint id;
   vertexarray() {
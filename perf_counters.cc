@@ -0,0 +1,55 @@
+#include "perf_counters.hh"
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cstring>
+#include <initializer_list>
+
+static int open_counter(uint64_t config) {
+  perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.size = sizeof(attr);
+  attr.config = config;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static int64_t read_counter(int fd) {
+  uint64_t value;
+  if (fd < 0 || read(fd, &value, sizeof(value)) != sizeof(value))
+    return -1;
+  return value;
+}
+
+perf_counters::perf_counters()
+  : _branches(open_counter(PERF_COUNT_HW_BRANCH_INSTRUCTIONS))
+    , _branch_misses(open_counter(PERF_COUNT_HW_BRANCH_MISSES))
+    , branches(-1), branch_misses(-1) {
+}
+
+perf_counters::~perf_counters() {
+  if (_branches >= 0)
+    close(_branches);
+  if (_branch_misses >= 0)
+    close(_branch_misses);
+}
+
+void perf_counters::start() {
+  for (int fd : { _branches, _branch_misses })
+    if (fd >= 0) {
+      ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+      ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+void perf_counters::stop() {
+  for (int fd : { _branches, _branch_misses })
+    if (fd >= 0)
+      ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+  branches = read_counter(_branches);
+  branch_misses = read_counter(_branch_misses);
+}
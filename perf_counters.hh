@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstdint>
+
+// hardware counters of the calling thread through perf_event_open(), for the
+// benchmarks. a counter that the kernel or the cpu does not offer, like in
+// most virtual machines, reads back as -1
+class perf_counters {
+  int _branches, _branch_misses; // descriptors, -1 when not available
+public:
+  // counted in user space between the last start() and stop()
+  int64_t branches, branch_misses;
+  perf_counters();
+  ~perf_counters();
+  bool available() const { return _branch_misses >= 0; }
+  void start();
+  void stop();
+};
@@ -0,0 +1,200 @@
+#include "profiler.hh"
+
+#ifdef VFK_PROFILE
+
+#include "utils.hh"
+#include <GL/glew.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// times are in nanoseconds since the program started
+struct profile_event {
+  const char *name;
+  uint64_t begin, end;
+};
+
+// the zones of a thread. only the thread writes the events and head, the
+// trace writer reads them. it reads slots the thread may be overwriting at
+// the same time, and drops the ones head says were lapped while it read
+struct profile_ring {
+  static const uint64_t capacity = 1 << 14;
+  profile_event events[capacity];
+  std::atomic<uint64_t> head; // events recorded so far
+  uint64_t tail; // events drained into the trace
+  uint32_t tid;
+  std::string name;
+};
+
+static const uint64_t start_ns = std::chrono::duration_cast<
+  std::chrono::nanoseconds>(std::chrono::steady_clock::now()
+      .time_since_epoch()).count();
+
+static uint64_t now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count() - start_ns;
+}
+
+// the rings live until exit, threads that have quit can still be drained
+static std::mutex rings_mutex;
+static std::vector<std::unique_ptr<profile_ring>> rings;
+static thread_local profile_ring *this_ring = nullptr;
+
+static profile_ring *new_ring(const std::string &name) {
+  std::lock_guard<std::mutex> lk(rings_mutex);
+  rings.emplace_back(new profile_ring);
+  profile_ring *r = rings.back().get();
+  r->head = 0;
+  r->tail = 0;
+  r->tid = rings.size();
+  r->name = name.empty() ? "thread " + std::to_string(r->tid) : name;
+  return r;
+}
+
+static profile_ring *thread_ring() {
+  if (!this_ring)
+    this_ring = new_ring("");
+  return this_ring;
+}
+
+static void record(profile_ring *r, const char *name, uint64_t begin
+    , uint64_t end) {
+  const uint64_t h = r->head.load(std::memory_order_relaxed);
+  r->events[h % profile_ring::capacity] = profile_event { name, begin, end };
+  r->head.store(h + 1, std::memory_order_release);
+}
+
+profile_scope::profile_scope(const char *n_name)
+  : _name(n_name), _begin(now_ns()) {}
+
+profile_scope::~profile_scope() {
+  record(thread_ring(), _name, _begin, now_ns());
+}
+
+void profile_thread(const char *name) {
+  profile_ring *r = thread_ring();
+  std::lock_guard<std::mutex> lk(rings_mutex);
+  r->name = name;
+}
+
+// gpu zones wait in order of their beginning until both their timestamps
+// are available. all of this only runs on the thread of the gl context
+struct gpu_zone {
+  const char *name;
+  GLuint begin, end;
+  bool ended;
+};
+static std::deque<gpu_zone> gpu_zones;
+static uint64_t gpu_first_zone = 0; // number of gpu_zones.front()
+static std::vector<GLuint> free_queries;
+static profile_ring *gpu_ring = nullptr;
+static int64_t gpu_to_cpu_ns;
+
+static bool gpu_timestamps() {
+  return GLEW_ARB_timer_query || GLEW_VERSION_3_3;
+}
+
+static GLuint take_query() {
+  if (free_queries.empty()) {
+    free_queries.resize(64);
+    glGenQueries(free_queries.size(), &free_queries[0]);
+  }
+  const GLuint q = free_queries.back();
+  free_queries.pop_back();
+  return q;
+}
+
+profile_gpu_scope::profile_gpu_scope(const char *n_name) : _query(~0ull) {
+  if (!gpu_timestamps())
+    return;
+  if (!gpu_ring) {
+    gpu_ring = new_ring("gpu");
+    // gl timestamps count from a point of their own, so they are put on
+    // the cpu's clock by where both are now
+    GLint64 gpu_now;
+    glGetInteger64v(GL_TIMESTAMP, &gpu_now);
+    gpu_to_cpu_ns = (int64_t)now_ns() - gpu_now;
+  }
+  _query = gpu_first_zone + gpu_zones.size();
+  gpu_zones.push_back(gpu_zone { n_name, take_query(), take_query(), false });
+  glQueryCounter(gpu_zones.back().begin, GL_TIMESTAMP);
+}
+
+profile_gpu_scope::~profile_gpu_scope() {
+  if (_query == ~0ull)
+    return;
+  gpu_zone &z = gpu_zones[_query - gpu_first_zone];
+  glQueryCounter(z.end, GL_TIMESTAMP);
+  z.ended = true;
+}
+
+void profile_gpu_collect() {
+  while (!gpu_zones.empty() && gpu_zones.front().ended) {
+    const gpu_zone &z = gpu_zones.front();
+    GLint available;
+    glGetQueryObjectiv(z.end, GL_QUERY_RESULT_AVAILABLE, &available);
+    if (!available)
+      break;
+    GLuint64 begin, end;
+    glGetQueryObjectui64v(z.begin, GL_QUERY_RESULT, &begin);
+    glGetQueryObjectui64v(z.end, GL_QUERY_RESULT, &end);
+    record(gpu_ring, z.name, begin + gpu_to_cpu_ns, end + gpu_to_cpu_ns);
+    free_queries.push_back(z.begin);
+    free_queries.push_back(z.end);
+    gpu_zones.pop_front();
+    gpu_first_zone++;
+  }
+}
+
+// zones drained so far, kept so that every write is a complete trace
+struct trace_event {
+  profile_event event;
+  uint32_t tid;
+};
+static std::vector<trace_event> trace;
+
+uint64_t profile_write_trace(const char *path) {
+  std::lock_guard<std::mutex> lk(rings_mutex);
+  const size_t before = trace.size();
+  for (auto &r : rings) {
+    const uint64_t head = r->head.load(std::memory_order_acquire)
+      , first = std::max(r->tail, head > profile_ring::capacity
+          ? head - profile_ring::capacity : 0);
+    std::vector<profile_event> events;
+    for (uint64_t i = first; i < head; i++)
+      events.push_back(r->events[i % profile_ring::capacity]);
+    // the thread writes the slot of event head - capacity next, so the
+    // events up to there may have changed while they were copied
+    const uint64_t after = r->head.load(std::memory_order_acquire);
+    for (uint64_t i = first; i < head; i++)
+      if (i + profile_ring::capacity > after)
+        trace.push_back(trace_event { events[i - first], r->tid });
+    r->tail = head;
+  }
+
+  FILE *f = fopen(path, "w");
+  assertf(f, "failed to open %s for writing", path);
+  fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+  const char *separator = "\n";
+  for (auto &r : rings) {
+    fprintf(f, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, "
+        "\"tid\": %u, \"args\": {\"name\": \"%s\"}}", separator, r->tid
+        , r->name.c_str());
+    separator = ",\n";
+  }
+  for (const trace_event &t : trace)
+    fprintf(f, "%s{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %u, "
+        "\"ts\": %.3f, \"dur\": %.3f}", separator, t.event.name, t.tid
+        , t.event.begin / 1e3, (t.event.end - t.event.begin) / 1e3);
+  fprintf(f, "\n]}\n");
+  assertf(fclose(f) == 0, "failed to write %s", path);
+  return trace.size() - before;
+}
+
+#endif
@@ -0,0 +1,61 @@
+#pragma once
+
+// instrumentation of where frames go, built in with -DVFK_PROFILE (make
+// profile) and compiled to nothing otherwise:
+//
+//   profile_zone("name")      times the rest of the enclosing scope on the
+//                             calling thread
+//   profile_gpu_zone("name")  times the gl commands issued in the rest of the
+//                             enclosing scope with timestamp queries
+//   profile_thread("name")    names the calling thread in the trace
+//
+// every thread records its zones into a ring buffer of its own that only it
+// writes to, so recording takes no lock. the rings keep the latest zones,
+// and profile_write_trace() drains them into a chrome trace that
+// chrome://tracing and ui.perfetto.dev open. names have to be string
+// literals, only the pointer is kept
+
+#include <cstdint>
+
+#ifdef VFK_PROFILE
+
+class profile_scope {
+  const char *_name;
+  uint64_t _begin;
+public:
+  profile_scope(const char *n_name);
+  ~profile_scope();
+};
+
+class profile_gpu_scope {
+  uint64_t _query; // number of its gpu zone
+public:
+  profile_gpu_scope(const char *n_name);
+  ~profile_gpu_scope();
+};
+
+void profile_thread(const char *name);
+// moves the gpu zones whose queries have finished into the trace. called
+// once per frame from the thread of the gl context, never waits on the gpu
+void profile_gpu_collect();
+// appends everything recorded since the last call to the trace in path and
+// returns the number of zones written. the file is rewritten as a whole, so
+// it is a complete trace after every call
+uint64_t profile_write_trace(const char *path);
+
+#define profile_concat2(a, b) a##b
+#define profile_concat(a, b) profile_concat2(a, b)
+#define profile_zone(name) \
+  profile_scope profile_concat(_profile_zone_, __LINE__)(name)
+#define profile_gpu_zone(name) \
+  profile_gpu_scope profile_concat(_profile_gpu_zone_, __LINE__)(name)
+
+#else
+
+#define profile_zone(name) do {} while (0)
+#define profile_gpu_zone(name) do {} while (0)
+static inline void profile_thread(const char*) {}
+static inline void profile_gpu_collect() {}
+static inline uint64_t profile_write_trace(const char*) { return 0; }
+
+#endif
@@ -0,0 +1,210 @@
+#include "program_cache.hh"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// a binary file is the magic "VFKP", the driver's binary format and the
+// binary itself
+static const char binary_magic[4] = { 'V', 'F', 'K', 'P' };
+
+static double ms_since(std::chrono::steady_clock::time_point begin) {
+  return std::chrono::duration<double, std::milli>(
+      std::chrono::steady_clock::now() - begin).count();
+}
+
+// fnv-1a
+static uint64_t hash_string(uint64_t h, const std::string &s) {
+  for (size_t i = 0; i <= s.size(); i++) {
+    h ^= i < s.size() ? (uint8_t)s[i] : 0;
+    h *= 0x100000001B3ull;
+  }
+  return h;
+}
+
+// creates path and its parents, like mkdir -p
+static bool make_dirs(const std::string &path) {
+  for (size_t i = 1; i <= path.size(); i++)
+    if (i == path.size() || path[i] == '/') {
+      const std::string dir = path.substr(0, i);
+      struct stat st;
+      if (stat(dir.c_str(), &st) != 0 && mkdir(dir.c_str(), 0755) != 0)
+        return false;
+    }
+  return true;
+}
+
+std::string default_program_cache_dir() {
+  if (const char *xdg = getenv("XDG_CACHE_HOME"))
+    if (*xdg)
+      return std::string(xdg) + "/vfk";
+  if (const char *home = getenv("HOME"))
+    if (*home)
+      return std::string(home) + "/.cache/vfk";
+  return "";
+}
+
+program_cache::program_cache(const std::string &n_dir)
+  : _dir(n_dir), hits(0), misses(0), compile_ms(0) {
+  GLint formats = 0;
+  if (GLEW_ARB_get_program_binary)
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+  _binaries = formats > 0 && !_dir.empty();
+  if (_binaries && !make_dirs(_dir)) {
+    printf("warning: failed to create the shader cache in %s\n"
+        , _dir.c_str());
+    _binaries = false;
+  }
+  _driver = std::string((const char*)glGetString(GL_VENDOR)) + "\n"
+    + (const char*)glGetString(GL_RENDERER) + "\n"
+    + (const char*)glGetString(GL_VERSION);
+  _parallel = GLEW_KHR_parallel_shader_compile;
+  if (_parallel)
+    glMaxShaderCompilerThreadsKHR(0xFFFFFFFF); // as many as the driver likes
+}
+
+program_cache::~program_cache() {
+  for (auto &e : _entries) {
+    delete e.second.vert;
+    delete e.second.frag;
+    delete e.second.program;
+  }
+}
+
+uint64_t program_cache::key(const std::string &vsrc
+    , const std::string &fsrc) const {
+  return hash_string(hash_string(hash_string(0xCBF29CE484222325ull, vsrc)
+        , fsrc), _driver);
+}
+
+bool program_cache::load_binary(entry &e) {
+  FILE *f = fopen(e.path.c_str(), "rb");
+  if (!f)
+    return false;
+  std::vector<uint8_t> data;
+  uint8_t buf[1 << 16];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+    data.insert(data.end(), buf, buf + n);
+  fclose(f);
+  GLenum format;
+  if (data.size() <= sizeof(binary_magic) + sizeof(format)
+      || memcmp(&data[0], binary_magic, sizeof(binary_magic)) != 0)
+    return false;
+  memcpy(&format, &data[sizeof(binary_magic)], sizeof(format));
+  const size_t header = sizeof(binary_magic) + sizeof(format);
+
+  const GLuint id = glCreateProgram();
+  glProgramBinary(id, format, &data[header], data.size() - header);
+  GLint linked;
+  glGetProgramiv(id, GL_LINK_STATUS, &linked);
+  if (linked != GL_TRUE) {
+    // the driver changed in a way its version string does not tell
+    glDeleteProgram(id);
+    unlink(e.path.c_str());
+    return false;
+  }
+  e.program = new shaderprogram(id);
+  return true;
+}
+
+// written next to the final path and renamed over it, so that another
+// instance never reads half a binary
+void program_cache::save_binary(const entry &e) const {
+  GLint size = 0;
+  glGetProgramiv(e.program->id, GL_PROGRAM_BINARY_LENGTH, &size);
+  if (size <= 0)
+    return;
+  std::vector<uint8_t> data(size);
+  GLenum format;
+  GLsizei length = 0;
+  glGetProgramBinary(e.program->id, size, &length, &format, &data[0]);
+  if (length <= 0)
+    return;
+  const std::string tmp = e.path + "." + std::to_string(getpid());
+  FILE *f = fopen(tmp.c_str(), "wb");
+  if (!f)
+    return;
+  const bool written = fwrite(binary_magic, sizeof(binary_magic), 1, f) == 1
+    && fwrite(&format, sizeof(format), 1, f) == 1
+    && fwrite(&data[0], length, 1, f) == 1;
+  if (fclose(f) == 0 && written)
+    rename(tmp.c_str(), e.path.c_str());
+  else
+    unlink(tmp.c_str());
+}
+
+// without KHR_parallel_shader_compile there is no asking, but most drivers
+// have built the program by the time glLinkProgram() returns
+bool program_cache::done(const entry &e) const {
+  if (!e.vert || !_parallel)
+    return true;
+  GLint status;
+  glGetProgramiv(e.program->id, GL_COMPLETION_STATUS_KHR, &status);
+  return status == GL_TRUE;
+}
+
+// reports the errors of a build from source, which blocks until it is done,
+// and saves its binary
+void program_cache::finish(entry &e) {
+  if (!e.vert)
+    return;
+  e.vert->check();
+  e.frag->check();
+  e.program->check(*e.vert, *e.frag);
+  if (_binaries)
+    save_binary(e);
+  delete e.vert;
+  delete e.frag;
+  e.vert = e.frag = nullptr;
+}
+
+void program_cache::request(const std::string &vsrc
+    , const std::string &fsrc) {
+  const uint64_t k = key(vsrc, fsrc);
+  if (_entries.count(k))
+    return;
+  auto begin = std::chrono::steady_clock::now();
+  entry &e = _entries[k];
+  e.vert = e.frag = nullptr;
+  e.program = nullptr;
+  if (_binaries) {
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.bin", (unsigned long long)k);
+    e.path = _dir + name;
+    if (load_binary(e)) {
+      hits++;
+      compile_ms += ms_since(begin);
+      return;
+    }
+  }
+  misses++;
+  e.vert = new shader(vsrc, GL_VERTEX_SHADER, false);
+  e.frag = new shader(fsrc, GL_FRAGMENT_SHADER, false);
+  const GLuint id = glCreateProgram();
+  glAttachShader(id, e.vert->id);
+  glAttachShader(id, e.frag->id);
+  if (_binaries)
+    glProgramParameteri(id, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+  glLinkProgram(id);
+  e.program = new shaderprogram(id);
+  compile_ms += ms_since(begin);
+}
+
+void program_cache::poll() {
+  for (auto &e : _entries)
+    if (e.second.vert && done(e.second))
+      finish(e.second);
+}
+
+shaderprogram *program_cache::get(const std::string &vsrc
+    , const std::string &fsrc) {
+  request(vsrc, fsrc);
+  entry &e = _entries[key(vsrc, fsrc)];
+  auto begin = std::chrono::steady_clock::now();
+  finish(e);
+  compile_ms += ms_since(begin);
+  return e.program;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "ogl.hh"
+#include <map>
+#include <string>
+#include <cstdint>
+
+// linked shader programs, kept on disk as driver binaries so that later runs
+// skip compiling them. a binary is keyed by a hash of the program's sources
+// and the driver's vendor, renderer and version strings, and one the driver
+// rejects anyway is thrown away and the program built from source again.
+//
+// programs are requested before they are needed. with
+// KHR_parallel_shader_compile the driver compiles and links them on threads
+// of its own while the caller goes on, and get() only blocks on a program
+// that is not done yet. all calls have to come from the thread of the gl
+// context
+class program_cache {
+  struct entry {
+    shader *vert, *frag; // while the program is built from source
+    shaderprogram *program;
+    std::string path;
+  };
+  std::string _dir, _driver;
+  bool _binaries, _parallel;
+  std::map<uint64_t, entry> _entries;
+  uint64_t key(const std::string &vsrc, const std::string &fsrc) const;
+  bool load_binary(entry &e);
+  void save_binary(const entry &e) const;
+  bool done(const entry &e) const;
+  void finish(entry &e);
+public:
+  uint32_t hits, misses;
+  // spent in gl calls building and loading programs, and waiting for builds
+  // in get(). builds overlapped with other work do not count
+  double compile_ms;
+  // binaries go into n_dir, which is created if needed. with an empty n_dir
+  // nothing is read from or written to disk
+  program_cache(const std::string &n_dir);
+  ~program_cache();
+  // starts building the program unless it is cached or already building
+  void request(const std::string &vsrc, const std::string &fsrc);
+  // finishes the builds the driver is done with, which saves their binaries.
+  // never blocks with KHR_parallel_shader_compile, so it can run every frame
+  void poll();
+  // the program, built now if it was not requested before. it stays owned
+  // by the cache
+  shaderprogram *get(const std::string &vsrc, const std::string &fsrc);
+};
+
+// $XDG_CACHE_HOME/vfk or ~/.cache/vfk, or nothing without a home directory
+std::string default_program_cache_dir();
@@ -0,0 +1,432 @@
+#include "raster.hh"
+#include "cpu_renderer.hh"
+#include "utils.hh"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+// the radius of the sphere the renderers keep clear, see clear_voxel() in
+// cpu_renderer.cc
+static const float clear_radius = 30.f;
+
+static int floor_div(int a, int b) {
+  return a >= 0 ? a / b : -((-a + b - 1) / b);
+}
+
+static int wrap(int a, int n) {
+  return (a % n + n) % n;
+}
+
+void mesh_chunk(const world *w, uint32_t edge, int cx, int cy, int cz
+    , bool clear, std::vector<quad_vertex> &vertices) {
+  // the chunk's voxels as 0 or 1, with a layer of its neighbours' around
+  // them. the bricks are fetched whole, edge is a multiple of brick_size and
+  // so the world repeats at brick boundaries
+  const int side = edge + 2, lo[3] = { cx * (int)edge - 1
+    , cy * (int)edge - 1, cz * (int)edge - 1 }
+    , bricks[3] = { (int)w->bw, (int)w->bh, (int)w->bd };
+  std::vector<uint8_t> solid(side * side * side);
+  uint8_t voxels[brick_voxels];
+  for (int bz = floor_div(lo[2], brick_size)
+      ; bz <= floor_div(lo[2] + side - 1, brick_size); bz++)
+    for (int by = floor_div(lo[1], brick_size)
+        ; by <= floor_div(lo[1] + side - 1, brick_size); by++)
+      for (int bx = floor_div(lo[0], brick_size)
+          ; bx <= floor_div(lo[0] + side - 1, brick_size); bx++) {
+        uint8_t value;
+        const bool uniform = w->uniform_brick(wrap(bx, bricks[0])
+            , wrap(by, bricks[1]), wrap(bz, bricks[2]), value);
+        if (uniform && !value)
+          continue;
+        if (!uniform)
+          w->get_brick(wrap(bx, bricks[0]), wrap(by, bricks[1])
+              , wrap(bz, bricks[2]), voxels);
+        // the part of the brick inside the padded chunk
+        const int b[3] = { bx * (int)brick_size, by * (int)brick_size
+          , bz * (int)brick_size };
+        int from[3], to[3];
+        for (int i = 0; i < 3; i++) {
+          from[i] = std::max(b[i], lo[i]) - lo[i];
+          to[i] = std::min(b[i] + (int)brick_size, lo[i] + side) - lo[i];
+        }
+        for (int z = from[2]; z < to[2]; z++)
+          for (int y = from[1]; y < to[1]; y++)
+            for (int x = from[0]; x < to[0]; x++)
+              solid[(z * side + y) * side + x] = uniform ? 1
+                : voxels[(((z + lo[2] - b[2]) << brick_shift)
+                    + y + lo[1] - b[1]) * brick_size + x + lo[0] - b[0]] != 0;
+      }
+  if (clear)
+    for (int z = 0; z < side; z++)
+      for (int y = 0; y < side; y++)
+        for (int x = 0; x < side; x++) {
+          const float px = lo[0] + x + 0.5f, py = lo[1] + y + 0.5f
+            , pz = lo[2] + z + 0.5f;
+          if (px * px + py * py + pz * pz <= clear_radius * clear_radius)
+            solid[(z * side + y) * side + x] = 0;
+        }
+
+  // a face for every solid voxel whose neighbour in the direction is empty,
+  // per slice across the axis. quads grow along u as far as the faces go,
+  // then along v while the rows below are covered as wide
+  const int n = edge;
+  std::vector<uint8_t> mask(n * n);
+  for (int axis = 0; axis < 3; axis++) {
+    const int u = (axis + 1) % 3, v = (axis + 2) % 3;
+    int step[3] = { 0, 0, 0 };
+    step[axis] = 1;
+    const int stride[3] = { 1, side, side * side }
+      , offset = step[0] * stride[0] + step[1] * stride[1]
+        + step[2] * stride[2];
+    for (int dir = -1; dir <= 1; dir += 2)
+      for (int slice = 0; slice < n; slice++) {
+        for (int j = 0; j < n; j++)
+          for (int i = 0; i < n; i++) {
+            int p[3];
+            p[axis] = slice + 1;
+            p[u] = i + 1;
+            p[v] = j + 1;
+            const int at = p[0] * stride[0] + p[1] * stride[1]
+              + p[2] * stride[2];
+            mask[j * n + i] = solid[at] && !solid[at + dir * offset];
+          }
+        for (int j = 0; j < n; j++)
+          for (int i = 0; i < n; ) {
+            if (!mask[j * n + i]) {
+              i++;
+              continue;
+            }
+            int width = 1, height = 1;
+            while (i + width < n && mask[j * n + i + width])
+              width++;
+            for (; j + height < n; height++) {
+              const uint8_t *row = &mask[(j + height) * n + i];
+              if (std::find(row, row + width, 0) != row + width)
+                break;
+            }
+            for (int k = 0; k < height; k++)
+              std::fill_n(&mask[(j + k) * n + i], width, 0);
+            // counterclockwise seen from the empty side, where it faces
+            quad_vertex corners[4];
+            const int cu[4] = { i, i + width, i + width, i }
+              , cv[4] = { j, j, j + height, j + height };
+            for (int c = 0; c < 4; c++) {
+              uint8_t q[3];
+              q[axis] = slice + (dir > 0);
+              q[u] = cu[c];
+              q[v] = cv[c];
+              corners[c] = quad_vertex { q[0], q[1], q[2], (uint8_t)axis };
+            }
+            const int order[2][6] = { { 0, 1, 2, 0, 2, 3 }
+              , { 0, 2, 1, 0, 3, 2 } };
+            for (int c = 0; c < 6; c++)
+              vertices.push_back(corners[order[dir > 0][c]]);
+            i += width;
+          }
+      }
+  }
+}
+
+vertex_pool::vertex_pool(uint32_t n_capacity) : _capacity(n_capacity) {}
+
+vertex_pool::~vertex_pool() {
+  for (pool_buffer &b : _buffers)
+    delete b.vertices;
+}
+
+vertex_pool::range vertex_pool::allocate(
+    const std::vector<quad_vertex> &vertices) {
+  const uint32_t count = vertices.size();
+  assertf(count <= _capacity, "a mesh of %u vertices does not fit in a "
+      "vertex buffer of %u", count, _capacity);
+  if (!count)
+    return range { 0, 0, 0 };
+  range r { 0, 0, count };
+  bool found = false;
+  for (; r.buffer < _buffers.size(); r.buffer++) {
+    for (auto &run : _buffers[r.buffer].free)
+      if (run.second >= count) {
+        r.first = run.first;
+        found = true;
+        break;
+      }
+    if (found)
+      break;
+  }
+  if (!found) {
+    pool_buffer b;
+    b.vertices = new array_buffer;
+    b.vertices->allocate(_capacity * sizeof(quad_vertex));
+    b.free[0] = _capacity;
+    _buffers.push_back(b);
+  }
+  std::map<uint32_t, uint32_t> &free = _buffers[r.buffer].free;
+  const uint32_t left = free[r.first] - count;
+  free.erase(r.first);
+  if (left)
+    free[r.first + count] = left;
+  _buffers[r.buffer].vertices->update(r.first * sizeof(quad_vertex)
+      , vertices.data(), count * sizeof(quad_vertex));
+  return r;
+}
+
+void vertex_pool::release(const range &r) {
+  if (!r.count)
+    return;
+  std::map<uint32_t, uint32_t> &free = _buffers[r.buffer].free;
+  auto next = free.lower_bound(r.first);
+  uint32_t first = r.first, count = r.count;
+  if (next != free.end() && next->first == first + count) {
+    count += next->second;
+    next = free.erase(next);
+  }
+  if (next != free.begin()) {
+    auto prev = std::prev(next);
+    if (prev->first + prev->second == first) {
+      first = prev->first;
+      count += prev->second;
+      free.erase(prev);
+    }
+  }
+  free[first] = count;
+}
+
+uint64_t vertex_pool::bytes() const {
+  return (uint64_t)_buffers.size() * _capacity * sizeof(quad_vertex);
+}
+
+bool raster_renderer::chunk_key::operator<(const chunk_key &o) const {
+  if (x != o.x)
+    return x < o.x;
+  if (y != o.y)
+    return y < o.y;
+  if (z != o.z)
+    return z < o.z;
+  return own < o.own;
+}
+
+const char *raster_renderer::vsrc = _glsl(
+  attribute vec4 corner;
+  uniform mat4 view_projection;
+  uniform vec3 chunk_origin;
+  varying float axis;
+  void main() {
+    gl_Position = view_projection * vec4(chunk_origin + corner.xyz, 1.0);
+    axis = corner.w;
+  }
+);
+
+const char *raster_renderer::fsrc = _glsl(
+  varying float axis;
+  void main() {
+    float shade = axis < 0.5 ? 0.5 : (axis < 1.5 ? 1.0 : 0.75);
+    gl_FragColor = vec4(vec3(shade), 1.0);
+  }
+);
+
+raster_renderer::raster_renderer(const world *n_world, thread_pool *n_pool
+    , shaderprogram *n_program, int n_width, int n_height)
+  : _world(n_world), _pool(n_pool), _edge(0)
+    , _aspect((float)n_width / n_height), _time(0), _program(n_program)
+    , draw_distance(128) {
+  // chunks have to tile the world for their copies to line up
+  for (uint32_t edge = 32; edge >= brick_size && !_edge; edge /= 2)
+    if (_world->w % edge == 0 && _world->h % edge == 0
+        && _world->d % edge == 0)
+      _edge = edge;
+  assertf(_edge, "the raster backend needs a world of multiples of %u "
+      "voxels, not %ux%ux%u", brick_size, _world->w, _world->h, _world->d);
+  _chunks[0] = _world->w / _edge;
+  _chunks[1] = _world->h / _edge;
+  _chunks[2] = _world->d / _edge;
+  _corner_attr = _program->bind_attrib("corner");
+  _view_projection_unif = _program->bind_uniform("view_projection");
+  _chunk_origin_unif = _program->bind_uniform("chunk_origin");
+  stats.draws = stats.meshed = 0;
+  stats.vertices = 0;
+  stats.mesh_ms = 0;
+}
+
+// chunks whose voxels or neighbours of them come within the clear sphere
+// get their own mesh, the rest share the one of their copy in the world
+raster_renderer::chunk_key raster_renderer::key(int cx, int cy, int cz)
+  const {
+  const int c[3] = { cx, cy, cz };
+  float d2 = 0;
+  for (int i = 0; i < 3; i++) {
+    const float lo = c[i] * (int)_edge - 0.5f, hi = lo + _edge + 1.f
+      , d = lo > 0 ? lo : hi < 0 ? -hi : 0;
+    d2 += d * d;
+  }
+  if (d2 <= clear_radius * clear_radius)
+    return chunk_key { cx, cy, cz, true };
+  return chunk_key { wrap(cx, _chunks[0]), wrap(cy, _chunks[1])
+    , wrap(cz, _chunks[2]), false };
+}
+
+void raster_renderer::invalidate(const std::vector<box> &bricks) {
+  if (bricks.empty())
+    return;
+  // a voxel's faces go into the meshes of the chunks of its neighbours too
+  std::vector<uint8_t> dirty(_chunks[0] * _chunks[1] * _chunks[2]);
+  for (const box &b : bricks) {
+    const int edge = _edge
+      , lo[3] = { floor_div((int)(b.x0 * brick_size) - 1, edge)
+        , floor_div((int)(b.y0 * brick_size) - 1, edge)
+        , floor_div((int)(b.z0 * brick_size) - 1, edge) }
+      , hi[3] = { floor_div(b.x1 * brick_size, edge)
+        , floor_div(b.y1 * brick_size, edge)
+        , floor_div(b.z1 * brick_size, edge) };
+    for (int z = lo[2]; z <= hi[2]; z++)
+      for (int y = lo[1]; y <= hi[1]; y++)
+        for (int x = lo[0]; x <= hi[0]; x++)
+          dirty[(wrap(z, _chunks[2]) * _chunks[1] + wrap(y, _chunks[1]))
+            * _chunks[0] + wrap(x, _chunks[0])] = 1;
+  }
+  for (auto &m : _meshes) {
+    const chunk_key &k = m.first;
+    if (dirty[(wrap(k.z, _chunks[2]) * _chunks[1] + wrap(k.y, _chunks[1]))
+        * _chunks[0] + wrap(k.x, _chunks[0])])
+      m.second.dirty = true;
+  }
+}
+
+// meshes on the pool, uploads here on the thread of the gl context
+void raster_renderer::remesh(const std::vector<chunk_key> &keys) {
+  std::vector<std::vector<quad_vertex>> meshes(keys.size());
+  _pool->parallel_for(keys.size(), [&](size_t i, int) {
+    const chunk_key &k = keys[i];
+    mesh_chunk(_world, _edge, k.x, k.y, k.z, k.own, meshes[i]);
+  });
+  for (size_t i = 0; i < keys.size(); i++) {
+    auto it = _meshes.find(keys[i]);
+    if (it == _meshes.end())
+      it = _meshes.insert(std::make_pair(keys[i]
+            , chunk_mesh { vertex_pool::range { 0, 0, 0 }, false })).first;
+    _vertices.release(it->second.range);
+    it->second.range = _vertices.allocate(meshes[i]);
+    it->second.dirty = false;
+  }
+}
+
+void raster_renderer::draw() {
+  // the camera of camera_ray(), from world to clip coordinates. the
+  // raymarcher's rays go through (x, y * height / width, 0.8) before the
+  // rotation, which the projection undoes
+  float origin[3], dir[3];
+  camera_ray(0.f, 0.f, 1.f, 1.f, _time, origin, dir);
+  const float near = 0.5f, far = draw_distance + 2.f * _edge
+    , s = sinf(_time), c = cosf(_time)
+    , depth_scale = (far + near) / (far - near)
+    , depth_offset = -2.f * far * near / (far - near);
+  // the rows of the view matrix, which rotates by -_time around the origin
+  const float view[3][4] = {
+    { c, 0.f, s, -c * origin[0] - s * origin[2] },
+    { 0.f, 1.f, 0.f, -origin[1] },
+    { -s, 0.f, c, s * origin[0] - c * origin[2] } };
+  // and of the projection times it, with the depth from near to far
+  float view_projection[4][4];
+  for (int i = 0; i < 4; i++) {
+    view_projection[0][i] = 0.8f * view[0][i];
+    view_projection[1][i] = 0.8f * _aspect * view[1][i];
+    view_projection[2][i] = depth_scale * view[2][i] + (i == 3) * depth_offset;
+    view_projection[3][i] = view[2][i];
+  }
+
+  // the chunks within the draw distance whose box is not outside one of the
+  // planes of the frustum
+  float planes[6][4];
+  for (int i = 0; i < 3; i++)
+    for (int j = 0; j < 4; j++) {
+      planes[i * 2][j] = view_projection[3][j] + view_projection[i][j];
+      planes[i * 2 + 1][j] = view_projection[3][j] - view_projection[i][j];
+    }
+  int lo[3], hi[3];
+  for (int i = 0; i < 3; i++) {
+    lo[i] = floorf((origin[i] - draw_distance) / _edge);
+    hi[i] = floorf((origin[i] + draw_distance) / _edge);
+  }
+  std::vector<chunk_draw> draws;
+  std::vector<chunk_key> visible, missing;
+  for (int z = lo[2]; z <= hi[2]; z++)
+    for (int y = lo[1]; y <= hi[1]; y++)
+      for (int x = lo[0]; x <= hi[0]; x++) {
+        const float b0[3] = { (float)x * _edge, (float)y * _edge
+          , (float)z * _edge };
+        float d2 = 0;
+        for (int i = 0; i < 3; i++) {
+          const float d = std::max(std::max(b0[i] - origin[i], 0.f)
+              , origin[i] - b0[i] - _edge);
+          d2 += d * d;
+        }
+        if (d2 > draw_distance * draw_distance)
+          continue;
+        bool outside = false;
+        for (int p = 0; p < 6 && !outside; p++) {
+          const float *n = planes[p];
+          outside = n[0] * (b0[0] + (n[0] > 0) * _edge)
+            + n[1] * (b0[1] + (n[1] > 0) * _edge)
+            + n[2] * (b0[2] + (n[2] > 0) * _edge) + n[3] < 0;
+        }
+        if (outside)
+          continue;
+        const chunk_key k = key(x, y, z);
+        auto it = _meshes.find(k);
+        if (it == _meshes.end() || it->second.dirty)
+          missing.push_back(k);
+        visible.push_back(k);
+        draws.push_back(chunk_draw { nullptr, x, y, z });
+      }
+
+  auto begin = std::chrono::steady_clock::now();
+  std::sort(missing.begin(), missing.end());
+  missing.erase(std::unique(missing.begin(), missing.end()
+        , [](const chunk_key &a, const chunk_key &b) {
+          return !(a < b) && !(b < a);
+        }), missing.end());
+  remesh(missing);
+  stats.meshed = missing.size();
+  stats.mesh_ms = std::chrono::duration<double, std::milli>(
+      std::chrono::steady_clock::now() - begin).count();
+
+  // grouped by buffer, so that each is bound once
+  size_t kept = 0;
+  for (size_t i = 0; i < draws.size(); i++) {
+    draws[i].mesh = &_meshes.find(visible[i])->second;
+    if (draws[i].mesh->range.count)
+      draws[kept++] = draws[i];
+  }
+  draws.resize(kept);
+  std::sort(draws.begin(), draws.end()
+      , [](const chunk_draw &a, const chunk_draw &b) {
+        return a.mesh->range.buffer < b.mesh->range.buffer;
+      });
+
+  glEnable(GL_DEPTH_TEST);
+  glEnable(GL_CULL_FACE);
+  _program->use_this_prog();
+  glUniformMatrix4fv(_view_projection_unif, 1, GL_TRUE
+      , &view_projection[0][0]);
+  glEnableVertexAttribArray(_corner_attr);
+  uint32_t bound = ~0u;
+  stats.vertices = 0;
+  for (const chunk_draw &d : draws) {
+    const vertex_pool::range &r = d.mesh->range;
+    if (r.buffer != bound) {
+      bound = r.buffer;
+      _vertices.buffer(bound).bind();
+      glVertexAttribPointer(_corner_attr, 4, GL_UNSIGNED_BYTE, GL_FALSE
+          , sizeof(quad_vertex), 0);
+    }
+    glUniform3f(_chunk_origin_unif, (float)d.x * _edge, (float)d.y * _edge
+        , (float)d.z * _edge);
+    glDrawArrays(GL_TRIANGLES, r.first, r.count);
+    stats.vertices += r.count;
+  }
+  glDisableVertexAttribArray(_corner_attr);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+  _program->dont_use_this_prog();
+  glDisable(GL_CULL_FACE);
+  glDisable(GL_DEPTH_TEST);
+  stats.draws = draws.size();
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include "world.hh"
+#include "thread_pool.hh"
+#include "ogl.hh"
+#include <map>
+#include <vector>
+#include <cstdint>
+
+// a corner of a quad, relative to the chunk. axis is the one the quad faces
+// along, which the raymarcher shades by
+struct quad_vertex {
+  uint8_t x, y, z, axis;
+};
+
+// the faces between solid and empty voxels of the chunk of edge voxels at
+// chunk coordinates cx, cy, cz, merged greedily into quads within every
+// slice and appended as two triangles each. the world repeats like in the
+// renderers, and with clear the voxels in the sphere around the origin that
+// they keep clear are empty as well
+void mesh_chunk(const world *w, uint32_t edge, int cx, int cy, int cz
+    , bool clear, std::vector<quad_vertex> &vertices);
+
+// the meshes of all chunks in a few large vertex buffers, each in a run of
+// vertices of its own. released runs are reused first fit and merged with
+// their neighbours, a mesh that fits in none of the buffers starts a new one
+class vertex_pool {
+  struct pool_buffer {
+    array_buffer *vertices;
+    std::map<uint32_t, uint32_t> free; // first vertex and count of the runs
+  };
+  std::vector<pool_buffer> _buffers;
+  uint32_t _capacity; // in vertices, of a buffer
+public:
+  struct range {
+    uint32_t buffer, first, count;
+  };
+  vertex_pool(uint32_t n_capacity = 1 << 20);
+  ~vertex_pool();
+  range allocate(const std::vector<quad_vertex> &vertices);
+  void release(const range &r);
+  const array_buffer &buffer(uint32_t i) const { return *_buffers[i].vertices; }
+  uint64_t bytes() const;
+};
+
+// the backend next to the raymarcher: chunks around the camera are meshed
+// on the pool, kept in a vertex_pool and rasterized, the ones outside the
+// view frustum or the draw distance skipped. like in the raymarcher the
+// world repeats, every chunk that is drawn more than once shares the mesh of
+// its copy in the world. only the chunks near the clear sphere around the
+// origin have meshes of their own, with the sphere carved out.
+//
+// edits are remeshed a chunk at a time, from the bricks world::flush() sent.
+// without the streamer's moving view_offset the clear sphere stays put, so
+// the streamer is not supported
+class raster_renderer {
+  struct chunk_key {
+    int x, y, z;
+    bool own; // lattice coordinates near the clear sphere, or a world chunk
+    bool operator<(const chunk_key &o) const;
+  };
+  struct chunk_mesh {
+    vertex_pool::range range;
+    bool dirty;
+  };
+  struct chunk_draw {
+    const chunk_mesh *mesh;
+    int x, y, z; // lattice coordinates
+  };
+  const world *_world;
+  thread_pool *_pool;
+  uint32_t _edge; // of a chunk, in voxels
+  int _chunks[3]; // of the world along every axis
+  float _aspect, _time;
+  std::map<chunk_key, chunk_mesh> _meshes;
+  vertex_pool _vertices;
+  shaderprogram *_program;
+  GLint _corner_attr, _view_projection_unif, _chunk_origin_unif;
+  chunk_key key(int cx, int cy, int cz) const;
+  void remesh(const std::vector<chunk_key> &keys);
+public:
+  float draw_distance; // in voxels, from the camera
+  struct {
+    uint32_t draws, meshed;
+    uint64_t vertices;
+    double mesh_ms;
+  } stats; // of the last draw(), meshing what it needed first
+  // takes a program of vsrc and fsrc from programs
+  raster_renderer(const world *n_world, thread_pool *n_pool
+      , shaderprogram *n_program, int n_width, int n_height);
+  static const char *vsrc, *fsrc;
+  // marks the chunks around the bricks of the boxes for meshing again
+  void invalidate(const std::vector<box> &bricks);
+  void set_time(float time) { _time = time; }
+  // into the bound framebuffer, which needs a depth buffer
+  void draw();
+  uint64_t memory_usage() const { return _vertices.bytes(); }
+};
@@ -1,20 +1,107 @@
 #include "screen.hh"
 #include "utils.hh"
+#include "profiler.hh"
+#include <EGL/eglext.h>
+#include <cstring>
+#include <thread>
+
+static bool has_extension(const char *list, const char *name) {
+  const size_t n = strlen(name);
+  for (const char *p = list; p && (p = strstr(p, name)); p += n)
+    if ((p == list || p[-1] == ' ') && (p[n] == ' ' || p[n] == 0))
+      return true;
+  return false;
+}
+
+void screen::create_headless_context() {
+  // mesa's surfaceless platform needs neither x nor a gpu device node, other
+  // drivers get their default display
+  const char *client = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+  _egl_display = EGL_NO_DISPLAY;
+#ifdef EGL_PLATFORM_SURFACELESS_MESA
+  PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display =
+    (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress(
+        "eglGetPlatformDisplayEXT");
+  if (get_platform_display
+      && has_extension(client, "EGL_MESA_platform_surfaceless"))
+    _egl_display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA
+        , EGL_DEFAULT_DISPLAY, nullptr);
+#endif
+  if (_egl_display == EGL_NO_DISPLAY)
+    _egl_display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+  assertf(_egl_display != EGL_NO_DISPLAY
+      && eglInitialize(_egl_display, nullptr, nullptr)
+      , "failed to open an egl display: 0x%x", eglGetError());
+  assertf(eglBindAPI(EGL_OPENGL_API), "egl does not support OpenGL");
+
+  const bool surfaceless = has_extension(eglQueryString(_egl_display
+        , EGL_EXTENSIONS), "EGL_KHR_surfaceless_context");
+  const EGLint config_attribs[] = {
+    EGL_SURFACE_TYPE, surfaceless ? 0 : EGL_PBUFFER_BIT
+    , EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT
+    , EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8
+    , EGL_DEPTH_SIZE, 24
+    , EGL_NONE
+  };
+  EGLConfig config;
+  EGLint configs = 0;
+  assertf(eglChooseConfig(_egl_display, config_attribs, &config, 1, &configs)
+      && configs > 0, "no egl config for OpenGL");
+
+  _egl_surface = EGL_NO_SURFACE;
+  if (!surfaceless) {
+    const EGLint pbuffer_attribs[] = { EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE };
+    _egl_surface = eglCreatePbufferSurface(_egl_display, config
+        , pbuffer_attribs);
+    assertf(_egl_surface != EGL_NO_SURFACE
+        , "failed to create an egl pbuffer: 0x%x", eglGetError());
+  }
+  const EGLint context_attribs[] = {
+    EGL_CONTEXT_MAJOR_VERSION, 3, EGL_CONTEXT_MINOR_VERSION, 0, EGL_NONE
+  };
+  _egl_context = eglCreateContext(_egl_display, config, EGL_NO_CONTEXT
+      , context_attribs);
+  assertf(_egl_context != EGL_NO_CONTEXT
+      , "failed to create an egl context: 0x%x", eglGetError());
+  assertf(eglMakeCurrent(_egl_display, _egl_surface, _egl_surface
+        , _egl_context), "failed to make the egl context current: 0x%x"
+      , eglGetError());
+}
 
-screen::screen(int n_window_width, int n_window_height)
-  : window_width(n_window_width), window_height(n_window_height) {
+screen::screen(int n_window_width, int n_window_height, bool headless)
+  : _window(nullptr), _gl_context(nullptr), _egl_display(EGL_NO_DISPLAY)
+    , _egl_surface(EGL_NO_SURFACE), _egl_context(EGL_NO_CONTEXT), _ticks(0)
+    , _dropped_ticks(0), window_width(n_window_width)
+    , window_height(n_window_height), step_ms(16), max_steps(5)
+    , threaded_simulation(false) {
+  if (headless) {
+    create_headless_context();
+    init_glew();
+    return;
+  }
   SDL_Init(SDL_INIT_EVERYTHING);
 
   SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_CORE);
   SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 3);
   SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 0);
+  // for the raster backend, the raymarcher does not test depth
+  SDL_GL_SetAttribute(SDL_GL_DEPTH_SIZE, 24);
 
   _window = SDL_CreateWindow("vfk", SDL_WINDOWPOS_CENTERED,
       SDL_WINDOWPOS_CENTERED, window_width, window_height, SDL_WINDOW_OPENGL);
 
   _gl_context = SDL_GL_CreateContext(_window);
+  init_glew();
+}
 
+void screen::init_glew() {
   GLenum err = glewInit();
+#ifdef GLEW_ERROR_NO_GLX_DISPLAY
+  // a glx build of glew loads the functions of an egl context all the same,
+  // but has no glx display to take the glx extensions from
+  if (_egl_context != EGL_NO_CONTEXT && err == GLEW_ERROR_NO_GLX_DISPLAY)
+    err = GLEW_OK;
+#endif
   assertf(err == GLEW_OK, "failed to initialze glew: %s",
       glewGetErrorString(err));
 
@@ -24,32 +111,92 @@ screen::screen(int n_window_width, int n_window_height)
 }
 
 screen::~screen() {
+  if (_egl_context != EGL_NO_CONTEXT) {
+    eglMakeCurrent(_egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE
+        , EGL_NO_CONTEXT);
+    eglDestroyContext(_egl_display, _egl_context);
+    if (_egl_surface != EGL_NO_SURFACE)
+      eglDestroySurface(_egl_display, _egl_surface);
+    eglTerminate(_egl_display);
+    return;
+  }
   SDL_GL_DeleteContext(_gl_context);
   SDL_Quit();
 }
 
+double screen::now() const {
+  return std::chrono::duration<double, std::milli>(
+      std::chrono::steady_clock::now() - _start).count()
+    - _dropped_ticks * step_ms;
+}
+
+// runs the ticks that are due
+void screen::catch_up(void (*update_cb)(double, uint32_t, screen*)) {
+  profile_zone("update");
+  const double time = now();
+  int steps = 0;
+  for (; (_ticks + 1) * step_ms <= time && steps < max_steps; steps++) {
+    update_cb(step_ms / 1000., (_ticks + 1) * step_ms, this);
+    _ticks++;
+  }
+  if ((_ticks + 1) * step_ms <= time)
+    _dropped_ticks += (uint64_t)(time / step_ms) - _ticks;
+}
+
 void screen::mainloop(void (*load_cb)(screen*)
+    , void (*event_cb)(const SDL_Event&, screen*)
     , void (*update_cb)(double, uint32_t, screen*)
-    , void (*draw_cb)(void)
+    , void (*draw_cb)(double)
     , void (*cleanup_cb)(void)) {
+  profile_thread("main");
   load_cb(this);
 
-  uint32_t simtime = 0;
+  // the clock starts after loading, which would be caught up with a burst
+  // of ticks otherwise
+  _start = std::chrono::steady_clock::now();
+  _ticks = _dropped_ticks = 0;
+  update_cb(step_ms / 1000., 0, this);
+  std::thread simulation;
+  if (threaded_simulation)
+    simulation = std::thread([this, update_cb] {
+      profile_thread("simulation");
+      while (running) {
+        const double wait = (_ticks + 1) * step_ms - now();
+        if (wait > 0)
+          std::this_thread::sleep_for(std::chrono::duration<double
+              , std::milli>(wait));
+        else
+          catch_up(update_cb);
+      }
+    });
+
   uint64_t totalframes = 0;
   int updatecount = 0;
 
   while (running) {
+    profile_zone("frame");
     uint32_t real_time = SDL_GetTicks();
 
-    while (simtime < real_time) {
-      simtime += 16;
+    SDL_Event event;
+    while (SDL_PollEvent(&event) != 0)
+      if (event.type == SDL_QUIT)
+        running = false;
+      else
+        event_cb(event, this);
 
-      update_cb(16. / 1000., simtime, this);
-    }
+    if (!threaded_simulation)
+      catch_up(update_cb);
 
-    draw_cb();
+    {
+      profile_zone("draw");
+      draw_cb(now());
+    }
 
-    SDL_GL_SwapWindow(_window);
+    {
+      profile_zone("swap");
+      SDL_GL_SwapWindow(_window);
+    }
+    profile_gpu_collect();
 
     totalframes++;
     updatecount++;
@@ -65,5 +212,7 @@ void screen::mainloop(void (*load_cb)(screen*)
     }
   }
 
+  if (simulation.joinable())
+    simulation.join();
   cleanup_cb();
 }
@@ -3,18 +3,47 @@
 #define GLEW_STATIC
 #include <GL/glew.h>
 #include <SDL2/SDL.h>
+#include <EGL/egl.h>
+#include <atomic>
+#include <chrono>
 
+// mainloop() ticks the simulation every step_ms of real time and draws as
+// often as it can. a frame runs at most max_steps ticks to catch up, the
+// rest of a longer stall is dropped and the simulation falls behind real
+// time instead of spiralling into ever longer frames. with
+// threaded_simulation the ticks run on a thread of their own, so that a
+// long tick never holds up drawing. a headless screen has no window and no
+// mainloop, only an egl context without a surface, or with a 1x1 pbuffer
+// where the driver cannot do without one, so it works with no display
+// server. it is for rendering into framebuffers
 class screen {
   SDL_Window *_window;
   SDL_GLContext _gl_context;
+  EGLDisplay _egl_display;
+  EGLSurface _egl_surface;
+  EGLContext _egl_context;
+  void create_headless_context();
+  void init_glew();
+  std::chrono::steady_clock::time_point _start;
+  std::atomic<uint64_t> _ticks, _dropped_ticks;
+  void catch_up(void (*update_cb)(double, uint32_t, screen*));
 public:
   int window_width, window_height;
-  bool running;
-  screen(int n_window_width, int n_window_height);
+  std::atomic<bool> running;
+  double step_ms;
+  int max_steps;
+  bool threaded_simulation;
+  screen(int n_window_width, int n_window_height, bool headless = false);
   ~screen();
+  // ms on the simulation's clock, which starts at the first frame
+  double now() const;
+  // update_cb gets the step in seconds and the time of its tick in ms, the
+  // first tick is at 0 before the first frame. draw_cb gets now(), which is
+  // up to a step past the latest tick, and interpolates between it and the
+  // tick before. events are handled on the main thread
   void mainloop(void (*load_cb)(screen*)
+      , void (*event_cb)(const SDL_Event&, screen*)
       , void (*update_cb)(double, uint32_t, screen*)
-      , void (*draw_cb)(void)
+      , void (*draw_cb)(double)
       , void (*cleanup_cb)(void));
 };
-
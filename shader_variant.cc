@@ -0,0 +1,104 @@
+#include "shader_variant.hh"
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+
+static std::string tuning_path(const std::string &dir) {
+  return dir + "/variants";
+}
+
+std::string shader_variant::name() const {
+  return std::string(hierarchical ? "hierarchical" : "flat")
+    + (branchless ? "-branchless-" : "-branchy-") + std::to_string(max_steps);
+}
+
+bool shader_variant::parse(const std::string &s) {
+  char hit[16], step[16];
+  int steps;
+  if (sscanf(s.c_str(), "%15[a-z]-%15[a-z]-%d", hit, step, &steps) != 3
+      || (strcmp(hit, "hierarchical") && strcmp(hit, "flat"))
+      || (strcmp(step, "branchless") && strcmp(step, "branchy"))
+      || steps < 1)
+    return false;
+  hierarchical = !strcmp(hit, "hierarchical");
+  branchless = !strcmp(step, "branchless");
+  max_steps = steps;
+  return true;
+}
+
+std::string shader_variant::defines() const {
+  return std::string("#define HIERARCHICAL ") + (hierarchical ? "1" : "0")
+    + "\n#define BRANCHLESS_DDA " + (branchless ? "1" : "0")
+    + "\n#define MAX_STEPS " + std::to_string(max_steps) + "\n";
+}
+
+std::vector<shader_variant> tuning_candidates(int max_steps) {
+  std::vector<shader_variant> candidates;
+  for (int i = 0; i < 4; i++)
+    candidates.push_back(shader_variant { i / 2 == 0, i % 2 == 1
+        , max_steps });
+  return candidates;
+}
+
+// the lines of the file, renderer first
+static std::vector<std::pair<std::string, std::string>> read_tuning(
+    const std::string &dir) {
+  std::vector<std::pair<std::string, std::string>> lines;
+  FILE *f = fopen(tuning_path(dir).c_str(), "r");
+  if (!f)
+    return lines;
+  char line[1024];
+  while (fgets(line, sizeof(line), f)) {
+    char *tab = strchr(line, '\t'), *end = strchr(line, '\n');
+    if (!tab)
+      continue;
+    if (end)
+      *end = 0;
+    *tab = 0;
+    lines.push_back(std::make_pair(line, tab + 1));
+  }
+  fclose(f);
+  return lines;
+}
+
+bool load_tuned_variant(const std::string &dir, const std::string &renderer
+    , shader_variant &v) {
+  if (dir.empty())
+    return false;
+  for (const auto &line : read_tuning(dir))
+    if (line.first == renderer)
+      return v.parse(line.second);
+  return false;
+}
+
+void save_tuned_variant(const std::string &dir, const std::string &renderer
+    , const shader_variant &v) {
+  if (dir.empty())
+    return;
+  std::vector<std::pair<std::string, std::string>> lines = read_tuning(dir);
+  bool replaced = false;
+  for (auto &line : lines)
+    if (line.first == renderer) {
+      line.second = v.name();
+      replaced = true;
+    }
+  if (!replaced)
+    lines.push_back(std::make_pair(renderer, v.name()));
+  const std::string path = tuning_path(dir)
+    , tmp = path + "." + std::to_string(getpid());
+  FILE *f = fopen(tmp.c_str(), "w");
+  if (!f) {
+    printf("warning: failed to write %s\n", path.c_str());
+    return;
+  }
+  bool written = true;
+  for (const auto &line : lines)
+    written = written && fprintf(f, "%s\t%s\n", line.first.c_str()
+        , line.second.c_str()) > 0;
+  if (fclose(f) == 0 && written)
+    rename(tmp.c_str(), path.c_str());
+  else {
+    unlink(tmp.c_str());
+    printf("warning: failed to write %s\n", path.c_str());
+  }
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+// the knobs of the raymarching shader that are compiled in, as defines after
+// its #version line, rather than read from uniforms. a knob that is off
+// costs nothing in the program then, but every combination is a program of
+// its own
+struct shader_variant {
+  // hits are tested with the index entry that the jumps across the
+  // occupancy pyramid fetch anyway, or with a fetch of their own on every
+  // step of the plain DDA
+  bool hierarchical;
+  bool branchless; // the DDA steps by a mask of the axis, not by branches
+  int max_steps; // of a ray, after which it counts as a miss
+  // like "hierarchical-branchy-128", which parse() reads back
+  std::string name() const;
+  bool parse(const std::string &s);
+  std::string defines() const;
+};
+
+const shader_variant default_variant = { true, false, 128 };
+
+// what --autotune times: both hit tests with both ways of stepping, at
+// max_steps. the step limit changes what the rays reach and is left to
+// --ray-steps
+std::vector<shader_variant> tuning_candidates(int max_steps);
+
+// the fastest variant --autotune found for each renderer, as lines of the
+// renderer string, which names the driver version as well, a tab and the
+// variant's name in a file in dir. false when there is none for renderer
+bool load_tuned_variant(const std::string &dir, const std::string &renderer
+    , shader_variant &v);
+// replaces the line of renderer, if any. the file is written next to its
+// path and renamed over it, like the binaries of program_cache
+void save_tuned_variant(const std::string &dir, const std::string &renderer
+    , const shader_variant &v);
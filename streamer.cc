@@ -0,0 +1,238 @@
+#include "streamer.hh"
+#include "profiler.hh"
+#include "utils.hh"
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <algorithm>
+#include <array>
+
+uint64_t chunk_streamer::chunk::bytes() const {
+  return sizeof(chunk) + voxels.capacity();
+}
+
+size_t chunk_streamer::chunk_key_hash::operator()(const chunk_key &k) const {
+  uint64_t h = (uint64_t)k.x * 0x9e3779b97f4a7c15ull
+    ^ (uint64_t)k.y * 0xc2b2ae3d27d4eb4full
+    ^ (uint64_t)k.z * 0x165667b19e3779f9ull;
+  return h ^ h >> 29;
+}
+
+static uint32_t wrap(int64_t x, uint32_t n) {
+  return (x % n + n) % n;
+}
+
+chunk_streamer::chunk_streamer(world *n_window, thread_pool *n_pool
+    , const generator *n_generate, uint64_t n_budget)
+  : _window(n_window), _pool(n_pool), _generate(n_generate)
+    , _budget(n_budget), _window_chunks(_window->w / chunk_size)
+    , _lru_first(nullptr), _lru_last(nullptr), _frame(0)
+    , _load_ms_total(0), stats() {
+  assertf(_window->w % chunk_size == 0 && _window->w == _window->h
+      && _window->w == _window->d && _window_chunks > 0, "stream window of "
+      "%ux%ux%u is not a cube of whole %u^3 chunks", _window->w, _window->h
+      , _window->d, chunk_size);
+  // every brick of the window can end up in the pool, reserving room for all
+  // of them keeps the atlas from being reallocated while streaming
+  _window->reserve_bricks(_window->bw * _window->bh * _window->bd);
+  _slots.assign(_window_chunks * _window_chunks * _window_chunks, nullptr);
+  // a cube of 2 * radius + 1 chunks has a slot of its own for every chunk
+  _radius = (_window_chunks - 1) / 2;
+  std::vector<std::array<int64_t, 3>> offsets;
+  for (int64_t z = -_radius; z <= _radius; z++)
+    for (int64_t y = -_radius; y <= _radius; y++)
+      for (int64_t x = -_radius; x <= _radius; x++)
+        offsets.push_back({{ x, y, z }});
+  std::stable_sort(offsets.begin(), offsets.end()
+      , [](const std::array<int64_t, 3> &a, const std::array<int64_t, 3> &b) {
+    return a[0] * a[0] + a[1] * a[1] + a[2] * a[2]
+      < b[0] * b[0] + b[1] * b[1] + b[2] * b[2];
+  });
+  for (const std::array<int64_t, 3> &o : offsets)
+    _offsets.insert(_offsets.end(), o.begin(), o.end());
+}
+
+chunk_streamer::~chunk_streamer() {
+  std::unique_lock<std::mutex> lock(_done_lock);
+  _done_cv.wait(lock, [this] { return _done.size() == _loading.size(); });
+  for (chunk *c : _done)
+    delete c;
+  for (auto &c : _chunks)
+    delete c.second;
+}
+
+// runs on a worker. bricks are collapsed here, so that the main thread only
+// copies them into the window
+void chunk_streamer::generate(chunk *c) {
+  profile_zone("generate chunk");
+  uint8_t voxels[brick_voxels];
+  int16_t used = 0;
+  for (uint32_t b = 0; b < chunk_brick_count; b++) {
+    const int64_t x0 = c->x * chunk_size + b % chunk_bricks * brick_size
+      , y0 = c->y * chunk_size + b / chunk_bricks % chunk_bricks * brick_size
+      , z0 = c->z * chunk_size + b / (chunk_bricks * chunk_bricks)
+      * brick_size;
+    _generate->brick(x0, y0, z0, voxels);
+    if (std::all_of(voxels, voxels + brick_voxels
+          , [&](uint8_t x) { return x == voxels[0]; })) {
+      c->slot[b] = -1;
+      c->value[b] = voxels[0];
+    } else {
+      c->slot[b] = used++;
+      c->voxels.insert(c->voxels.end(), voxels, voxels + brick_voxels);
+    }
+  }
+  c->voxels.shrink_to_fit();
+}
+
+chunk_streamer::chunk *&chunk_streamer::slot(int64_t x, int64_t y
+    , int64_t z) {
+  return _slots[((uint64_t)wrap(z, _window_chunks) * _window_chunks
+      + wrap(y, _window_chunks)) * _window_chunks + wrap(x, _window_chunks)];
+}
+
+void chunk_streamer::map(chunk *c) {
+  slot(c->x, c->y, c->z) = c;
+  const uint32_t bx0 = wrap(c->x, _window_chunks) * chunk_bricks
+    , by0 = wrap(c->y, _window_chunks) * chunk_bricks
+    , bz0 = wrap(c->z, _window_chunks) * chunk_bricks;
+  for (uint32_t b = 0; b < chunk_brick_count; b++) {
+    const uint32_t bx = bx0 + b % chunk_bricks
+      , by = by0 + b / chunk_bricks % chunk_bricks
+      , bz = bz0 + b / (chunk_bricks * chunk_bricks);
+    if (c->slot[b] < 0)
+      _window->fill(box { bx * brick_size, by * brick_size, bz * brick_size
+          , (bx + 1) * brick_size, (by + 1) * brick_size
+          , (bz + 1) * brick_size }, c->value[b]);
+    else
+      _window->set_brick(bx, by, bz
+          , &c->voxels[(uint64_t)c->slot[b] * brick_voxels]);
+  }
+}
+
+void chunk_streamer::unmap(int64_t x, int64_t y, int64_t z) {
+  slot(x, y, z) = nullptr;
+  const uint32_t x0 = wrap(x, _window_chunks) * chunk_size
+    , y0 = wrap(y, _window_chunks) * chunk_size
+    , z0 = wrap(z, _window_chunks) * chunk_size;
+  _window->fill(box { x0, y0, z0, x0 + chunk_size, y0 + chunk_size
+      , z0 + chunk_size }, 0);
+}
+
+void chunk_streamer::lru_unlink(chunk *c) {
+  (c->lru_prev ? c->lru_prev->lru_next : _lru_first) = c->lru_next;
+  (c->lru_next ? c->lru_next->lru_prev : _lru_last) = c->lru_prev;
+  c->lru_prev = c->lru_next = nullptr;
+}
+
+// marks a chunk used during this frame, which moves it to the end of the lru
+// list, or adds it there when it has just been loaded
+void chunk_streamer::touch(chunk *c) {
+  c->last_used = _frame;
+  if (c == _lru_last)
+    return;
+  if (c->lru_prev || c == _lru_first)
+    lru_unlink(c);
+  c->lru_prev = _lru_last;
+  (_lru_last ? _lru_last->lru_next : _lru_first) = c;
+  _lru_last = c;
+}
+
+// chunks used during this frame are never evicted, even when the view alone
+// needs more than the budget. they are all at the end of the list
+void chunk_streamer::evict() {
+  while (stats.resident_bytes > _budget && _lru_first
+      && _lru_first->last_used < _frame) {
+    chunk *lru = _lru_first;
+    lru_unlink(lru);
+    if (slot(lru->x, lru->y, lru->z) == lru)
+      unmap(lru->x, lru->y, lru->z);
+    stats.resident_bytes -= lru->bytes();
+    stats.evictions++;
+    _chunks.erase(chunk_key { lru->x, lru->y, lru->z });
+    delete lru;
+  }
+}
+
+void chunk_streamer::update(float x, float y, float z) {
+  // loads and copies per frame are capped, so that a jump to an unloaded
+  // area is spread over a few frames instead of stalling one
+  profile_zone("stream update");
+  const uint32_t max_loading = _pool->size() * 4, max_maps = 8;
+  _frame++;
+  stats.frame_loads = stats.frame_maps = 0;
+
+  std::vector<chunk*> done;
+  {
+    std::lock_guard<std::mutex> lock(_done_lock);
+    done.swap(_done);
+  }
+  for (chunk *c : done) {
+    const chunk_key k { c->x, c->y, c->z };
+    _loading.erase(k);
+    _chunks[k] = c;
+    c->lru_prev = c->lru_next = nullptr;
+    touch(c);
+    stats.resident_bytes += c->bytes();
+    stats.loads++;
+    _load_ms_total += c->load_ms;
+    stats.load_ms_max = std::max(stats.load_ms_max, c->load_ms);
+  }
+
+  const int64_t cx = floorf(x / chunk_size), cy = floorf(y / chunk_size)
+    , cz = floorf(z / chunk_size);
+  for (size_t i = 0; i < _offsets.size(); i += 3) {
+    const int64_t ox = cx + _offsets[i], oy = cy + _offsets[i + 1]
+      , oz = cz + _offsets[i + 2];
+    const chunk_key k { ox, oy, oz };
+    chunk *mapped = slot(ox, oy, oz);
+    if (mapped && mapped->x == ox && mapped->y == oy && mapped->z == oz) {
+      touch(mapped);
+      continue;
+    }
+    // the slot still holds a chunk the view has moved away from
+    if (mapped)
+      unmap(ox, oy, oz);
+    auto it = _chunks.find(k);
+    if (it != _chunks.end()) {
+      touch(it->second);
+      if (stats.frame_maps < max_maps) {
+        map(it->second);
+        stats.frame_maps++;
+      }
+    } else if (!_loading.count(k) && _loading.size() < max_loading) {
+      chunk *c = new chunk;
+      c->x = ox;
+      c->y = oy;
+      c->z = oz;
+      _loading[k] = c;
+      stats.frame_loads++;
+      auto begin = std::chrono::steady_clock::now();
+      _pool->submit([this, c, begin](int) {
+        generate(c);
+        c->load_ms = std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - begin).count();
+        std::lock_guard<std::mutex> lock(_done_lock);
+        _done.push_back(c);
+        _done_cv.notify_all();
+      });
+    }
+  }
+
+  evict();
+  stats.resident = _chunks.size();
+  stats.loading = _loading.size();
+  stats.mapped = _slots.size() - std::count(_slots.begin(), _slots.end()
+      , nullptr);
+  stats.load_ms_mean = stats.loads ? _load_ms_total / stats.loads : 0;
+}
+
+void chunk_streamer::print_stats() const {
+  printf("stream: %u chunks resident (%.2f MB), %u mapped, %u loading, "
+      "%lu loads, %lu evictions, load %.2f ms mean %.2f ms max\n"
+      , stats.resident, stats.resident_bytes / (1024. * 1024.), stats.mapped
+      , stats.loading, (unsigned long)stats.loads
+      , (unsigned long)stats.evictions, stats.load_ms_mean
+      , stats.load_ms_max);
+}
+
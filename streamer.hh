@@ -0,0 +1,90 @@
+#pragma once
+
+#include "world.hh"
+#include "thread_pool.hh"
+#include "generator.hh"
+#include <unordered_map>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <cstdint>
+
+// the streamed world is unbounded and split into chunks of chunk_size^3
+// voxels. chunks near the view are generated on the thread pool, kept in a
+// cache that is evicted least recently used once it grows over a budget, and
+// copied into a window world. the window is addressed modulo its size, the
+// same way the shader wraps coordinates, so every chunk has a fixed slot in
+// it and the window never has to be shifted as the view moves. chunks are
+// keyed by their full 64 bit coordinates, what bounds the world in practice
+// is the float view position, which stops resolving single voxels at 2^24
+const uint32_t chunk_size = 32, chunk_bricks = chunk_size / brick_size
+  , chunk_brick_count = chunk_bricks * chunk_bricks * chunk_bricks;
+
+struct stream_stats {
+  uint32_t resident, mapped, loading;
+  uint64_t resident_bytes;
+  uint64_t loads, evictions; // since the start
+  uint32_t frame_loads, frame_maps; // during the last update()
+  double load_ms_mean, load_ms_max; // submit to finish, over all loads
+};
+
+class chunk_streamer {
+  // the full chunk coordinates, so that chunks far apart never share a key
+  struct chunk_key {
+    int64_t x, y, z;
+    bool operator==(const chunk_key &o) const {
+      return x == o.x && y == o.y && z == o.z;
+    }
+  };
+  struct chunk_key_hash {
+    size_t operator()(const chunk_key &k) const;
+  };
+  // bricks with slot -1 are uniform and hold their value in value, the
+  // others own brick_voxels bytes at slot * brick_voxels in voxels
+  struct chunk {
+    int64_t x, y, z;
+    int16_t slot[chunk_brick_count];
+    uint8_t value[chunk_brick_count];
+    std::vector<uint8_t> voxels;
+    uint64_t last_used;
+    // the resident chunks in order of last_used, least recent first
+    chunk *lru_prev, *lru_next;
+    double load_ms;
+    uint64_t bytes() const;
+  };
+  world *_window;
+  thread_pool *_pool;
+  const generator *_generate;
+  uint64_t _budget;
+  int _radius;
+  uint32_t _window_chunks; // window size in chunks along every axis
+  std::unordered_map<chunk_key, chunk*, chunk_key_hash> _chunks, _loading;
+  std::vector<chunk*> _slots; // the chunk each window slot holds, or null
+  chunk *_lru_first, *_lru_last;
+  std::vector<int64_t> _offsets; // chunk offsets in view, nearest first
+  uint64_t _frame;
+  std::mutex _done_lock;
+  std::condition_variable _done_cv;
+  std::vector<chunk*> _done;
+  double _load_ms_total;
+  void generate(chunk *c);
+  chunk *&slot(int64_t x, int64_t y, int64_t z);
+  void lru_unlink(chunk *c);
+  void touch(chunk *c);
+  void map(chunk *c);
+  void unmap(int64_t x, int64_t y, int64_t z);
+  void evict();
+public:
+  stream_stats stats;
+  // n_window must be empty and a whole number of chunks along every axis,
+  // the view radius in chunks is as large as the window allows. chunks are
+  // filled by n_generate on the workers
+  chunk_streamer(world *n_window, thread_pool *n_pool
+      , const generator *n_generate, uint64_t n_budget);
+  ~chunk_streamer();
+  // called once per frame with the view position. never waits on a worker,
+  // chunks that are still loading show up empty until a later frame
+  void update(float x, float y, float z);
+  void print_stats() const;
+};
+
@@ -0,0 +1,101 @@
+#include "thread_pool.hh"
+#include "profiler.hh"
+#include <algorithm>
+
+thread_pool::thread_pool(int n_threads) : _queued(0), _quit(false)
+    , _next_queue(0) {
+  if (n_threads <= 0)
+    n_threads = std::max(1u, std::thread::hardware_concurrency());
+  for (int i = 0; i < n_threads; i++)
+    _queues.emplace_back(new worker_queue);
+  for (int i = 0; i < n_threads; i++)
+    _threads.emplace_back(&thread_pool::work, this, i);
+}
+
+thread_pool::~thread_pool() {
+  {
+    std::lock_guard<std::mutex> lk(_wake_mutex);
+    _quit = true;
+  }
+  _wake.notify_all();
+  for (std::thread &t : _threads)
+    t.join();
+}
+
+int thread_pool::size() const {
+  return _threads.size();
+}
+
+void thread_pool::push(int queue, task t) {
+  {
+    std::lock_guard<std::mutex> lk(_queues[queue]->lock);
+    _queues[queue]->tasks.push_back(std::move(t));
+  }
+  {
+    std::lock_guard<std::mutex> lk(_wake_mutex);
+    _queued++;
+  }
+  _wake.notify_one();
+}
+
+bool thread_pool::pop(int worker, task &t) {
+  const int n = _queues.size();
+  for (int i = 0; i < n; i++) {
+    worker_queue &q = *_queues[(worker + i) % n];
+    std::lock_guard<std::mutex> lk(q.lock);
+    if (q.tasks.empty())
+      continue;
+    if (i == 0) {
+      t = std::move(q.tasks.back());
+      q.tasks.pop_back();
+    } else {
+      t = std::move(q.tasks.front());
+      q.tasks.pop_front();
+    }
+    std::lock_guard<std::mutex> wlk(_wake_mutex);
+    _queued--;
+    return true;
+  }
+  return false;
+}
+
+void thread_pool::work(int worker) {
+  profile_thread("worker");
+  task t;
+  while (true) {
+    if (pop(worker, t)) {
+      t(worker);
+      continue;
+    }
+    std::unique_lock<std::mutex> lk(_wake_mutex);
+    _wake.wait(lk, [this] { return _quit || _queued > 0; });
+    if (_quit && _queued == 0)
+      return;
+  }
+}
+
+void thread_pool::submit(std::function<void(int)> t) {
+  push(_next_queue++ % _queues.size(), std::move(t));
+}
+
+void thread_pool::parallel_for(size_t n
+    , const std::function<void(size_t, int)> &body) {
+  if (n == 0)
+    return;
+  size_t remaining = n;
+  std::mutex done_mutex;
+  std::condition_variable done;
+  // hand out contiguous runs so that neighbouring items start on the same
+  // worker, stealing evens out whatever imbalance is left
+  const size_t per_queue = (n + _queues.size() - 1) / _queues.size();
+  for (size_t i = 0; i < n; i++)
+    push(i / per_queue, [&, i](int worker) {
+      body(i, worker);
+      std::lock_guard<std::mutex> lk(done_mutex);
+      if (--remaining == 0)
+        done.notify_all();
+    });
+  std::unique_lock<std::mutex> lk(done_mutex);
+  done.wait(lk, [&] { return remaining == 0; });
+}
+
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <deque>
+#include <vector>
+#include <memory>
+
+// every worker owns a deque. it pops its own tasks from the back and steals
+// from the front of the other workers' deques once it runs dry
+class thread_pool {
+  typedef std::function<void(int)> task;
+  struct worker_queue {
+    std::mutex lock;
+    std::deque<task> tasks;
+  };
+  std::vector<std::thread> _threads;
+  std::vector<std::unique_ptr<worker_queue>> _queues;
+  std::mutex _wake_mutex;
+  std::condition_variable _wake;
+  size_t _queued;
+  bool _quit;
+  std::atomic<unsigned> _next_queue;
+  void push(int queue, task t);
+  bool pop(int worker, task &t);
+  void work(int worker);
+public:
+  thread_pool(int n_threads = 0); // 0 means one thread per core
+  ~thread_pool();
+  int size() const;
+  void submit(std::function<void(int)> t);
+  // runs body(i, worker) for every i in [0, n) and waits for all of them.
+  // must not be called from inside a task
+  void parallel_for(size_t n, const std::function<void(size_t, int)> &body);
+};
+
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+// hands the latest of a stream of values from one thread to another without
+// either of them waiting. the writer fills the back slot and trades it for
+// the middle one, the reader trades its front slot for the middle one when
+// that holds a value it has not seen. values the reader never got to are
+// skipped
+template <class T>
+class triple_buffer {
+  static const uint32_t fresh = 4; // on _middle, next to a slot index
+  T _slots[3];
+  uint32_t _back, _front;
+  std::atomic<uint32_t> _middle;
+public:
+  triple_buffer() : _slots(), _back(0), _front(1), _middle(2) {}
+  // only for the writer. holds whatever was written to it two values ago
+  T &back() {
+    return _slots[_back];
+  }
+  void publish() {
+    _back = _middle.exchange(_back | fresh) & ~fresh;
+  }
+  // only for the reader. the latest value published, or the same one as
+  // the last call when none was published since
+  const T &front() {
+    if (_middle.load() & fresh)
+      _front = _middle.exchange(_front) & ~fresh;
+    return _slots[_front];
+  }
+};
@@ -15,4 +15,6 @@
 #define die(...) do { printf(__VA_ARGS__); puts(""); exit(1); } while (0)
 
 #define _glsl(X) "#version 120\n" #X
+// a piece of shader source that is spliced into another one
+#define _glsl_part(X) #X
 
@@ -0,0 +1,170 @@
+#include "world.hh"
+#include "world_file.hh"
+#include "generator.hh"
+#include "thread_pool.hh"
+#include "utils.hh"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+// converts worlds between .vfk files, raw volumes of a byte per voxel, x
+// first, and the random worlds vfk generates, and compares how long a world
+// takes to load against generating it
+
+struct options {
+  float fill = 1.f;
+  int threads = 0;
+  uint32_t seed = 1;
+  voxel_format format = material_voxels;
+};
+
+static double ms_since(std::chrono::steady_clock::time_point begin) {
+  return std::chrono::duration<double, std::milli>(
+      std::chrono::steady_clock::now() - begin).count();
+}
+
+static void print_info(const char *path) {
+  world_file file(path);
+  uint64_t bytes = 0, max_bytes = 0;
+  for (uint32_t c = 0; c < file.chunk_count(); c++) {
+    bytes += file.chunk_bytes(c);
+    max_bytes = std::max(max_bytes, file.chunk_bytes(c));
+  }
+  printf("%s: %ux%ux%u voxels, %u chunks, %.2f MB of chunk data, %.3f bits "
+      "per voxel, largest chunk %lu bytes\n", path, file.w, file.h, file.d
+      , file.chunk_count(), bytes / (1024. * 1024.), bytes * 8.
+      / ((double)file.w * file.h * file.d), (unsigned long)max_bytes);
+}
+
+static void import_raw(const char *in, uint32_t w, uint32_t h, uint32_t d
+    , const char *out) {
+  FILE *f = fopen(in, "rb");
+  assertf(f, "failed to open %s", in);
+  world wd(w, h, d);
+  std::vector<uint8_t> row(w);
+  for (uint32_t z = 0; z < d; z++)
+    for (uint32_t y = 0; y < h; y++) {
+      assertf(fread(&row[0], w, 1, f) == 1, "%s is shorter than %ux%ux%u "
+          "voxels", in, w, h, d);
+      for (uint32_t x = 0; x < w; x++)
+        wd.set(x, y, z, row[x]);
+    }
+  fclose(f);
+  wd.compact();
+  save_world(&wd, out);
+}
+
+static void export_raw(const char *in, const char *out, const options &o) {
+  thread_pool pool(o.threads);
+  world *wd = load_world(in, &pool, o.format);
+  FILE *f = fopen(out, "wb");
+  assertf(f, "failed to open %s for writing", out);
+  std::vector<uint8_t> row(wd->w);
+  for (uint32_t z = 0; z < wd->d; z++)
+    for (uint32_t y = 0; y < wd->h; y++) {
+      for (uint32_t x = 0; x < wd->w; x++)
+        row[x] = wd->get(x, y, z);
+      assertf(fwrite(&row[0], wd->w, 1, f) == 1, "failed to write %s", out);
+    }
+  assertf(fclose(f) == 0, "failed to write %s", out);
+  delete wd;
+}
+
+// drops the file from the page cache, so that the next load reads it from
+// the disk the way it would right after boot
+static void evict_cache(const char *path) {
+  const int fd = open(path, O_RDONLY);
+  assertf(fd >= 0, "failed to open %s", path);
+  fdatasync(fd);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd);
+}
+
+static void bench_startup(uint32_t edge, const char *path, const options &o) {
+  thread_pool pool(o.threads);
+  auto begin = std::chrono::steady_clock::now();
+  world *generated = new world(edge, edge, edge, o.format);
+  generate(generated, random_generator(o.seed, o.fill), &pool);
+  const double generate_ms = ms_since(begin);
+  begin = std::chrono::steady_clock::now();
+  save_world(generated, path);
+  const double save_ms = ms_since(begin);
+
+  double load_ms[2];
+  for (int i = 0; i < 2; i++) {
+    if (i == 0)
+      evict_cache(path);
+    begin = std::chrono::steady_clock::now();
+    world *loaded = load_world(path, &pool, o.format);
+    load_ms[i] = ms_since(begin);
+    const box all { 0, 0, 0, edge, edge, edge };
+    assertf(loaded->count(all) == generated->count(all)
+        && loaded->resident_bricks() == generated->resident_bricks()
+        , "%s does not load back into the world it was saved from", path);
+    delete loaded;
+  }
+  delete generated;
+
+  world_file file(path);
+  uint64_t bytes = 0;
+  for (uint32_t c = 0; c < file.chunk_count(); c++)
+    bytes += file.chunk_bytes(c);
+  printf("%u^3: generate %.1f ms, save %.1f ms, %.2f MB on disk, load %.1f "
+      "ms cold and %.1f ms warm on %d threads, %.1fx faster than "
+      "generating\n", edge, generate_ms, save_ms, bytes / (1024. * 1024.)
+      , load_ms[0], load_ms[1], pool.size(), generate_ms / load_ms[0]);
+}
+
+static void usage() {
+  puts("usage: vfkconv [--fill F] [--seed N] [--threads N] [--bits] COMMAND\n"
+      "  --random N out.vfk        save a random N^3 world\n"
+      "  --raw WxHxD in.raw out.vfk\n"
+      "  in.vfk out.raw\n"
+      "  --info in.vfk\n"
+      "  --bench N [file.vfk]      time loading a random N^3 world against "
+      "generating it");
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  options o;
+  std::vector<std::string> args;
+  for (int i = 1; i < argc; i++) {
+    const std::string arg = argv[i];
+    if (arg == "--fill" && i + 1 < argc)
+      o.fill = atof(argv[++i]);
+    else if (arg == "--threads" && i + 1 < argc)
+      o.threads = atoi(argv[++i]);
+    else if (arg == "--bits")
+      o.format = occupancy_bits;
+    else if (arg == "--seed" && i + 1 < argc)
+      o.seed = strtoul(argv[++i], nullptr, 0);
+    else
+      args.push_back(arg);
+  }
+  if (args.size() == 3 && args[0] == "--random") {
+    const uint32_t edge = atoi(args[1].c_str());
+    world wd(edge, edge, edge, o.format);
+    thread_pool pool(o.threads);
+    generate(&wd, random_generator(o.seed, o.fill), &pool);
+    save_world(&wd, args[2].c_str());
+  } else if (args.size() == 4 && args[0] == "--raw") {
+    uint32_t w, h, d;
+    if (sscanf(args[1].c_str(), "%ux%ux%u", &w, &h, &d) != 3)
+      usage();
+    import_raw(args[2].c_str(), w, h, d, args[3].c_str());
+  } else if (args.size() == 2 && args[0] == "--info")
+    print_info(args[1].c_str());
+  else if ((args.size() == 2 || args.size() == 3) && args[0] == "--bench")
+    bench_startup(atoi(args[1].c_str()), args.size() == 3 ? args[2].c_str()
+        : "vfkconv_bench.vfk", o);
+  else if (args.size() == 2 && args[0][0] != '-')
+    export_raw(args[0].c_str(), args[1].c_str(), o);
+  else
+    usage();
+  return 0;
+}
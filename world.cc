@@ -1,58 +1,1209 @@
 #include "world.hh"
+#include "thread_pool.hh"
+#include "distance_field.hh"
+#include "occlusion.hh"
 #include <random>
+#include <cmath>
+#include <algorithm>
+#include <array>
+#include <map>
+#include <limits>
 
-uint64_t world::to_index(uint32_t x, uint32_t y, uint32_t z) const {
-  return z * h * w + y * w + x;
+uint64_t world::to_brick_index(uint32_t bx, uint32_t by, uint32_t bz) const {
+  return ((uint64_t)bz * bh + by) * bw + bx;
 }
 
-world::world(uint32_t n_w, uint32_t n_h, uint32_t n_d)
+static uint32_t to_voxel_index(uint32_t x, uint32_t y, uint32_t z) {
+  const uint32_t m = brick_size - 1;
+  return (((z & m) << brick_shift | (y & m)) << brick_shift) | (x & m);
+}
+
+// a packed brick is 2^3 blocks, each a word with bit (z * 4 + y) * 4 + x set
+// for a solid voxel x, y, z of the block
+static uint32_t to_block_index(uint32_t x, uint32_t y, uint32_t z) {
+  return (z >> block_shift & 1) << 2 | (y >> block_shift & 1) << 1
+    | (x >> block_shift & 1);
+}
+
+static uint32_t to_bit_index(uint32_t x, uint32_t y, uint32_t z) {
+  const uint32_t m = block_size - 1;
+  return (((z & m) << block_shift | (y & m)) << block_shift) | (x & m);
+}
+
+// words go through memcpy, the pool is a byte vector for both formats
+static uint64_t load_word(const uint8_t *p) {
+  uint64_t word;
+  memcpy(&word, p, sizeof(word));
+  return word;
+}
+
+static void store_word(uint8_t *p, uint64_t word) {
+  memcpy(p, &word, sizeof(word));
+}
+
+// the bits of a block inside [x0, x1) x [y0, y1) x [z0, z1), in block
+// coordinates from 0 to block_size
+static uint64_t block_mask(uint32_t x0, uint32_t y0, uint32_t z0, uint32_t x1
+    , uint32_t y1, uint32_t z1) {
+  const uint64_t row = (1u << x1) - (1u << x0);
+  uint64_t plane = 0, mask = 0;
+  for (uint32_t y = y0; y < y1; y++)
+    plane |= row << (y << block_shift);
+  for (uint32_t z = z0; z < z1; z++)
+    mask |= plane << (z << 2 * block_shift);
+  return mask;
+}
+
+// the masks of the 8 blocks of a packed brick for a box in brick coordinates
+static void brick_masks(uint32_t x0, uint32_t y0, uint32_t z0, uint32_t x1
+    , uint32_t y1, uint32_t z1, uint64_t masks[8]) {
+  for (uint32_t i = 0; i < 8; i++) {
+    const uint32_t ox = (i & 1) * block_size, oy = (i >> 1 & 1) * block_size
+      , oz = (i >> 2) * block_size;
+    const uint32_t bx0 = std::max(x0, ox), by0 = std::max(y0, oy)
+      , bz0 = std::max(z0, oz), bx1 = std::min(x1, ox + block_size)
+      , by1 = std::min(y1, oy + block_size)
+      , bz1 = std::min(z1, oz + block_size);
+    masks[i] = bx0 < bx1 && by0 < by1 && bz0 < bz1
+      ? block_mask(bx0 - ox, by0 - oy, bz0 - oz, bx1 - ox, by1 - oy
+          , bz1 - oz) : 0;
+  }
+}
+
+world::world(uint32_t n_w, uint32_t n_h, uint32_t n_d
+    , voxel_format n_format)
   : w(n_w), h(n_h), d(n_d)
-    , _data(std::vector<uint8_t>(w * h * d, 0))
-    , _texture(0) {
-  for (uint32_t z = 0; z < d; z++)
-    for (uint32_t y = 0; y < h; y++)
-      for (uint32_t x = 0; x < w; x++) {
-        _data[to_index(x, y, z)] = 255 * (rand() % 2);
-        // printf("wrote %d\n", _data[to_index(x, y, z)]);
-      }
+    , bw((w + brick_size - 1) / brick_size)
+    , bh((h + brick_size - 1) / brick_size)
+    , bd((d + brick_size - 1) / brick_size), format(n_format)
+    , flushed_bytes(0)
+    , _index(std::vector<uint32_t>((uint64_t)bw * bh * bd, uniform_flag))
+    , _brick_side(format == material_voxels ? brick_size
+        : brick_size / block_size)
+    , _brick_bytes(format == material_voxels ? brick_voxels
+        : brick_voxels / 8)
+    , _dirty(std::vector<uint8_t>(_index.size(), 0)), _occupancy_width(0)
+    , _occupancy_changed(false), _distance_pool(nullptr)
+    , _occlusion_pool(nullptr), _index_texture(0), _atlas_texture(0)
+    , _occupancy_texture(0), _distance_texture(0), _occlusion_texture(0)
+    , _atlas_x(0), _atlas_y(0)
+    , _atlas_z(0), _reserved_bricks(0), _program(nullptr), _unpack(nullptr) {
+  // a level only exists when the one below it has an even number of cells
+  // along every axis, so that the cells tile the wrapped world exactly
+  occupancy_levels = 1;
+  while (occupancy_levels < max_occupancy_levels
+      && (bw >> (occupancy_levels - 1)) % 2 == 0
+      && (bh >> (occupancy_levels - 1)) % 2 == 0
+      && (bd >> (occupancy_levels - 1)) % 2 == 0)
+    occupancy_levels++;
+  _occupancy_width = 2 * bw - (2 * bw >> occupancy_levels);
+  _occupancy.assign((uint64_t)_occupancy_width * bh * bd, 0);
 }
 
 world::~world() {
-  if (_texture > 0)
-    glDeleteTextures(1, &_texture);
+  delete _unpack;
+  if (_index_texture > 0)
+    glDeleteTextures(1, &_index_texture);
+  if (_atlas_texture > 0)
+    glDeleteTextures(1, &_atlas_texture);
+  if (_occupancy_texture > 0)
+    glDeleteTextures(1, &_occupancy_texture);
+  if (_distance_texture > 0)
+    glDeleteTextures(1, &_distance_texture);
+  if (_occlusion_texture > 0)
+    glDeleteTextures(1, &_occlusion_texture);
+}
+
+uint8_t *world::brick_data(uint32_t slot) {
+  return &_bricks[(uint64_t)slot * _brick_bytes];
+}
+
+const uint8_t *world::brick_data(uint32_t slot) const {
+  return &_bricks[(uint64_t)slot * _brick_bytes];
+}
+
+// fill is 0 or 255 for packed bricks, which sets every bit of them as well
+uint32_t world::alloc_brick(uint8_t fill) {
+  uint32_t slot;
+  if (!_free_bricks.empty()) {
+    slot = _free_bricks.back();
+    _free_bricks.pop_back();
+  } else {
+    slot = _bricks.size() / _brick_bytes;
+    _bricks.resize(_bricks.size() + _brick_bytes);
+  }
+  memset(brick_data(slot), fill, _brick_bytes);
+  return slot;
+}
+
+void world::free_brick(uint32_t slot) {
+  _free_bricks.push_back(slot);
+}
+
+void world::mark_dirty(uint64_t brick) {
+  if (!(_dirty[brick] & dirty_upload))
+    _dirty_bricks.push_back(brick);
+  if (!(_dirty[brick] & dirty_occupancy))
+    _occupancy_dirty.push_back(brick);
+  if (_distance_pool && !(_dirty[brick] & dirty_distance))
+    _distance_dirty.push_back(brick);
+  if (_occlusion_pool && !(_dirty[brick] & dirty_occlusion))
+    _occlusion_dirty.push_back(brick);
+  _dirty[brick] = dirty_upload | dirty_occupancy
+    | (_distance_pool ? dirty_distance : 0)
+    | (_occlusion_pool ? dirty_occlusion : 0);
 }
 
 uint8_t world::get(uint32_t x, uint32_t y, uint32_t z) const {
-  const uint64_t idx = to_index(x, y, z);
-  return (idx < w * h * d) ? _data[idx] : 0;
+  if (x >= w || y >= h || z >= d)
+    return 0;
+  const uint32_t entry = _index[to_brick_index(x >> brick_shift
+      , y >> brick_shift, z >> brick_shift)];
+  if (entry & uniform_flag)
+    return entry & 0xFF;
+  if (format == material_voxels)
+    return brick_data(entry)[to_voxel_index(x, y, z)];
+  return load_word(brick_data(entry) + to_block_index(x, y, z) * 8)
+    >> to_bit_index(x, y, z) & 1 ? 255 : 0;
 }
 
-void world::update_texture(shaderprogram *sp) {
-  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+void world::set(uint32_t x, uint32_t y, uint32_t z, uint8_t v) {
+  if (x >= w || y >= h || z >= d)
+    return;
+  if (format == occupancy_bits && v)
+    v = 255;
+  const uint64_t brick = to_brick_index(x >> brick_shift, y >> brick_shift
+      , z >> brick_shift);
+  uint32_t &entry = _index[brick];
+  if (entry & uniform_flag) {
+    if ((entry & 0xFF) == v)
+      return;
+    entry = alloc_brick(entry & 0xFF);
+  }
+  if (format == occupancy_bits) {
+    uint8_t *p = brick_data(entry) + to_block_index(x, y, z) * 8;
+    const uint64_t word = load_word(p), bit = 1ull << to_bit_index(x, y, z)
+      , next = v ? word | bit : word & ~bit;
+    if (next == word)
+      return;
+    store_word(p, next);
+    mark_dirty(brick);
+    return;
+  }
+  uint8_t &voxel = brick_data(entry)[to_voxel_index(x, y, z)];
+  if (voxel == v)
+    return;
+  voxel = v;
+  mark_dirty(brick);
+}
 
-  if (_texture > 0)
-    glDeleteTextures(1, &_texture);
-  glActiveTexture(GL_TEXTURE0);
-  glGenTextures(1, &_texture);
-  glBindTexture(GL_TEXTURE_3D, _texture);
+// bricks that the box covers completely are collapsed into their index entry
+// without touching the pool, only the bricks on its border are written
+// voxel by voxel
+void world::fill(const box &b, uint8_t v) {
+  const uint32_t x1 = std::min(b.x1, w), y1 = std::min(b.y1, h)
+    , z1 = std::min(b.z1, d);
+  if (b.x0 >= x1 || b.y0 >= y1 || b.z0 >= z1)
+    return;
+  if (format == occupancy_bits && v)
+    v = 255;
+  for (uint32_t bz = b.z0 >> brick_shift; bz <= (z1 - 1) >> brick_shift; bz++)
+    for (uint32_t by = b.y0 >> brick_shift; by <= (y1 - 1) >> brick_shift
+        ; by++)
+      for (uint32_t bx = b.x0 >> brick_shift; bx <= (x1 - 1) >> brick_shift
+          ; bx++) {
+        const uint64_t brick = to_brick_index(bx, by, bz);
+        uint32_t &entry = _index[brick];
+        // the part of the brick inside both the box and the world
+        const uint32_t cx0 = std::max(b.x0, bx * brick_size)
+          , cy0 = std::max(b.y0, by * brick_size)
+          , cz0 = std::max(b.z0, bz * brick_size)
+          , cx1 = std::min(x1, (bx + 1) * brick_size)
+          , cy1 = std::min(y1, (by + 1) * brick_size)
+          , cz1 = std::min(z1, (bz + 1) * brick_size);
+        if (cx0 == bx * brick_size && cy0 == by * brick_size
+            && cz0 == bz * brick_size && cx1 == std::min(w, (bx + 1)
+              * brick_size) && cy1 == std::min(h, (by + 1) * brick_size)
+            && cz1 == std::min(d, (bz + 1) * brick_size)) {
+          if (entry == (uniform_flag | v))
+            continue;
+          if (!(entry & uniform_flag))
+            free_brick(entry);
+          entry = uniform_flag | v;
+          mark_dirty(brick);
+          continue;
+        }
+        if (entry == (uniform_flag | v))
+          continue;
+        if (entry & uniform_flag)
+          entry = alloc_brick(entry & 0xFF);
+        uint8_t *voxels = brick_data(entry);
+        if (format == occupancy_bits) {
+          const uint32_t ox = bx * brick_size, oy = by * brick_size
+            , oz = bz * brick_size;
+          uint64_t masks[8];
+          brick_masks(cx0 - ox, cy0 - oy, cz0 - oz, cx1 - ox, cy1 - oy
+              , cz1 - oz, masks);
+          for (uint32_t i = 0; i < 8; i++) {
+            const uint64_t word = load_word(voxels + i * 8);
+            store_word(voxels + i * 8, v ? word | masks[i]
+                : word & ~masks[i]);
+          }
+        } else
+          for (uint32_t z = cz0; z < cz1; z++)
+            for (uint32_t y = cy0; y < cy1; y++)
+              memset(voxels + to_voxel_index(cx0, y, z), v, cx1 - cx0);
+        mark_dirty(brick);
+      }
+}
+
+void world::set_brick(uint32_t bx, uint32_t by, uint32_t bz
+    , const uint8_t *voxels) {
+  if (bx >= bw || by >= bh || bz >= bd)
+    return;
+  const uint64_t brick = to_brick_index(bx, by, bz);
+  uint32_t &entry = _index[brick];
+  if (entry & uniform_flag)
+    entry = alloc_brick(0);
+  if (format == material_voxels)
+    memcpy(brick_data(entry), voxels, brick_voxels);
+  else {
+    // a row of a block is 4 adjacent bits of its word
+    uint64_t words[8] = {};
+    for (uint32_t z = 0; z < brick_size; z++)
+      for (uint32_t y = 0; y < brick_size; y++)
+        for (uint32_t x = 0; x < brick_size; x += block_size) {
+          const uint8_t *v = voxels + to_voxel_index(x, y, z);
+          const uint64_t row = (v[0] != 0) | (v[1] != 0) << 1
+            | (v[2] != 0) << 2 | (v[3] != 0) << 3;
+          words[to_block_index(x, y, z)] |= row << to_bit_index(x, y, z);
+        }
+    memcpy(brick_data(entry), words, sizeof(words));
+  }
+  mark_dirty(brick);
+}
+
+void world::get_brick(uint32_t bx, uint32_t by, uint32_t bz
+    , uint8_t *voxels) const {
+  const uint32_t entry = bx < bw && by < bh && bz < bd
+    ? _index[to_brick_index(bx, by, bz)] : uniform_flag;
+  if (entry & uniform_flag)
+    memset(voxels, entry & 0xFF, brick_voxels);
+  else if (format == material_voxels)
+    memcpy(voxels, brick_data(entry), brick_voxels);
+  else {
+    uint64_t words[8];
+    memcpy(words, brick_data(entry), sizeof(words));
+    for (uint32_t z = 0; z < brick_size; z++)
+      for (uint32_t y = 0; y < brick_size; y++)
+        for (uint32_t x = 0; x < brick_size; x++)
+          voxels[to_voxel_index(x, y, z)] = words[to_block_index(x, y, z)]
+            >> to_bit_index(x, y, z) & 1 ? 255 : 0;
+  }
+}
+
+bool world::uniform_brick(uint32_t bx, uint32_t by, uint32_t bz
+    , uint8_t &value) const {
+  const uint32_t entry = _index[to_brick_index(bx, by, bz)];
+  value = entry & 0xFF;
+  return entry & uniform_flag;
+}
+
+static int floor_mod(int x, int n) {
+  return ((x % n) + n) % n;
+}
+
+// a run of voxels along one axis that lies in a single brick of the world,
+// offset voxels into the run it is part of and at voxel v of the world
+struct brick_run {
+  int offset, v, length;
+};
+
+static std::vector<brick_run> brick_runs(int origin, int length, int size) {
+  std::vector<brick_run> runs;
+  for (int i = 0; i < length; ) {
+    const int v = floor_mod(origin + i, size)
+      , n = std::min(std::min(length - i, (int)(brick_size - v % brick_size))
+          , size - v);
+    runs.push_back(brick_run { i, v, n });
+    i += n;
+  }
+  return runs;
+}
+
+void world::copy_solid(const int origin[3], const int n[3], size_t row
+    , size_t plane, uint8_t solid, uint8_t empty, uint8_t *out
+    , thread_pool *pool) const {
+  const std::vector<brick_run> xs = brick_runs(origin[0], n[0], w)
+    , ys = brick_runs(origin[1], n[1], h), zs = brick_runs(origin[2], n[2], d);
+  pool->parallel_for(zs.size(), [&](size_t i, int) {
+    const brick_run &z = zs[i];
+    uint8_t voxels[brick_voxels];
+    for (const brick_run &y : ys)
+      for (const brick_run &x : xs) {
+        const uint32_t bx = x.v >> brick_shift, by = y.v >> brick_shift
+          , bz = z.v >> brick_shift;
+        uint8_t value;
+        const bool uniform = uniform_brick(bx, by, bz, value);
+        if (!uniform)
+          get_brick(bx, by, bz, voxels);
+        const uint32_t m = brick_size - 1;
+        for (int k = 0; k < z.length; k++)
+          for (int j = 0; j < y.length; j++) {
+            uint8_t *o = out + (z.offset + k) * plane + (y.offset + j) * row
+              + x.offset;
+            if (uniform) {
+              memset(o, value > 127 ? solid : empty, x.length);
+              continue;
+            }
+            const uint8_t *in = voxels + ((((z.v + k) & m) << brick_shift
+                  | ((y.v + j) & m)) << brick_shift) + (x.v & m);
+            for (int l = 0; l < x.length; l++)
+              o[l] = in[l] > 127 ? solid : empty;
+          }
+      }
+  });
+}
+
+// collapse every pooled brick whose voxels all share one value back into its
+// index entry. called after bulk writes instead of checking on every set()
+void world::compact() {
+  for (uint64_t brick = 0; brick < _index.size(); brick++) {
+    uint32_t &entry = _index[brick];
+    if (entry & uniform_flag)
+      continue;
+    // a packed brick is uniform when its bytes are all 0 or all 255 as well,
+    // which compares it a word at a time
+    const uint8_t *voxels = brick_data(entry);
+    uint32_t i = 1;
+    while (i < _brick_bytes && voxels[i] == voxels[0])
+      i++;
+    if (i != _brick_bytes
+        || (format == occupancy_bits && voxels[0] && voxels[0] != 255))
+      continue;
+    free_brick(entry);
+    entry = uniform_flag | voxels[0];
+    mark_dirty(brick);
+  }
+}
+
+uint64_t world::count(const box &b) const {
+  const uint32_t x1 = std::min(b.x1, w), y1 = std::min(b.y1, h)
+    , z1 = std::min(b.z1, d);
+  if (b.x0 >= x1 || b.y0 >= y1 || b.z0 >= z1)
+    return 0;
+  uint64_t n = 0;
+  for (uint32_t bz = b.z0 >> brick_shift; bz <= (z1 - 1) >> brick_shift; bz++)
+    for (uint32_t by = b.y0 >> brick_shift; by <= (y1 - 1) >> brick_shift
+        ; by++)
+      for (uint32_t bx = b.x0 >> brick_shift; bx <= (x1 - 1) >> brick_shift
+          ; bx++) {
+        const uint32_t entry = _index[to_brick_index(bx, by, bz)];
+        const uint32_t ox = bx * brick_size, oy = by * brick_size
+          , oz = bz * brick_size;
+        const uint32_t cx0 = std::max(b.x0, ox), cy0 = std::max(b.y0, oy)
+          , cz0 = std::max(b.z0, oz), cx1 = std::min(x1, ox + brick_size)
+          , cy1 = std::min(y1, oy + brick_size)
+          , cz1 = std::min(z1, oz + brick_size);
+        if (entry & uniform_flag) {
+          if (entry & 0xFF)
+            n += (uint64_t)(cx1 - cx0) * (cy1 - cy0) * (cz1 - cz0);
+          continue;
+        }
+        const uint8_t *voxels = brick_data(entry);
+        if (format == occupancy_bits) {
+          uint64_t masks[8];
+          brick_masks(cx0 - ox, cy0 - oy, cz0 - oz, cx1 - ox, cy1 - oy
+              , cz1 - oz, masks);
+          for (uint32_t i = 0; i < 8; i++)
+            n += __builtin_popcountll(load_word(voxels + i * 8) & masks[i]);
+        } else
+          for (uint32_t z = cz0; z < cz1; z++)
+            for (uint32_t y = cy0; y < cy1; y++)
+              for (uint32_t x = cx0; x < cx1; x++)
+                n += voxels[to_voxel_index(x, y, z)] != 0;
+      }
+  return n;
+}
+
+// level l starts at x = 2 * bw - 2 * bw / 2^l, level 0 at x = 0
+uint64_t world::occupancy_index(int level, uint32_t x, uint32_t y, uint32_t z)
+  const {
+  return ((uint64_t)z * bh + y) * _occupancy_width + 2 * bw - (2 * bw >> level)
+    + x;
+}
+
+void world::update_occupancy() {
+  for (uint64_t brick : _occupancy_dirty) {
+    _dirty[brick] &= ~dirty_occupancy;
+    uint32_t x = brick % bw, y = brick / bw % bh
+      , z = brick / ((uint64_t)bw * bh);
+    // pooled bricks count as occupied even when edits have emptied them,
+    // until compact() collapses them. occupied cells hold 255, so that they
+    // read as 1 from the normalized texture
+    uint8_t o = _index[brick] != uniform_flag ? 255 : 0;
+    for (int level = 0; level < occupancy_levels; level++) {
+      if (level > 0) {
+        x >>= 1;
+        y >>= 1;
+        z >>= 1;
+        o = 0;
+        for (int i = 0; i < 8; i++)
+          o |= _occupancy[occupancy_index(level - 1, 2 * x + (i & 1)
+              , 2 * y + (i >> 1 & 1), 2 * z + (i >> 2))];
+      }
+      uint8_t &cell = _occupancy[occupancy_index(level, x, y, z)];
+      if (cell == o)
+        break;
+      cell = o;
+      _occupancy_changed = true;
+    }
+  }
+  _occupancy_dirty.clear();
+}
+
+bool world::empty_cell(int level, uint32_t x, uint32_t y, uint32_t z) const {
+  const int shift = brick_shift + level;
+  return !_occupancy[occupancy_index(level, x >> shift, y >> shift
+      , z >> shift)];
+}
+
+void ray_batch::resize(size_t n) {
+  for (std::vector<float> *v : { &ox, &oy, &oz, &dx, &dy, &dz })
+    v->resize(n);
+}
+
+// clips the ray to the world's box and finds the voxel where it comes in,
+// through the face of axis, -1 when it starts inside. false when it misses
+// the box
+static bool begin_ray(const float origin[3], const float dir[3]
+    , float max_dist, const int size[3], float dn[3], float inv[3], float &t
+    , float &end, int &axis, int map[3], int step[3]) {
+  const float length = sqrtf(dir[0] * dir[0] + dir[1] * dir[1]
+      + dir[2] * dir[2]);
+  if (!(length > 0.f))
+    return false;
+  t = 0.f;
+  end = max_dist;
+  axis = -1;
+  for (int i = 0; i < 3; i++) {
+    dn[i] = dir[i] / length;
+    inv[i] = 1.f / dn[i];
+    if (dn[i] == 0.f) {
+      if (origin[i] < 0.f || origin[i] >= size[i])
+        return false;
+      continue;
+    }
+    float enter = -origin[i] * inv[i], leave = (size[i] - origin[i]) * inv[i];
+    if (enter > leave)
+      std::swap(enter, leave);
+    if (enter > t) {
+      t = enter;
+      axis = i;
+    }
+    end = std::min(end, leave);
+  }
+  if (t > end)
+    return false;
+  for (int i = 0; i < 3; i++) {
+    map[i] = std::min(std::max((int)floorf(origin[i] + dn[i] * t), 0)
+        , size[i] - 1);
+    step[i] = dn[i] < 0.f ? -1 : 1;
+  }
+  return true;
+}
+
+static void set_hit(raycast_hit &r, const int map[3], int axis
+    , const int step[3], float t) {
+  r.x = map[0];
+  r.y = map[1];
+  r.z = map[2];
+  if (axis >= 0)
+    r.normal[axis] = -step[axis];
+  r.distance = t;
+  r.hit = true;
+}
+
+raycast_hit world::raycast(const float origin[3], const float dir[3]
+    , float max_dist) const {
+  raycast_hit r = {};
+  const float inf = std::numeric_limits<float>::infinity();
+  const int size[3] = { (int)w, (int)h, (int)d };
+  float dn[3], inv[3], t, end, side[3];
+  int axis, map[3], step[3];
+  if (!begin_ray(origin, dir, max_dist, size, dn, inv, t, end, axis, map
+        , step))
+    return r;
+  // where the ray leaves the voxel it is in along axis i
+  auto boundary = [&](int i, int face) {
+    return dn[i] == 0.f ? inf : (face - origin[i]) * inv[i];
+  };
+  for (int i = 0; i < 3; i++)
+    side[i] = boundary(i, step[i] > 0 ? map[i] + 1 : map[i]);
+  int level = -1; // of the last jump across empty space
+  for (;;) {
+    if (empty_cell(0, map[0], map[1], map[2])) {
+      const int up = std::min(level + 1, occupancy_levels - 1);
+      level = up > 0 && empty_cell(up, map[0], map[1], map[2]) ? up : 0;
+      const int cell = brick_size << level;
+      int lo[3];
+      float exit[3];
+      for (int i = 0; i < 3; i++) {
+        lo[i] = map[i] & ~(cell - 1);
+        exit[i] = boundary(i, step[i] > 0 ? lo[i] + cell : lo[i]);
+      }
+      axis = exit[0] < exit[1] ? (exit[0] < exit[2] ? 0 : 2)
+        : (exit[1] < exit[2] ? 1 : 2);
+      t = exit[axis];
+      if (t > end)
+        return r;
+      for (int i = 0; i < 3; i++)
+        map[i] = i == axis ? (step[i] > 0 ? lo[i] + cell : lo[i] - 1)
+          : std::min(std::max((int)floorf(origin[i] + dn[i] * t), lo[i])
+              , lo[i] + cell - 1);
+      if (map[axis] < 0 || map[axis] >= size[axis])
+        return r;
+      for (int i = 0; i < 3; i++)
+        side[i] = boundary(i, step[i] > 0 ? map[i] + 1 : map[i]);
+      continue;
+    }
+    if (get(map[0], map[1], map[2]) > 127) {
+      set_hit(r, map, axis, step, t);
+      return r;
+    }
+    level = -1;
+    axis = side[0] < side[1] ? (side[0] < side[2] ? 0 : 2)
+      : (side[1] < side[2] ? 1 : 2);
+    t = side[axis];
+    if (t > end)
+      return r;
+    map[axis] += step[axis];
+    if (map[axis] < 0 || map[axis] >= size[axis])
+      return r;
+    side[axis] = boundary(axis, step[axis] > 0 ? map[axis] + 1 : map[axis]);
+  }
+}
+
+// the rays of raycast_batch() in lanes of gcc vectors, a component per
+// vector. masks are -1 in the lanes they hold for and 0 in the others
+typedef float lanes_f __attribute__((vector_size(4 * raycast_lanes)));
+typedef int32_t lanes_i __attribute__((vector_size(4 * raycast_lanes)));
+
+struct ray_lanes {
+  lanes_f origin[3], dn[3], inv[3], t, end;
+  lanes_i map[3], step[3], axis;
+  // the size of the cell around map that the lane leaves next, 1 for the
+  // voxel or that of an empty cell of the pyramid
+  lanes_i cell;
+  // lanes still tracing, and those of them that leave their cell
+  lanes_i live, moving;
+};
+
+// the step of raycast() for the moving lanes, out of the voxel or across an
+// empty cell, without branches. a voxel is a cell of size 1, which makes
+// both the same. compiled a second time for avx2, like the generator's
+// kernels
+__attribute__((target_clones("avx2", "default")))
+static void step_lanes(ray_lanes &l, const int size[3]) {
+  const float inf = std::numeric_limits<float>::infinity();
+  lanes_i lo[3];
+  lanes_f exit[3];
+  for (int i = 0; i < 3; i++) {
+    lo[i] = l.map[i] & ~(l.cell - 1);
+    const lanes_f face = __builtin_convertvector(lo[i]
+        + (l.cell & (l.step[i] > 0)), lanes_f);
+    exit[i] = l.dn[i] == 0.f ? inf : (face - l.origin[i]) * l.inv[i];
+  }
+  const lanes_i xy = exit[0] < exit[1], mx = xy & (exit[0] < exit[2])
+    , my = ~xy & (exit[1] < exit[2]), mask[3] = { mx, my, ~(mx | my) };
+  const lanes_f t = mask[0] ? exit[0] : (mask[1] ? exit[1] : exit[2]);
+  lanes_i out = t > l.end;
+  for (int i = 0; i < 3; i++) {
+    // floor() of where the ray leaves, clamped into the cell
+    const lanes_f p = l.origin[i] + l.dn[i] * t;
+    lanes_i across = __builtin_convertvector(p, lanes_i);
+    across += __builtin_convertvector(across, lanes_f) > p;
+    across = across < lo[i] ? lo[i] : across;
+    across = across > lo[i] + l.cell - 1 ? lo[i] + l.cell - 1 : across;
+    const lanes_i along = l.step[i] > 0 ? lo[i] + l.cell : lo[i] - 1
+      , map = mask[i] ? along : across;
+    out |= (map < 0) | (map >= size[i]);
+    l.map[i] = l.moving ? map : l.map[i];
+  }
+  l.live &= ~(l.moving & out);
+  l.t = l.moving ? t : l.t;
+  l.axis = l.moving ? (mask[1] & 1) | (mask[2] & 2) : l.axis;
+}
+
+void world::raycast_run(const ray_batch &rays, size_t first, size_t last
+    , float max_dist, raycast_hit *hits) const {
+  const int size[3] = { (int)w, (int)h, (int)d };
+  ray_lanes l;
+  int level[raycast_lanes];
+  size_t ray[raycast_lanes], next = first;
+  // puts the next ray that comes into the world into lane k. with none left
+  // the lane stays dead and steps in place, on finite numbers
+  auto load = [&](int k) {
+    float origin[3] = {}, dn[3] = { 1.f, 1.f, 1.f }, inv[3] = { 1.f, 1.f
+      , 1.f }, t = 0.f, end = 0.f;
+    int axis = -1, map[3] = {}, step[3] = { 1, 1, 1 };
+    bool began = false;
+    while (!began && next < last) {
+      const size_t i = next++;
+      const float dir[3] = { rays.dx[i], rays.dy[i], rays.dz[i] };
+      origin[0] = rays.ox[i];
+      origin[1] = rays.oy[i];
+      origin[2] = rays.oz[i];
+      hits[i] = raycast_hit {};
+      ray[k] = i;
+      began = begin_ray(origin, dir, max_dist, size, dn, inv, t, end, axis
+          , map, step);
+    }
+    // begin_ray() may have set some of them for a ray that missed
+    if (!began)
+      for (int i = 0; i < 3; i++) {
+        origin[i] = 0.f;
+        dn[i] = inv[i] = 1.f;
+        map[i] = 0;
+        step[i] = 1;
+      }
+    for (int i = 0; i < 3; i++) {
+      l.origin[i][k] = origin[i];
+      l.dn[i][k] = dn[i];
+      l.inv[i][k] = inv[i];
+      l.map[i][k] = map[i];
+      l.step[i][k] = step[i];
+    }
+    l.t[k] = t;
+    l.end[k] = end;
+    l.axis[k] = axis;
+    l.cell[k] = 1;
+    l.live[k] = -began;
+    level[k] = -1;
+    return began;
+  };
+  for (int k = 0; k < raycast_lanes; k++)
+    load(k);
+  bool live = true;
+  while (live) {
+    live = false;
+    for (int k = 0; k < raycast_lanes; k++) {
+      l.moving[k] = 0;
+      // a lane whose ray ended takes the next one
+      while (l.live[k] || load(k)) {
+        const uint32_t x = l.map[0][k], y = l.map[1][k], z = l.map[2][k];
+        if (empty_cell(0, x, y, z)) {
+          // as in raycast(), a level higher than the last jump's at most
+          const int up = std::min(level[k] + 1, occupancy_levels - 1);
+          level[k] = up > 0 && empty_cell(up, x, y, z) ? up : 0;
+          l.cell[k] = brick_size << level[k];
+        } else if (get(x, y, z) > 127) {
+          const int map[3] = { (int)x, (int)y, (int)z }, step[3] = {
+            l.step[0][k], l.step[1][k], l.step[2][k] };
+          set_hit(hits[ray[k]], map, l.axis[k], step, l.t[k]);
+          l.live[k] = 0;
+          continue;
+        } else {
+          level[k] = -1;
+          l.cell[k] = 1;
+        }
+        l.moving[k] = -1;
+        live = true;
+        break;
+      }
+    }
+    step_lanes(l, size);
+  }
+}
+
+std::vector<raycast_hit> world::raycast_batch(const ray_batch &rays
+    , float max_dist, thread_pool *pool) const {
+  std::vector<raycast_hit> hits(rays.size());
+  // a task takes a run of rays, one is too little work to be worth a task
+  const size_t run = 1024, runs = (rays.size() + run - 1) / run;
+  auto cast = [&](size_t first, int worker) {
+    const size_t last = std::min(rays.size(), (first + 1) * run);
+    raycast_run(rays, first * run, last, max_dist, &hits[0]);
+  };
+  if (pool && runs > 1)
+    pool->parallel_for(runs, cast);
+  else
+    for (size_t i = 0; i < runs; i++)
+      cast(i, 0);
+  return hits;
+}
+
+uint32_t world::resident_bricks() const {
+  return _bricks.size() / _brick_bytes - _free_bricks.size();
+}
+
+uint64_t world::memory_usage() const {
+  return _index.size() * sizeof(_index[0]) + _bricks.size()
+    + _free_bricks.size() * sizeof(_free_bricks[0]) + _dirty.size()
+    + (_dirty_bricks.size() + _occupancy_dirty.size()
+        + _distance_dirty.size() + _occlusion_dirty.size()) * sizeof(uint64_t)
+    + _occupancy.size() + _distance.size() + _occlusion.size();
+}
+
+static GLuint create_texture_3d(GLenum unit) {
+  GLuint texture;
+  glActiveTexture(unit);
+  glGenTextures(1, &texture);
+  glBindTexture(GL_TEXTURE_3D, texture);
   glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
   glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+  return texture;
+}
+
+void world::index_texel(uint32_t entry, uint8_t *texel) const {
+  if (entry & uniform_flag) {
+    texel[0] = entry & 0xFF;
+    texel[1] = texel[2] = texel[3] = 0;
+  } else {
+    texel[0] = entry % _atlas_x;
+    texel[1] = entry / _atlas_x % _atlas_y;
+    texel[2] = entry / (_atlas_x * _atlas_y);
+    texel[3] = 255;
+  }
+}
+
+// recreates the textures from scratch. the atlas gets room for half as many
+// bricks again as the pool holds, so that edits can allocate bricks for a
+// while before it has to be reallocated
+void world::upload_all() {
+  GLint max_size;
+  glGetIntegerv(GL_MAX_3D_TEXTURE_SIZE, &max_size);
+  assertf(bw <= (uint32_t)max_size && bh <= (uint32_t)max_size
+      && bd <= (uint32_t)max_size, "world of %ux%ux%u bricks does not fit in "
+      "a %d^3 texture", bw, bh, bd, max_size);
+
+  // lay the brick pool out in the atlas as a cube that is as small as
+  // possible. atlas coordinates are stored in 8 bits per axis in the index
+  const uint32_t used = _bricks.size() / _brick_bytes
+    , slots = std::max(std::max<uint32_t>(used + used / 2, 64)
+        , _reserved_bricks)
+    , max_side = std::min<uint32_t>(max_size / _brick_side, 256);
+  _atlas_x = std::min<uint32_t>(ceil(cbrt(slots)), max_side);
+  _atlas_y = std::min<uint32_t>((slots + _atlas_x - 1) / _atlas_x, _atlas_x);
+  _atlas_z = std::min((slots + _atlas_x * _atlas_y - 1)
+      / (_atlas_x * _atlas_y), max_side);
+  assertf(used <= _atlas_x * _atlas_y * _atlas_z, "brick pool of %u bricks "
+      "does not fit in the atlas", used);
+
+  // packed bricks take a 2^3 texel corner of an rg32ui atlas, a texel per
+  // block with the low half of its word in r
+  const uint32_t side = _brick_side
+    , texel = _brick_bytes / (side * side * side)
+    , aw = _atlas_x * side, ah = _atlas_y * side, ad = _atlas_z * side;
+  std::vector<uint8_t> atlas((uint64_t)aw * ah * ad * texel, 0);
+  for (uint32_t slot = 0; slot < used; slot++) {
+    const uint32_t sx = slot % _atlas_x * side
+      , sy = slot / _atlas_x % _atlas_y * side
+      , sz = slot / (_atlas_x * _atlas_y) * side;
+    const uint8_t *voxels = brick_data(slot);
+    for (uint32_t z = 0; z < side; z++)
+      for (uint32_t y = 0; y < side; y++)
+        memcpy(&atlas[(((uint64_t)(sz + z) * ah + sy + y) * aw + sx) * texel]
+            , voxels + (z * side + y) * side * texel, side * texel);
+  }
+
+  std::vector<uint8_t> index(_index.size() * 4);
+  for (size_t i = 0; i < _index.size(); i++)
+    index_texel(_index[i], &index[i * 4]);
+
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+  if (_index_texture > 0)
+    glDeleteTextures(1, &_index_texture);
+  _index_texture = create_texture_3d(GL_TEXTURE0);
+  glTexImage3D(GL_TEXTURE_3D, 0, GL_RGBA8, bw, bh, bd, 0, GL_RGBA
+      , GL_UNSIGNED_BYTE, &index[0]);
+
+  if (_atlas_texture > 0)
+    glDeleteTextures(1, &_atlas_texture);
+  _atlas_texture = create_texture_3d(GL_TEXTURE1);
+  if (format == material_voxels)
+    glTexImage3D(GL_TEXTURE_3D, 0, GL_R8, aw, ah, ad, 0, GL_RED
+        , GL_UNSIGNED_BYTE, &atlas[0]);
+  else
+    glTexImage3D(GL_TEXTURE_3D, 0, GL_RG32UI, aw, ah, ad, 0, GL_RG_INTEGER
+        , GL_UNSIGNED_INT, &atlas[0]);
+
+  update_occupancy();
+  if (_occupancy_texture > 0)
+    glDeleteTextures(1, &_occupancy_texture);
+  _occupancy_texture = create_texture_3d(GL_TEXTURE2);
+  glTexImage3D(GL_TEXTURE_3D, 0, GL_R8, _occupancy_width, bh, bd, 0, GL_RED
+      , GL_UNSIGNED_BYTE, &_occupancy[0]);
+  _occupancy_changed = false;
+  glActiveTexture(GL_TEXTURE0);
+  if (_distance_pool) {
+    update_distance();
+    upload_distance();
+  }
+  if (_occlusion_pool) {
+    update_occlusion();
+    upload_occlusion();
+  }
+
+  for (uint64_t brick : _dirty_bricks)
+    _dirty[brick] &= ~dirty_upload;
+  _dirty_bricks.clear();
+  flushed.assign(1, box { 0, 0, 0, bw, bh, bd });
+  flushed_bytes = index.size() + atlas.size() + _occupancy.size()
+    + _distance.size() + _occlusion.size();
+}
+
+// a byte per voxel, or per brick, of a w x h x d grid, which replaces texture
+static void upload_voxel_texture(GLuint &texture, GLenum unit
+    , const std::vector<uint8_t> &voxels, uint32_t w, uint32_t h, uint32_t d
+    , const char *name) {
+  GLint max_size;
+  glGetIntegerv(GL_MAX_3D_TEXTURE_SIZE, &max_size);
+  assertf(w <= (uint32_t)max_size && h <= (uint32_t)max_size
+      && d <= (uint32_t)max_size, "%s of %ux%ux%u does not fit in a "
+      "%d^3 texture", name, w, h, d, max_size);
+  if (texture > 0)
+    glDeleteTextures(1, &texture);
+  texture = create_texture_3d(unit);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  glTexImage3D(GL_TEXTURE_3D, 0, GL_R8, w, h, d, 0, GL_RED, GL_UNSIGNED_BYTE
+      , &voxels[0]);
+  glActiveTexture(GL_TEXTURE0);
+}
+
+// sends the boxes of cells that changed, straight from voxels, and returns
+// how many bytes that took
+static uint64_t flush_voxel_texture(GLuint texture, GLenum unit
+    , const std::vector<uint8_t> &voxels, uint32_t w, uint32_t h
+    , std::vector<box> &changed) {
+  uint64_t bytes = 0;
+  glActiveTexture(unit);
+  glBindTexture(GL_TEXTURE_3D, texture);
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, w);
+  glPixelStorei(GL_UNPACK_IMAGE_HEIGHT, h);
+  for (const box &b : changed) {
+    glTexSubImage3D(GL_TEXTURE_3D, 0, b.x0, b.y0, b.z0, b.x1 - b.x0
+        , b.y1 - b.y0, b.z1 - b.z0, GL_RED, GL_UNSIGNED_BYTE
+        , &voxels[((uint64_t)b.z0 * h + b.y0) * w + b.x0]);
+    bytes += (uint64_t)(b.x1 - b.x0) * (b.y1 - b.y0) * (b.z1 - b.z0);
+  }
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+  glPixelStorei(GL_UNPACK_IMAGE_HEIGHT, 0);
+  glActiveTexture(GL_TEXTURE0);
+  changed.clear();
+  return bytes;
+}
+
+void world::upload_distance() {
+  upload_voxel_texture(_distance_texture, GL_TEXTURE4, _distance, bw, bh, bd
+      , "distance field");
+  _distance_changed.clear();
+}
+
+// the shader reads the occlusion between corners, filtered by the texture
+// unit, and the corners past the far ends of the world are the first ones
+void world::upload_occlusion() {
+  upload_voxel_texture(_occlusion_texture, GL_TEXTURE5, _occlusion, w, h, d
+      , "ambient occlusion");
+  glActiveTexture(GL_TEXTURE5);
+  glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
   glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_REPEAT);
   glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_REPEAT);
   glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_REPEAT);
+  glActiveTexture(GL_TEXTURE0);
+  _occlusion_changed.clear();
+}
 
-  glTexImage3D(GL_TEXTURE_3D, 0, GL_RED, w, h, d, 0, GL_RED, GL_UNSIGNED_BYTE
-      , &_data[0]);
+void world::reserve_bricks(uint32_t bricks) {
+  _reserved_bricks = bricks;
+}
 
-  _data_unif = sp->bind_uniform("world_data");
-  _w_unif = sp->bind_uniform("w");
-  _h_unif = sp->bind_uniform("h");
-  _d_unif = sp->bind_uniform("d");
+void world::bind_program(shaderprogram *sp) {
+  _program = sp;
+  _index_unif = sp->bind_uniform("world_index");
+  _atlas_unif = sp->bind_uniform("world_atlas");
+  _size_unif = sp->bind_uniform("world_size");
+  _index_size_unif = sp->bind_uniform("index_size");
+  _atlas_size_unif = sp->bind_uniform("atlas_size");
+  _occupancy_unif = sp->bind_uniform("world_occupancy");
+  _occupancy_size_unif = sp->bind_uniform("occupancy_size");
+  _occupancy_levels_unif = sp->bind_uniform("occupancy_levels");
+  _distance_unif = sp->bind_uniform("world_distance");
+  _occlusion_unif = sp->bind_uniform("world_occlusion");
   sp->use_this_prog();
-  glUniform1i(_data_unif, 0);
-  glUniform1i(_w_unif, 1);
-  glUniform1i(_h_unif, 1);
-  glUniform1i(_d_unif, 0);
+  glUniform1i(_index_unif, 0);
+  glUniform1i(_atlas_unif, 1);
+  glUniform1i(_occupancy_unif, 2);
+  glUniform1i(_distance_unif, 4);
+  glUniform1i(_occlusion_unif, 5);
+  glUniform3f(_size_unif, w, h, d);
+  glUniform3f(_index_size_unif, bw, bh, bd);
+  glUniform3f(_atlas_size_unif, _atlas_x * brick_size, _atlas_y * brick_size
+      , _atlas_z * brick_size);
+  glUniform3f(_occupancy_size_unif, _occupancy_width, bh, bd);
+  glUniform1f(_occupancy_levels_unif, occupancy_levels);
   sp->dont_use_this_prog();
 }
 
+void world::update_texture(shaderprogram *sp) {
+  if (!_unpack)
+    _unpack = new unpack_ring;
+  upload_all();
+  bind_program(sp);
+}
+
+// merges boxes that line up into bigger ones: rows into slabs along y, then
+// slabs into boxes along z. the rows have to be sorted by z, y and x
+static void coalesce_boxes(std::vector<box> &boxes) {
+  for (int axis = 1; axis < 3; axis++) {
+    std::vector<box> merged;
+    std::map<std::array<uint32_t, 4>, size_t> last;
+    for (const box &b : boxes) {
+      const std::array<uint32_t, 4> key = axis == 1
+        ? std::array<uint32_t, 4> {{ b.x0, b.x1, b.z0, b.z1 }}
+        : std::array<uint32_t, 4> {{ b.x0, b.x1, b.y0, b.y1 }};
+      auto it = last.find(key);
+      if (it != last.end()) {
+        box &m = merged[it->second];
+        uint32_t &end = axis == 1 ? m.y1 : m.z1;
+        if (end == (axis == 1 ? b.y0 : b.z0)) {
+          end = axis == 1 ? b.y1 : b.z1;
+          continue;
+        }
+      }
+      last[key] = merged.size();
+      merged.push_back(b);
+    }
+    boxes.swap(merged);
+  }
+}
+
+void world::enable_distance_field(thread_pool *pool) {
+  if (_distance_pool)
+    return;
+  _distance_pool = pool;
+  _distance.assign((uint64_t)bw * bh * bd, 0);
+  const int lo[3] = { 0, 0, 0 }, hi[3] = { (int)bw, (int)bh, (int)bd };
+  distance_transform(this, lo, hi, &_distance[0], pool);
+  if (_index_texture > 0)
+    upload_distance();
+}
+
+// the boxes of the world that [lo, hi) covers once it is wrapped around
+static void wrap_box(const int lo[3], const int hi[3], const int size[3]
+    , std::vector<box> &boxes) {
+  uint32_t from[3][2], to[3][2];
+  int parts[3];
+  for (int i = 0; i < 3; i++) {
+    const int l = ((lo[i] % size[i]) + size[i]) % size[i]
+      , n = std::min(hi[i] - lo[i], size[i]);
+    from[i][0] = n == size[i] ? 0 : l;
+    to[i][0] = std::min(from[i][0] + n, (uint32_t)size[i]);
+    from[i][1] = 0;
+    to[i][1] = from[i][0] + n - to[i][0];
+    parts[i] = to[i][1] > 0 ? 2 : 1;
+  }
+  for (int z = 0; z < parts[2]; z++)
+    for (int y = 0; y < parts[1]; y++)
+      for (int x = 0; x < parts[0]; x++)
+        boxes.push_back(box { from[0][x], from[1][y], from[2][z], to[0][x]
+            , to[1][y], to[2][z] });
+}
+
+// empties the list of dirty bricks, which had flag set, into boxes of them
+std::vector<box> world::take_dirty(std::vector<uint64_t> &bricks
+    , uint8_t flag) {
+  std::sort(bricks.begin(), bricks.end());
+  std::vector<box> boxes;
+  for (uint64_t brick : bricks) {
+    const uint32_t bx = brick % bw, by = brick / bw % bh
+      , bz = brick / ((uint64_t)bw * bh);
+    if (!boxes.empty() && boxes.back().x1 == bx && boxes.back().y0 == by
+        && boxes.back().z0 == bz)
+      boxes.back().x1++;
+    else
+      boxes.push_back(box { bx, by, bz, bx + 1, by + 1, bz + 1 });
+    _dirty[brick] &= ~flag;
+  }
+  bricks.clear();
+  coalesce_boxes(boxes);
+  return boxes;
+}
+
+// a brick can only be nearer to an edited one than distance_cap when it is
+// less than that away along every axis, so the edited bricks grow by that
+// much. the transform of a box reads that much around it again, when all
+// of that adds up to more than the world it is done whole instead
+void world::update_distance() {
+  if (!_distance_pool || _distance_dirty.empty())
+    return;
+  const std::vector<box> bricks = take_dirty(_distance_dirty, dirty_distance);
+
+  const int reach = distance_cap - 1
+    , size[3] = { (int)bw, (int)bh, (int)bd };
+  std::vector<std::array<int, 6>> regions;
+  uint64_t work = 0;
+  for (const box &b : bricks) {
+    const int lo[3] = { (int)b.x0, (int)b.y0, (int)b.z0 }
+      , hi[3] = { (int)b.x1, (int)b.y1, (int)b.z1 };
+    std::array<int, 6> r;
+    uint64_t volume = 1;
+    for (int i = 0; i < 3; i++) {
+      r[i] = lo[i] - reach;
+      r[i + 3] = hi[i] + reach;
+      volume *= std::min(hi[i] - lo[i] + 4 * reach, size[i]);
+    }
+    regions.push_back(r);
+    work += volume;
+  }
+  if (work >= (uint64_t)bw * bh * bd)
+    regions.assign(1, std::array<int, 6> {{ 0, 0, 0, size[0], size[1]
+        , size[2] }});
+  for (const std::array<int, 6> &r : regions) {
+    distance_transform(this, &r[0], &r[3], &_distance[0], _distance_pool);
+    if (_distance_texture > 0)
+      wrap_box(&r[0], &r[3], size, _distance_changed);
+  }
+}
+
+void world::enable_ambient_occlusion(thread_pool *pool) {
+  if (_occlusion_pool)
+    return;
+  _occlusion_pool = pool;
+  _occlusion.assign((uint64_t)w * h * d, 0);
+  const int lo[3] = { 0, 0, 0 }, hi[3] = { (int)w, (int)h, (int)d };
+  bake_occlusion(this, lo, hi, &_occlusion[0], pool);
+  if (_index_texture > 0)
+    upload_occlusion();
+}
+
+// an edited voxel shades the 8 corners around it, so the edited bricks grow
+// by a corner along every axis
+void world::update_occlusion() {
+  if (!_occlusion_pool || _occlusion_dirty.empty())
+    return;
+  const int size[3] = { (int)w, (int)h, (int)d };
+  for (const box &b : take_dirty(_occlusion_dirty, dirty_occlusion)) {
+    const int lo[3] = { (int)(b.x0 * brick_size), (int)(b.y0 * brick_size)
+      , (int)(b.z0 * brick_size) }
+      , hi[3] = { (int)std::min(b.x1 * brick_size, w) + 1
+        , (int)std::min(b.y1 * brick_size, h) + 1
+        , (int)std::min(b.z1 * brick_size, d) + 1 };
+    bake_occlusion(this, lo, hi, &_occlusion[0], _occlusion_pool);
+    if (_occlusion_texture > 0)
+      wrap_box(lo, hi, size, _occlusion_changed);
+  }
+}
+
+// sends the bricks edited since the last upload. their index texels go up as
+// a few coalesced boxes, their pooled voxels as runs of adjacent atlas slots,
+// all staged in one buffer of the unpack ring so the copies run
+// asynchronously. falls back to upload_all() when the atlas is full
+void world::flush() {
+  flushed.clear();
+  flushed_bytes = 0;
+  if (_dirty_bricks.empty())
+    return;
+  if (_bricks.size() / _brick_bytes > _atlas_x * _atlas_y * _atlas_z) {
+    upload_all();
+    bind_program(_program);
+    return;
+  }
+
+  std::sort(_dirty_bricks.begin(), _dirty_bricks.end());
+  std::vector<uint32_t> slots;
+  for (uint64_t brick : _dirty_bricks) {
+    const uint32_t bx = brick % bw, by = brick / bw % bh
+      , bz = brick / ((uint64_t)bw * bh);
+    if (!flushed.empty() && flushed.back().x1 == bx
+        && flushed.back().y0 == by && flushed.back().z0 == bz)
+      flushed.back().x1++;
+    else
+      flushed.push_back(box { bx, by, bz, bx + 1, by + 1, bz + 1 });
+    if (!(_index[brick] & uniform_flag))
+      slots.push_back(_index[brick]);
+    _dirty[brick] &= ~dirty_upload;
+  }
+  _dirty_bricks.clear();
+  coalesce_boxes(flushed);
+  std::sort(slots.begin(), slots.end());
+
+  // runs of slots that are adjacent along x in the atlas, as first and count
+  std::vector<std::pair<uint32_t, uint32_t>> runs;
+  for (uint32_t slot : slots)
+    if (!runs.empty() && runs.back().first + runs.back().second == slot
+        && slot % _atlas_x != 0)
+      runs.back().second++;
+    else
+      runs.push_back(std::make_pair(slot, 1));
+
+  const uint32_t side = _brick_side, row = _brick_bytes / (side * side);
+  uint64_t size = (uint64_t)slots.size() * _brick_bytes;
+  for (const box &b : flushed)
+    size += (uint64_t)(b.x1 - b.x0) * (b.y1 - b.y0) * (b.z1 - b.z0) * 4;
+  flushed_bytes = size;
+  uint8_t *staging = _unpack->map(size), *p = staging;
+  for (const box &b : flushed)
+    for (uint32_t z = b.z0; z < b.z1; z++)
+      for (uint32_t y = b.y0; y < b.y1; y++)
+        for (uint32_t x = b.x0; x < b.x1; x++, p += 4)
+          index_texel(_index[to_brick_index(x, y, z)], p);
+  for (const std::pair<uint32_t, uint32_t> &r : runs)
+    for (uint32_t z = 0; z < side; z++)
+      for (uint32_t y = 0; y < side; y++)
+        for (uint32_t s = r.first; s < r.first + r.second; s++, p += row)
+          memcpy(p, brick_data(s) + (z * side + y) * row, row);
+  _unpack->unmap();
+
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  uint64_t offset = 0;
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_3D, _index_texture);
+  for (const box &b : flushed) {
+    glTexSubImage3D(GL_TEXTURE_3D, 0, b.x0, b.y0, b.z0, b.x1 - b.x0
+        , b.y1 - b.y0, b.z1 - b.z0, GL_RGBA, GL_UNSIGNED_BYTE
+        , (const void*)offset);
+    offset += (uint64_t)(b.x1 - b.x0) * (b.y1 - b.y0) * (b.z1 - b.z0) * 4;
+  }
+  glActiveTexture(GL_TEXTURE1);
+  glBindTexture(GL_TEXTURE_3D, _atlas_texture);
+  for (const std::pair<uint32_t, uint32_t> &r : runs) {
+    glTexSubImage3D(GL_TEXTURE_3D, 0, r.first % _atlas_x * side
+        , r.first / _atlas_x % _atlas_y * side
+        , r.first / (_atlas_x * _atlas_y) * side, r.second * side, side, side
+        , format == material_voxels ? GL_RED : GL_RG_INTEGER
+        , format == material_voxels ? GL_UNSIGNED_BYTE : GL_UNSIGNED_INT
+        , (const void*)offset);
+    offset += (uint64_t)r.second * _brick_bytes;
+  }
+  _unpack->unbind();
+
+  // the pyramid is small next to the bricks, it goes up whole whenever a
+  // cell of it changed
+  update_occupancy();
+  if (_occupancy_changed) {
+    glActiveTexture(GL_TEXTURE2);
+    glBindTexture(GL_TEXTURE_3D, _occupancy_texture);
+    glTexSubImage3D(GL_TEXTURE_3D, 0, 0, 0, 0, _occupancy_width, bh, bd
+        , GL_RED, GL_UNSIGNED_BYTE, &_occupancy[0]);
+    flushed_bytes += _occupancy.size();
+    _occupancy_changed = false;
+  }
+
+  // the distance field and the occlusion go up straight from their
+  // bytes, a box of them at a time
+  update_distance();
+  if (!_distance_changed.empty())
+    flushed_bytes += flush_voxel_texture(_distance_texture, GL_TEXTURE4
+        , _distance, bw, bh, _distance_changed);
+  update_occlusion();
+  if (!_occlusion_changed.empty())
+    flushed_bytes += flush_voxel_texture(_occlusion_texture, GL_TEXTURE5
+        , _occlusion, w, h, _occlusion_changed);
+  glActiveTexture(GL_TEXTURE0);
+}
@@ -5,17 +5,195 @@
 #include <vector>
 #include <cstdint>
 
+// the world is split into bricks of brick_size^3 voxels. bricks that contain a
+// single value are collapsed into their index entry, the rest live in a pool
+// that is uploaded to the gpu as a 3d atlas, together with an indirection
+// texture that holds one texel per brick
+const uint32_t brick_size = 8, brick_shift = 3
+  , brick_voxels = brick_size * brick_size * brick_size;
+
+// pooled bricks keep a byte per voxel with material_voxels. occupancy_bits
+// packs them into a bit each, as 64 bit words that each hold a 4^3 block,
+// which takes an eighth of the memory and upload bandwidth. a voxel that is
+// set to anything but 0 reads back as 255 then
+enum voxel_format { material_voxels, occupancy_bits };
+const uint32_t block_size = 4, block_shift = 2;
+
+// the occupancy pyramid has a cell per brick at level 0 and cells twice as
+// large along every axis at each level above it
+const int max_occupancy_levels = 6;
+
+// the distance field holds a byte per brick, the chebyshev distance in bricks
+// to the nearest one with voxels in it of the repeating world: 0 for those,
+// 1 next to them, and no more than distance_cap. every brick less than that
+// distance away along all axes is empty
+const uint8_t distance_cap = 16;
+
+// the ambient occlusion holds a byte per corner of the voxels, how many of
+// the 2^3 voxels around it are solid out of 255. on a face of a voxel half
+// of them are its own side, interpolating the four corners of the face gives
+// how much the voxels in front of it shade a point on it
+
+// half open box [x0, x1) x [y0, y1) x [z0, z1)
+struct box {
+  uint32_t x0, y0, z0, x1, y1, z1;
+};
+
+class thread_pool;
+
+// rays for world::raycast_batch(), as structure of arrays. directions need
+// not be normalized
+struct ray_batch {
+  std::vector<float> ox, oy, oz, dx, dy, dz;
+  void resize(size_t n);
+  size_t size() const { return ox.size(); }
+};
+// rays of a batch that step together, as one vector step
+const int raycast_lanes = 8;
+
+struct raycast_hit {
+  uint32_t x, y, z; // the voxel
+  // of the face the ray entered the voxel through, all 0 when it started in it
+  int8_t normal[3];
+  float distance; // along the normalized direction, to where it entered
+  bool hit;
+};
+
 class world {
-  GLint _data_unif, _w_unif, _h_unif, _d_unif;
-  uint64_t to_index(uint32_t x, uint32_t y, uint32_t z) const;
+  GLint _index_unif, _atlas_unif, _size_unif, _index_size_unif
+    , _atlas_size_unif, _occupancy_unif, _occupancy_size_unif
+    , _occupancy_levels_unif, _distance_unif, _occlusion_unif;
+  // index entries with uniform_flag set hold the brick's value in the low
+  // byte, other entries are slots in _bricks
+  static const uint32_t uniform_flag = 0x80000000;
+  uint64_t to_brick_index(uint32_t bx, uint32_t by, uint32_t bz) const;
+  uint8_t *brick_data(uint32_t slot);
+  const uint8_t *brick_data(uint32_t slot) const;
+  uint32_t alloc_brick(uint8_t fill);
+  void free_brick(uint32_t slot);
+  void mark_dirty(uint64_t brick);
+  uint64_t occupancy_index(int level, uint32_t x, uint32_t y, uint32_t z)
+    const;
+  void index_texel(uint32_t entry, uint8_t *texel) const;
+  void upload_all();
+  void upload_distance();
+  void upload_occlusion();
+  std::vector<box> take_dirty(std::vector<uint64_t> &bricks, uint8_t flag);
+  // raycast() for the rays [first, last) of the batch, raycast_lanes at a
+  // time. a lane whose ray ends takes the next one
+  void raycast_run(const ray_batch &rays, size_t first, size_t last
+      , float max_dist, raycast_hit *hits) const;
 public:
   uint32_t w, h, d;
-  world(uint32_t n_w, uint32_t n_h, uint32_t n_d);
+  uint32_t bw, bh, bd; // dimensions in bricks
+  voxel_format format;
+  int occupancy_levels;
+  world(uint32_t n_w, uint32_t n_h, uint32_t n_d
+      , voxel_format n_format = material_voxels);
   ~world();
   uint8_t get(uint32_t x, uint32_t y, uint32_t z) const;
+  void set(uint32_t x, uint32_t y, uint32_t z, uint8_t v);
+  void fill(const box &b, uint8_t v);
+  // copies a whole brick of voxels, laid out x first, into the pool
+  void set_brick(uint32_t bx, uint32_t by, uint32_t bz, const uint8_t *voxels);
+  // the reverse of set_brick(), for uniform bricks as well
+  void get_brick(uint32_t bx, uint32_t by, uint32_t bz, uint8_t *voxels)
+    const;
+  // true when the brick is collapsed into a single value, which goes into
+  // value
+  bool uniform_brick(uint32_t bx, uint32_t by, uint32_t bz, uint8_t &value)
+    const;
+  // the voxels of the box of n voxels at origin, in unwrapped coordinates of
+  // the repeating world, as solid or empty in out. its rows are row bytes and
+  // its planes plane bytes apart. bricks are read on pool, a z run of them
+  // per task
+  void copy_solid(const int origin[3], const int n[3], size_t row
+      , size_t plane, uint8_t solid, uint8_t empty, uint8_t *out
+      , thread_pool *pool) const;
+  void compact();
+  // number of voxels in b that are not 0. uniform bricks are counted whole
+  // and packed bricks a word at a time
+  uint64_t count(const box &b) const;
+  // rebuilds the occupancy pyramid above the bricks edited since the last
+  // call. flush() calls it, the cpu renderer has to call it itself
+  void update_occupancy();
+  // true when no voxel in the level's cell around x, y, z is solid
+  bool empty_cell(int level, uint32_t x, uint32_t y, uint32_t z) const;
+  // computes the distance field on pool and keeps it up to date from then on,
+  // uploaded next to the occupancy pyramid. it costs a byte per brick
+  void enable_distance_field(thread_pool *pool);
+  // recomputes the distance field within distance_cap of the bricks edited
+  // since the last call, or all of it when that is less work. flush() calls
+  // it, the cpu renderer has to call it itself
+  void update_distance();
+  uint8_t distance(uint32_t bx, uint32_t by, uint32_t bz) const {
+    return _distance[((uint64_t)bz * bh + by) * bw + bx];
+  }
+  // bakes the ambient occlusion on pool and keeps it up to date from then
+  // on, uploaded as a texture with linear filtering. it costs a byte per
+  // voxel
+  void enable_ambient_occlusion(thread_pool *pool);
+  // rebakes the corners of the bricks edited since the last call. flush()
+  // calls it, the cpu renderer has to call it itself
+  void update_occlusion();
+  uint8_t occlusion(uint32_t x, uint32_t y, uint32_t z) const {
+    return _occlusion[((uint64_t)z * h + y) * w + x];
+  }
+  // the first solid voxel along the ray, above 127 like in the renderers,
+  // up to max_dist. unlike in the renderers the world does not repeat here,
+  // rays only hit voxels inside it. empty space is skipped with the
+  // occupancy pyramid, which has to be updated after edits
+  raycast_hit raycast(const float origin[3], const float dir[3]
+      , float max_dist) const;
+  // raycast() for every ray of the batch, on pool when there is one, with
+  // the same hits. must not be called from one of its tasks
+  std::vector<raycast_hit> raycast_batch(const ray_batch &rays
+      , float max_dist, thread_pool *pool = nullptr) const;
+  uint32_t resident_bricks() const;
+  uint64_t memory_usage() const;
+  // creates the textures and binds the uniforms of sp, once. edits made
+  // afterwards are uploaded by flush(), which only sends the changed bricks
   void update_texture(shaderprogram *sp);
+  // points the uniforms of a rebuilt program at the textures
+  void bind_program(shaderprogram *sp);
+  void flush();
+  // makes the atlas hold at least this many bricks from the next upload on
+  void reserve_bricks(uint32_t bricks);
+  std::vector<box> flushed; // brick boxes sent by the last flush()
+  uint64_t flushed_bytes;
 private:
-  std::vector<uint8_t> _data; // reorder for initializer list
-  GLuint _texture;
+  std::vector<uint32_t> _index; // reorder for initializer list
+  // a pooled brick is _brick_side^3 texels of the atlas and _brick_bytes
+  // bytes in _bricks, laid out x first in both
+  uint32_t _brick_side, _brick_bytes;
+  std::vector<uint8_t> _bricks;
+  std::vector<uint32_t> _free_bricks;
+  // bricks edited since the last upload, the last occupancy update, the last
+  // distance update and the last occlusion update, as flags per brick and a
+  // list each
+  enum { dirty_upload = 1, dirty_occupancy = 2, dirty_distance = 4
+    , dirty_occlusion = 8 };
+  std::vector<uint8_t> _dirty;
+  std::vector<uint64_t> _dirty_bricks, _occupancy_dirty, _distance_dirty
+    , _occlusion_dirty;
+  // every level of the pyramid in one texture, next to each other along x
+  std::vector<uint8_t> _occupancy;
+  uint32_t _occupancy_width;
+  bool _occupancy_changed;
+  // empty until enable_distance_field(). the boxes of bricks it changed go
+  // up with the next flush()
+  std::vector<uint8_t> _distance;
+  thread_pool *_distance_pool;
+  std::vector<box> _distance_changed;
+  // the same for the ambient occlusion
+  std::vector<uint8_t> _occlusion;
+  thread_pool *_occlusion_pool;
+  std::vector<box> _occlusion_changed;
+  GLuint _index_texture, _atlas_texture, _occupancy_texture
+    , _distance_texture, _occlusion_texture;
+  uint32_t _atlas_x, _atlas_y, _atlas_z; // atlas dimensions in bricks
+  uint32_t _reserved_bricks;
+  shaderprogram *_program;
+  unpack_ring *_unpack;
 };
 
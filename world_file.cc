@@ -0,0 +1,310 @@
+#include "world_file.hh"
+#include "utils.hh"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+enum { brick_uniform, brick_packed, brick_runs };
+
+static const char magic[4] = { 'V', 'F', 'K', 'W' };
+static const uint32_t header_words = 9, directory_entry_bytes = 16;
+
+// chunks are checked from several threads, the table is built by the first
+// call under the guarantees of a function local static
+struct crc32_table {
+  uint32_t entries[256];
+  crc32_table() {
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; k++)
+        c = c & 1 ? 0xEDB88320u ^ c >> 1 : c >> 1;
+      entries[i] = c;
+    }
+  }
+};
+
+static uint32_t crc32(const uint8_t *data, size_t size) {
+  static const crc32_table table;
+  uint32_t c = ~0u;
+  for (size_t i = 0; i < size; i++)
+    c = table.entries[(c ^ data[i]) & 0xFF] ^ c >> 8;
+  return ~c;
+}
+
+static void put32(std::vector<uint8_t> &out, uint32_t x) {
+  for (int i = 0; i < 4; i++)
+    out.push_back(x >> 8 * i);
+}
+
+static void put64(std::vector<uint8_t> &out, uint64_t x) {
+  for (int i = 0; i < 8; i++)
+    out.push_back(x >> 8 * i);
+}
+
+static uint32_t get32(const uint8_t *p) {
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t get64(const uint8_t *p) {
+  return get32(p) | (uint64_t)get32(p + 4) << 32;
+}
+
+// bits per palette index of a packed brick
+static uint32_t index_bits(uint32_t palette_size) {
+  uint32_t bits = 1;
+  while (1u << bits < palette_size)
+    bits *= 2;
+  return bits;
+}
+
+// the bricks of chunk cx, cy, cz that lie inside the world, x first
+template <typename F>
+static void for_chunk_bricks(uint32_t cx, uint32_t cy, uint32_t cz
+    , uint32_t bw, uint32_t bh, uint32_t bd, F f) {
+  for (uint32_t i = 0; i < file_chunk_brick_count; i++) {
+    const uint32_t bx = cx * file_chunk_bricks + i % file_chunk_bricks
+      , by = cy * file_chunk_bricks + i / file_chunk_bricks
+        % file_chunk_bricks
+      , bz = cz * file_chunk_bricks + i / (file_chunk_bricks
+          * file_chunk_bricks);
+    if (bx < bw && by < bh && bz < bd)
+      f(i, bx, by, bz);
+  }
+}
+
+static void encode_chunk(const world *w, uint32_t cx, uint32_t cy, uint32_t cz
+    , std::vector<uint8_t> &out) {
+  std::vector<uint8_t> voxels(file_chunk_brick_count * brick_voxels);
+  bool present[256] = {};
+  for_chunk_bricks(cx, cy, cz, w->bw, w->bh, w->bd
+      , [&](uint32_t i, uint32_t bx, uint32_t by, uint32_t bz) {
+    uint8_t *v = &voxels[i * brick_voxels];
+    w->get_brick(bx, by, bz, v);
+    for (uint32_t j = 0; j < brick_voxels; j++)
+      present[v[j]] = true;
+  });
+  uint8_t palette_index[256];
+  std::vector<uint8_t> palette;
+  for (int v = 0; v < 256; v++)
+    if (present[v]) {
+      palette_index[v] = palette.size();
+      palette.push_back(v);
+    }
+  if (palette.empty())
+    palette.push_back(0);
+  out.push_back(palette.size() - 1);
+  out.insert(out.end(), palette.begin(), palette.end());
+
+  const uint32_t bits = index_bits(palette.size())
+    , packed_bytes = brick_voxels * bits / 8;
+  std::vector<uint8_t> runs;
+  for_chunk_bricks(cx, cy, cz, w->bw, w->bh, w->bd
+      , [&](uint32_t i, uint32_t, uint32_t, uint32_t) {
+    const uint8_t *v = &voxels[i * brick_voxels];
+    runs.clear();
+    // noisy bricks give up on runs once they are no smaller than packing
+    uint32_t j = 0;
+    while (j < brick_voxels && runs.size() + 2 < packed_bytes) {
+      uint32_t n = 1;
+      while (j + n < brick_voxels && n < 256 && v[j + n] == v[j])
+        n++;
+      runs.push_back(n - 1);
+      runs.push_back(palette_index[v[j]]);
+      j += n;
+    }
+    // runs are at most 256 voxels long, a uniform brick takes two of them
+    if (runs.size() == 4 && runs[1] == runs[3]) {
+      out.push_back(brick_uniform);
+      out.push_back(palette_index[v[0]]);
+    } else if (j == brick_voxels && runs.size() + 2 < packed_bytes) {
+      out.push_back(brick_runs);
+      out.push_back((runs.size() / 2 - 1) & 0xFF);
+      out.push_back((runs.size() / 2 - 1) >> 8);
+      out.insert(out.end(), runs.begin(), runs.end());
+    } else {
+      out.push_back(brick_packed);
+      for (const uint8_t *v_end = v + brick_voxels; v < v_end; ) {
+        uint8_t packed = 0;
+        for (uint32_t shift = 0; shift < 8; shift += bits)
+          packed |= palette_index[*v++] << shift;
+        out.push_back(packed);
+      }
+    }
+  });
+}
+
+void save_world(const world *w, const char *path) {
+  const uint32_t cw = (w->bw + file_chunk_bricks - 1) / file_chunk_bricks
+    , ch = (w->bh + file_chunk_bricks - 1) / file_chunk_bricks
+    , cd = (w->bd + file_chunk_bricks - 1) / file_chunk_bricks
+    , chunks = cw * ch * cd;
+  const uint64_t data_start = header_words * 4
+    + (uint64_t)chunks * directory_entry_bytes;
+  std::vector<uint8_t> directory, data;
+  for (uint32_t c = 0; c < chunks; c++) {
+    const size_t start = data.size();
+    encode_chunk(w, c % cw, c / cw % ch, c / (cw * ch), data);
+    put64(directory, data_start + start);
+    put32(directory, data.size() - start);
+    put32(directory, crc32(&data[start], data.size() - start));
+  }
+
+  std::vector<uint8_t> header(magic, magic + 4);
+  put32(header, world_file_version);
+  put32(header, w->w);
+  put32(header, w->h);
+  put32(header, w->d);
+  put32(header, file_chunk_bricks);
+  put32(header, chunks);
+  put32(header, crc32(&directory[0], directory.size()));
+  put32(header, crc32(&header[0], header.size()));
+
+  FILE *f = fopen(path, "wb");
+  assertf(f, "failed to open %s for writing", path);
+  const bool written = fwrite(&header[0], header.size(), 1, f) == 1
+    && fwrite(&directory[0], directory.size(), 1, f) == 1
+    && (data.empty() || fwrite(&data[0], data.size(), 1, f) == 1);
+  assertf(written && fclose(f) == 0, "failed to write %s", path);
+}
+
+world_file::world_file(const char *n_path) : _path(n_path) {
+  const int fd = open(_path, O_RDONLY);
+  assertf(fd >= 0, "failed to open %s", _path);
+  struct stat st;
+  assertf(fstat(fd, &st) == 0, "failed to stat %s", _path);
+  _size = st.st_size;
+  assertf(_size >= header_words * 4, "%s is too short for a world file"
+      , _path);
+  void *p = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  assertf(p != MAP_FAILED, "failed to map %s", _path);
+  _data = (const uint8_t*)p;
+
+  assertf(!memcmp(_data, magic, 4), "%s is not a world file", _path);
+  const uint32_t version = get32(_data + 4);
+  assertf(version == world_file_version, "%s is a version %u world file, "
+      "only version %u is supported", _path, version, world_file_version);
+  assertf(get32(_data + 32) == crc32(_data, 32), "the header of %s is "
+      "corrupt", _path);
+  w = get32(_data + 8);
+  h = get32(_data + 12);
+  d = get32(_data + 16);
+  assertf(get32(_data + 20) == file_chunk_bricks, "%s has chunks of %u^3 "
+      "bricks, not %u^3", _path, get32(_data + 20), file_chunk_bricks);
+  const uint32_t span = brick_size * file_chunk_bricks;
+  cw = (w + span - 1) / span;
+  ch = (h + span - 1) / span;
+  cd = (d + span - 1) / span;
+  assertf(get32(_data + 24) == chunk_count() && _size >= header_words * 4
+      + (uint64_t)chunk_count() * directory_entry_bytes, "the directory of "
+      "%s does not match its %ux%ux%u voxels", _path, w, h, d);
+  assertf(get32(_data + 28) == crc32(_data + header_words * 4
+        , chunk_count() * directory_entry_bytes), "the directory of %s is "
+      "corrupt", _path);
+  // chunks are decoded in about the order they are stored, from any number
+  // of threads
+  madvise(p, _size, MADV_WILLNEED);
+}
+
+world_file::~world_file() {
+  munmap((void*)_data, _size);
+}
+
+uint32_t world_file::chunk_count() const {
+  return cw * ch * cd;
+}
+
+uint64_t world_file::chunk_bytes(uint32_t chunk) const {
+  return get32(_data + header_words * 4 + chunk * directory_entry_bytes + 8);
+}
+
+void world_file::decode(uint32_t chunk, decoded_chunk &out) const {
+  const uint8_t *entry = _data + header_words * 4
+    + chunk * directory_entry_bytes;
+  const uint64_t offset = get64(entry), size = get32(entry + 8);
+  assertf(offset <= _size && size <= _size - offset && size > 0
+      && crc32(_data + offset, size) == get32(entry + 12), "chunk %u of %s "
+      "is corrupt", chunk, _path);
+  const uint8_t *p = _data + offset, *end = p + size;
+  const uint32_t palette_size = *p++ + 1;
+  assertf(p + palette_size <= end, "chunk %u of %s is truncated", chunk
+      , _path);
+  // indices past the end of the palette can only come from packed bricks,
+  // they read as 0 instead of being checked voxel by voxel
+  uint8_t palette[256] = {};
+  memcpy(palette, p, palette_size);
+  p += palette_size;
+  const uint32_t bits = index_bits(palette_size)
+    , packed_bytes = brick_voxels * bits / 8;
+  out.voxels.resize(file_chunk_brick_count * brick_voxels);
+  const uint32_t bw = (w + brick_size - 1) / brick_size
+    , bh = (h + brick_size - 1) / brick_size
+    , bd = (d + brick_size - 1) / brick_size;
+  for_chunk_bricks(chunk % cw, chunk / cw % ch, chunk / (cw * ch), bw, bh, bd
+      , [&](uint32_t i, uint32_t, uint32_t, uint32_t) {
+    assertf(p < end, "chunk %u of %s is truncated", chunk, _path);
+    const uint8_t tag = *p++;
+    out.uniform[i] = tag == brick_uniform;
+    uint8_t *v = &out.voxels[i * brick_voxels];
+    if (tag == brick_uniform) {
+      assertf(p < end && *p < palette_size, "chunk %u of %s is corrupt"
+          , chunk, _path);
+      out.value[i] = palette[*p++];
+    } else if (tag == brick_packed) {
+      assertf((uint64_t)(end - p) >= packed_bytes, "chunk %u of %s is truncated", chunk
+          , _path);
+      const uint32_t mask = (1u << bits) - 1;
+      for (const uint8_t *packed_end = p + packed_bytes; p < packed_end; p++)
+        for (uint32_t shift = 0; shift < 8; shift += bits)
+          *v++ = palette[*p >> shift & mask];
+    } else {
+      assertf(tag == brick_runs && end - p >= 2, "chunk %u of %s is corrupt"
+          , chunk, _path);
+      const uint32_t runs = (p[0] | p[1] << 8) + 1;
+      p += 2;
+      assertf((uint64_t)(end - p) >= runs * 2, "chunk %u of %s is truncated", chunk
+          , _path);
+      uint32_t j = 0;
+      for (uint32_t r = 0; r < runs; r++, p += 2) {
+        const uint32_t n = p[0] + 1;
+        assertf(j + n <= brick_voxels && p[1] < palette_size, "chunk %u of "
+            "%s is corrupt", chunk, _path);
+        memset(v + j, palette[p[1]], n);
+        j += n;
+      }
+      assertf(j == brick_voxels, "chunk %u of %s is corrupt", chunk, _path);
+    }
+  });
+}
+
+world *load_world(const char *path, thread_pool *pool, voxel_format format) {
+  world_file file(path);
+  world *w = new world(file.w, file.h, file.d, format);
+  const uint32_t chunks = file.chunk_count()
+    , batch = std::max(pool->size() * 16, 1);
+  std::vector<decoded_chunk> decoded(std::min(batch, chunks));
+  for (uint32_t first = 0; first < chunks; first += batch) {
+    const uint32_t n = std::min(batch, chunks - first);
+    pool->parallel_for(n, [&](size_t i, int) {
+      file.decode(first + i, decoded[i]);
+    });
+    for (uint32_t i = 0; i < n; i++) {
+      const uint32_t c = first + i;
+      for_chunk_bricks(c % file.cw, c / file.cw % file.ch
+          , c / (file.cw * file.ch), w->bw, w->bh, w->bd
+          , [&](uint32_t b, uint32_t bx, uint32_t by, uint32_t bz) {
+        if (decoded[i].uniform[b])
+          w->fill(box { bx * brick_size, by * brick_size, bz * brick_size
+              , (bx + 1) * brick_size, (by + 1) * brick_size
+              , (bz + 1) * brick_size }, decoded[i].value[b]);
+        else
+          w->set_brick(bx, by, bz, &decoded[i].voxels[b * brick_voxels]);
+      });
+    }
+  }
+  return w;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "world.hh"
+#include "thread_pool.hh"
+#include <vector>
+#include <cstdint>
+
+// worlds are saved as .vfk files, little endian throughout:
+//
+//   header     magic "VFKW", version, w, h, d, chunk_bricks, chunk count,
+//              crc32 of the directory, crc32 of the header before it
+//   directory  per chunk, x first: offset and size of its data, crc32 of it
+//   chunks     palette size - 1 and the palette, the values that occur in
+//              the chunk. then every brick of the chunk inside the world, x
+//              first, as a tag and its data:
+//                brick_uniform  palette index of its value
+//                brick_packed   palette indices of 1, 2, 4 or 8 bits, as
+//                               few as the palette allows, x first
+//                brick_runs     number of runs - 1 as 16 bits, then per run
+//                               its length - 1 and a palette index
+//
+// bricks take whichever of packed and runs is smaller. chunks are
+// independent of each other, so they can be checked and decoded on any
+// thread and in any order
+const uint32_t world_file_version = 1, file_chunk_bricks = 4
+  , file_chunk_brick_count = file_chunk_bricks * file_chunk_bricks
+    * file_chunk_bricks;
+
+// a chunk with its bricks decoded, in the same order as in the file. uniform
+// bricks only have their value set
+struct decoded_chunk {
+  bool uniform[file_chunk_brick_count];
+  uint8_t value[file_chunk_brick_count];
+  std::vector<uint8_t> voxels; // brick_voxels per brick
+};
+
+// a .vfk file mapped into memory. opening it only checks the header and the
+// directory, chunks are read when they are decoded
+class world_file {
+  const uint8_t *_data;
+  size_t _size;
+  const char *_path;
+public:
+  uint32_t w, h, d;
+  uint32_t cw, ch, cd; // dimensions in chunks
+  world_file(const char *n_path);
+  ~world_file();
+  uint32_t chunk_count() const;
+  uint64_t chunk_bytes(uint32_t chunk) const;
+  // verifies the chunk's checksum and decodes it. can be called from any
+  // number of threads at once
+  void decode(uint32_t chunk, decoded_chunk &out) const;
+};
+
+void save_world(const world *w, const char *path);
+// decodes the chunks on the pool, a batch at a time so that only a few of
+// them are held decoded at once, and copies them into a new world
+world *load_world(const char *path, thread_pool *pool
+    , voxel_format format = material_voxels);